@@ -7,29 +7,40 @@
  */
 
 #include <stdlib.h>
+#include <atomic>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <mutex>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <flashlight/flashlight.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "common/BlockingQueue.h"
 #include "common/Defines.h"
 #include "common/Dictionary.h"
 #include "common/Transforms.h"
 #include "common/Utils.h"
 #include "criterion/criterion.h"
 #include "data/Featurize.h"
+#include "decoder/CachedLM.h"
+#include "decoder/FlatTrie.h"
 #include "decoder/KenLM.h"
+#include "decoder/Lattice.h"
 #include "decoder/Trie.h"
 #include "module/module.h"
 #include "runtime/Data.h"
+#include "runtime/DecodeSweep.h"
+#include "runtime/EmissionFile.h"
 #include "runtime/Logger.h"
 #include "runtime/Serial.h"
+#include "runtime/TrieCache.h"
 
 #include "decoder/LexiconFreeDecoder.h"
 #include "decoder/TokenLMDecoder.h"
@@ -37,6 +48,126 @@
 
 using namespace w2l;
 
+namespace {
+
+/* Counters of a rescoring pass */
+struct RescoreMeters {
+  double time = 0; // Wall time of the pass
+  double sliceTime = 0; // Total time of the threads
+  int64_t nArcs = 0;
+};
+
+/**
+ * Second pass over the lattices, one sample at a time per thread: rescore
+ * them with `rescoreLm` and return the best words of each. As in the first
+ * pass, each thread owns an instance of the LM and memoizes its queries if
+ * required.
+ */
+std::vector<std::vector<std::string>> rescoreLattices(
+    std::vector<Lattice>& lattices,
+    const LMPtr& rescoreLm,
+    const Dictionary& wordDict,
+    RescoreMeters& meters) {
+  const int nSample = lattices.size();
+  std::vector<std::vector<std::string>> rescoredPredictions(nSample);
+  std::vector<double> sliceRescoreTime(FLAGS_nthread_rescore, 0);
+  std::vector<int64_t> sliceRescoreArcs(FLAGS_nthread_rescore, 0);
+  std::vector<int> rescoreLmIndices(wordDict.indexSize());
+  for (int i = 0; i < rescoreLmIndices.size(); i++) {
+    rescoreLmIndices[i] = rescoreLm->index(wordDict.getToken(i));
+  }
+  const float rescoreLmWeight = static_cast<float>(
+      FLAGS_rescore_lmweight < 0 ? FLAGS_lmweight : FLAGS_rescore_lmweight);
+  const int wordUnkIdx = wordDict.getIndex(kUnkToken);
+  std::atomic<int> nextLattice(0);
+
+  auto runRescorer = [&](int tid) {
+    try {
+      LMPtr threadLm = rescoreLm->clone();
+      if (FLAGS_lmcachesize > 0) {
+        threadLm = std::make_shared<CachedLM>(threadLm, FLAGS_lmcachesize);
+      }
+      fl::TimeMeter sliceTimer;
+      sliceTimer.resume();
+      for (int s = nextLattice++; s < nSample; s = nextLattice++) {
+        Lattice& lattice = lattices[s];
+        rescoreLattice(lattice, threadLm, rescoreLmIndices, rescoreLmWeight);
+        if (!lattice.ends_.empty()) {
+          rescoredPredictions[s] = wrdTensor2Words(
+              validateTensor(lattice.words(0), wordUnkIdx), wordDict);
+        }
+        sliceRescoreArcs[tid] += lattice.arcs_.size();
+      }
+      sliceTimer.stop();
+      sliceRescoreTime[tid] = sliceTimer.value();
+    } catch (const std::exception& exc) {
+      LOG(FATAL) << "Exception in rescoring thread " << tid << "\n"
+                 << exc.what();
+    }
+  };
+
+  auto rescoreTimer = fl::TimeMeter();
+  rescoreTimer.resume();
+  if (FLAGS_nthread_rescore == 1) {
+    runRescorer(0);
+  } else if (FLAGS_nthread_rescore > 1) {
+    fl::ThreadPool threadPool(FLAGS_nthread_rescore);
+    for (int i = 0; i < std::min(FLAGS_nthread_rescore, nSample); i++) {
+      threadPool.enqueue(runRescorer, i);
+    }
+  } else {
+    LOG(FATAL) << "Invalid nthread_rescore";
+  }
+  rescoreTimer.stop();
+
+  meters.time = rescoreTimer.value();
+  for (int i = 0; i < FLAGS_nthread_rescore; i++) {
+    meters.sliceTime += sliceRescoreTime[i];
+    meters.nArcs += sliceRescoreArcs[i];
+  }
+  return rescoredPredictions;
+}
+
+/**
+ * Summary of a rescoring pass, whose hypothesis are also saved to the sclite
+ * directory
+ */
+std::string rescoreReport(
+    const std::vector<std::vector<std::string>>& rescoredPredictions,
+    const std::vector<std::vector<std::string>>& wordTargets,
+    const std::vector<std::string>& sampleIds,
+    const RescoreMeters& meters) {
+  // Throughput of the second pass alone, the first pass is reported apart
+  const int nSample = rescoredPredictions.size();
+  fl::EditDistanceMeter werMeter;
+  for (int s = 0; s < nSample; s++) {
+    werMeter.add(rescoredPredictions[s], wordTargets[s]);
+  }
+  std::stringstream buffer;
+  buffer << "[Rescore with " << FLAGS_rescore_lm << " (" << nSample
+         << " samples, " << meters.nArcs << " arcs) in " << meters.time
+         << "s (actual rescoring time " << std::setprecision(3)
+         << meters.sliceTime / std::max(1, nSample) << "s/sample, "
+         << meters.nArcs / std::max(1e-9, meters.sliceTime)
+         << " arcs/s) -- WER: " << std::setprecision(6) << werMeter.value()[0]
+         << "]" << std::endl;
+  if (!FLAGS_sclite.empty()) {
+    auto rescorePath =
+        pathsConcat(FLAGS_sclite, cleanFilepath(FLAGS_test) + ".rescore.hyp");
+    std::ofstream rescoreStream(rescorePath);
+    if (!rescoreStream.is_open() || !rescoreStream.good()) {
+      LOG(FATAL) << "Error opening rescoring file: " << rescorePath;
+    }
+    for (int s = 0; s < nSample; s++) {
+      rescoreStream << join(" ", rescoredPredictions[s]) << " ("
+                    << sampleIds[s] << ")\n";
+    }
+  }
+  return buffer.str();
+}
+
+} // namespace
+
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::InstallFailureSignalHandler();
@@ -60,6 +191,79 @@ int main(int argc, char** argv) {
     gflags::ReadFromFlagsFile(flagsfile, argv[0], true);
   }
 
+  /* ===================== Rescore Saved Lattices ===================== */
+  // Without decoding: the lattices saved to --lattice_dir by a previous run
+  // are loaded with their references and rescored with --rescore_lm. The
+  // lexicon must be the one of that run, which gave the words their index.
+  if (FLAGS_rescore_only) {
+    if (FLAGS_lattice_dir.empty() || FLAGS_rescore_lm.empty() ||
+        FLAGS_lexicon.empty()) {
+      LOG(FATAL) << "[Rescore] --rescore_only needs --lattice_dir, "
+                 << "--rescore_lm and --lexicon";
+    }
+    auto wordDict = createWordDict(loadWords(FLAGS_lexicon, FLAGS_maxword));
+
+    auto latticePath =
+        pathsConcat(FLAGS_lattice_dir, cleanFilepath(FLAGS_test) + ".lat");
+    std::ifstream latticeStream(latticePath, std::ios::binary);
+    std::ifstream latticeRefStream(latticePath + ".ref");
+    if (!latticeStream.is_open() || !latticeRefStream.is_open()) {
+      LOG(FATAL) << "Error opening lattice file: " << latticePath;
+    }
+    std::vector<Lattice> lattices;
+    std::vector<std::vector<std::string>> wordTargets;
+    std::vector<std::string> sampleIds;
+    Lattice lattice;
+    std::string line;
+    while (loadLattice(latticeStream, lattice)) {
+      // <reference> (<sample id>)
+      if (!std::getline(latticeRefStream, line)) {
+        LOG(FATAL) << "[Rescore] Missing reference in " << latticePath
+                   << ".ref for lattice " << lattices.size();
+      }
+      auto idStart = line.rfind(" (");
+      if (idStart == std::string::npos || line.back() != ')') {
+        LOG(FATAL) << "[Rescore] Invalid reference: " << line;
+      }
+      std::istringstream refStream(line.substr(0, idStart));
+      std::vector<std::string> wordTarget;
+      std::string word;
+      while (refStream >> word) {
+        wordTarget.push_back(word);
+      }
+      lattices.push_back(std::move(lattice));
+      wordTargets.push_back(std::move(wordTarget));
+      sampleIds.push_back(
+          line.substr(idStart + 2, line.size() - idStart - 3));
+    }
+    const int nSample = FLAGS_maxload > 0
+        ? std::min<int>(lattices.size(), FLAGS_maxload)
+        : lattices.size();
+    lattices.resize(nSample);
+    LOG(INFO) << "[Rescore] " << nSample << " lattices loaded from "
+              << latticePath;
+
+    auto rescoreLm = std::make_shared<KenLM>(FLAGS_rescore_lm);
+    LOG(INFO) << "[Rescore] LM constructed.\n";
+    RescoreMeters rescoreMeters;
+    auto rescoredPredictions =
+        rescoreLattices(lattices, rescoreLm, wordDict, rescoreMeters);
+
+    auto report = rescoreReport(
+        rescoredPredictions, wordTargets, sampleIds, rescoreMeters);
+    LOG(INFO) << "------\n" << report;
+    if (!FLAGS_sclite.empty()) {
+      auto logPath =
+          pathsConcat(FLAGS_sclite, cleanFilepath(FLAGS_test) + ".rescore.log");
+      std::ofstream logStream(logPath);
+      if (!logStream.is_open() || !logStream.good()) {
+        LOG(FATAL) << "Error opening log file: " << logPath;
+      }
+      logStream << report;
+    }
+    return 0;
+  }
+
   /* ===================== Create Network ===================== */
   if (!(FLAGS_am.empty() ^ FLAGS_emission_dir.empty())) {
     LOG(FATAL)
@@ -90,13 +294,18 @@ int main(int argc, char** argv) {
     LOG(INFO) << "[Network] Updating flags from config file: " << FLAGS_am;
     gflags::ReadFlagsFromString(flags->second, gflags::GetArgv0(), true);
   }
-  /* Using existing emissions */
-  else {
-    std::string cleanedTestPath = cleanFilepath(FLAGS_test);
+  /* Using existing emissions, either loaded at once or memory-mapped */
+  std::shared_ptr<EmissionFile> emissionFile;
+  if (FLAGS_am.empty()) {
     std::string loadPath =
-        pathsConcat(FLAGS_emission_dir, cleanedTestPath + ".bin");
+        emissionPath(FLAGS_emission_dir, FLAGS_test, FLAGS_emission_format);
     LOG(INFO) << "[Serialization] Loading file: " << loadPath;
-    W2lSerializer::load(loadPath, emissionSet);
+    if (FLAGS_emission_format == "cereal") {
+      W2lSerializer::load(loadPath, emissionSet);
+    } else {
+      emissionFile = std::make_shared<EmissionFile>(loadPath);
+      emissionSet = emissionFile->metadata();
+    }
     gflags::ReadFlagsFromString(emissionSet.gflags, gflags::GetArgv0(), true);
   }
 
@@ -116,80 +325,165 @@ int main(int argc, char** argv) {
 
   Dictionary wordDict;
   LexiconMap lexicon;
+  TrieCacheKey trieCacheKey;
+  std::shared_ptr<TrieCache> trieCache;
   if (!FLAGS_lexicon.empty()) {
-    lexicon = loadWords(FLAGS_lexicon, FLAGS_maxword);
-    wordDict = createWordDict(lexicon);
+    if (!FLAGS_lexicon_cache.empty()) {
+      // The trie only depends on the LM through the word scores of "wrd"
+      trieCacheKey.lexicon = hashFile(FLAGS_lexicon);
+      trieCacheKey.lm = FLAGS_decodertype == "wrd"
+          ? hashFileStamped(FLAGS_lm, FLAGS_lexicon_cache + ".lmhash")
+          : 0;
+      trieCacheKey.tokens = hashDictionary(tokenDict);
+      trieCacheKey.options = hashString(
+          "decodertype=" + FLAGS_decodertype + ";smearing=" + FLAGS_smearing +
+          ";maxword=" + std::to_string(FLAGS_maxword) +
+          ";replabel=" + std::to_string(FLAGS_replabel));
+      trieCache = TrieCache::load(FLAGS_lexicon_cache, trieCacheKey);
+    }
+    // The lexicon is still needed to load a dataset with the acoustic model
+    if (trieCache && !FLAGS_emission_dir.empty()) {
+      wordDict = trieCache->wordDict();
+    } else {
+      lexicon = loadWords(FLAGS_lexicon, FLAGS_maxword);
+      wordDict = createWordDict(lexicon);
+    }
     LOG(INFO) << "Number of words: " << wordDict.indexSize();
   }
 
   DictionaryMap dicts = {{kTargetIdx, tokenDict}, {kWordIdx, wordDict}};
 
   /* ===================== Create Dataset ===================== */
+  // With an acoustic model, the forward pass runs in its own thread and hands
+  // the emissions over to the decoder threads through a bounded queue: the
+  // decoding overlaps with the forward pass, and only the emissions in the
+  // queue or being decoded are held in memory.
+  std::shared_ptr<W2lDataset> ds;
+  int nSample = 0;
   if (FLAGS_emission_dir.empty()) {
     // Load dataset
     int worldRank = 0;
     int worldSize = 1;
-    auto ds =
-        createDataset(FLAGS_test, dicts, lexicon, 1, worldRank, worldSize);
-
+    ds = createDataset(FLAGS_test, dicts, lexicon, 1, worldRank, worldSize);
     ds->shuffle(3);
-    LOG(INFO) << "[Serialization] Running forward pass ...";
-
-    int cnt = 0;
-    for (auto& sample : *ds) {
-      auto rawEmission =
-          network->forward({fl::input(sample[kInputIdx])}).front();
-      int N = rawEmission.dims(0);
-      int T = rawEmission.dims(1);
-
-      auto emission = afToVector<float>(rawEmission);
-      auto tokenTarget = afToVector<int>(sample[kTargetIdx]);
-      auto wordTarget = afToVector<int>(sample[kWordIdx]);
-
-      // TODO: we will reform the w2l dataset so that the loaded word targets
-      // are strings already
-      std::vector<std::string> wordTargetStr;
-      if (!FLAGS_lexicon.empty() && FLAGS_criterion != kSeq2SeqCriterion) {
-        wordTargetStr = wrdTensor2Words(wordTarget, wordDict);
-      } else {
-        auto letterTarget = tkn2Ltr(tokenTarget, tokenDict);
-        wordTargetStr = tknTensor2Words(letterTarget, tokenDict);
-      }
-
-      emissionSet.emissions.emplace_back(emission);
-      emissionSet.wordTargets.emplace_back(wordTargetStr);
-      emissionSet.tokenTargets.emplace_back(tokenTarget);
-      emissionSet.emissionT.emplace_back(T);
-      emissionSet.emissionN = N;
-
-      // while decoding we use batchsize 1 and hence ds only has 1 sampleid
-      emissionSet.sampleIds.emplace_back(
-          afToVector<std::string>(sample[kSampleIdx]).front());
 
-      ++cnt;
-      if (cnt == FLAGS_maxload) {
-        break;
-      }
-    }
+    nSample = ds->size();
+    nSample = FLAGS_maxload > 0 ? std::min(nSample, FLAGS_maxload) : nSample;
+    emissionSet.emissions.resize(nSample);
+    emissionSet.wordTargets.resize(nSample);
+    emissionSet.tokenTargets.resize(nSample);
+    emissionSet.emissionT.resize(nSample);
+    emissionSet.sampleIds.resize(nSample);
     if (FLAGS_criterion == kAsgCriterion) {
       emissionSet.transition = afToVector<float>(criterion->param(0).array());
     }
+  } else {
+    nSample = emissionSet.emissionT.size();
+    nSample = FLAGS_maxload > 0 ? std::min(nSample, FLAGS_maxload) : nSample;
   }
+  LOG(INFO) << "[Dataset] Number of samples: " << nSample;
+
+  BlockingQueue<int> emissionQueue(FLAGS_emission_queue_size);
+  // The ArrayFire device is per thread: the forward thread uses the one the
+  // network was loaded on
+  int afDevice = af::getDevice();
+  auto runForward = [&]() {
+    try {
+      af::setDevice(afDevice);
+      LOG(INFO) << "[Serialization] Running forward pass ...";
+      int cnt = 0;
+      for (auto& sample : *ds) {
+        if (cnt == nSample) {
+          break;
+        }
+        auto rawEmission =
+            network->forward({fl::input(sample[kInputIdx])}).front();
+        int N = rawEmission.dims(0);
+        int T = rawEmission.dims(1);
+
+        auto emission = afToVector<float>(rawEmission);
+        auto tokenTarget = afToVector<int>(sample[kTargetIdx]);
+        auto wordTarget = afToVector<int>(sample[kWordIdx]);
+
+        // TODO: we will reform the w2l dataset so that the loaded word targets
+        // are strings already
+        std::vector<std::string> wordTargetStr;
+        if (!FLAGS_lexicon.empty() && FLAGS_criterion != kSeq2SeqCriterion) {
+          wordTargetStr = wrdTensor2Words(wordTarget, wordDict);
+        } else {
+          auto letterTarget = tkn2Ltr(tokenTarget, tokenDict);
+          wordTargetStr = tknTensor2Words(letterTarget, tokenDict);
+        }
+
+        // Each sample gets its own slot, filled before it is queued
+        emissionSet.emissions[cnt] = std::move(emission);
+        emissionSet.wordTargets[cnt] = std::move(wordTargetStr);
+        emissionSet.tokenTargets[cnt] = std::move(tokenTarget);
+        emissionSet.emissionT[cnt] = T;
+        if (cnt == 0) {
+          emissionSet.emissionN = N;
+        }
 
-  int nSample = emissionSet.emissions.size();
-  nSample = FLAGS_maxload > 0 ? std::min(nSample, FLAGS_maxload) : nSample;
-  int nSamplePerThread =
-      std::ceil(nSample / static_cast<float>(FLAGS_nthread_decoder));
-  LOG(INFO) << "[Dataset] Number of samples per thread: " << nSamplePerThread;
+        // while decoding we use batchsize 1 and hence ds only has 1 sampleid
+        emissionSet.sampleIds[cnt] =
+            afToVector<std::string>(sample[kSampleIdx]).front();
+
+        emissionQueue.push(cnt);
+        ++cnt;
+      }
+      emissionQueue.close();
+    } catch (const std::exception& exc) {
+      LOG(FATAL) << "Exception in forward pass\n" << exc.what();
+    }
+  };
 
   /* ===================== Decode ===================== */
+  // Without an acoustic model, schedule the samples longest first. Each thread
+  // picks the next sample from a shared index, so that the threads finish at
+  // about the same time.
+  std::vector<int> sampleOrder;
+  if (!ds) {
+    sampleOrder.resize(nSample);
+    std::iota(sampleOrder.begin(), sampleOrder.end(), 0);
+    std::stable_sort(
+        sampleOrder.begin(), sampleOrder.end(), [&](int a, int b) {
+          return emissionSet.emissionT[a] > emissionSet.emissionT[b];
+        });
+  }
+  std::atomic<int> nextSample(0);
+  std::atomic<int> nDoneSamples(0);
+
+  // Sweep: decode each sample with every configuration of weights in a row.
+  // The configurations share the emissions, the trie and the LM, and those of
+  // a thread share its LM cache. The per-sample outputs (show, sclite) are
+  // only written without a sweep.
+  std::vector<SweepConfig> sweep;
+  if (!FLAGS_sweep.empty()) {
+    SweepConfig base{
+        FLAGS_lmweight, FLAGS_wordscore, FLAGS_silweight, FLAGS_unkweight};
+    sweep = sweepConfigs(FLAGS_sweep, base, FLAGS_sweep_random, FLAGS_seed);
+    LOG(INFO) << "[Sweep] Decoding with " << sweep.size()
+              << " configurations";
+  }
+  const int nConfigs = sweep.empty() ? 1 : sweep.size();
+
+  // Predictions are kept per configuration and sample, and WER/LER are
+  // computed in sample order at the end, independently of the scheduling
+  std::vector<std::vector<std::vector<std::string>>> wordPredictions(
+      nConfigs, std::vector<std::vector<std::string>>(nSample));
+  std::vector<std::vector<std::vector<int>>> letterPredictions(
+      nConfigs, std::vector<std::vector<int>>(nSample));
+  std::vector<std::vector<int>> letterTargets(nSample);
+
   // Prepare counters
-  std::vector<double> sliceWer(FLAGS_nthread_decoder);
-  std::vector<double> sliceLer(FLAGS_nthread_decoder);
-  std::vector<int> sliceNumWords(FLAGS_nthread_decoder, 0);
-  std::vector<int> sliceNumTokens(FLAGS_nthread_decoder, 0);
   std::vector<int> sliceNumSamples(FLAGS_nthread_decoder, 0);
   std::vector<double> sliceTime(FLAGS_nthread_decoder, 0);
+  std::vector<int64_t> sliceLmHits(FLAGS_nthread_decoder, 0);
+  std::vector<int64_t> sliceLmMisses(FLAGS_nthread_decoder, 0);
+  std::vector<int> sliceNumChunks(FLAGS_nthread_decoder, 0);
+  std::vector<double> sliceChunkLatency(FLAGS_nthread_decoder, 0);
+  std::vector<double> sliceMaxChunkLatency(FLAGS_nthread_decoder, 0);
+  std::vector<DecoderStats> sliceDecoderStats(FLAGS_nthread_decoder);
 
   // Prepare criterion
   CriterionType criterionType = CriterionType::ASG;
@@ -211,6 +505,38 @@ int main(int argc, char** argv) {
       FLAGS_logadd,
       static_cast<float>(FLAGS_silweight),
       criterionType);
+  decoderOpt.hashMerge_ = FLAGS_hashmerge;
+  decoderOpt.histogramPruning_ = FLAGS_histogrampruning;
+  decoderOpt.maxCandidates_ = FLAGS_maxcandidates;
+  decoderOpt.blankSkipThreshold_ = static_cast<float>(FLAGS_blankskip);
+  decoderOpt.tokenTopK_ = FLAGS_tokentopk;
+  decoderOpt.tokenThreshold_ = static_cast<float>(FLAGS_tokenthreshold);
+  decoderOpt.nThreads_ = FLAGS_nthread_beam;
+  decoderOpt.maxBufferFrames_ = FLAGS_maxbufferframes;
+  decoderOpt.pruneLookBack_ = FLAGS_streamlookback;
+
+  // Rescoring: the first pass keeps the lattice of each sample, which is
+  // rescored with the rescoring LM once all the samples are decoded, and/or
+  // saved to --lattice_dir
+  const bool rescore = !FLAGS_rescore_lm.empty();
+  const bool keepLattices = rescore || !FLAGS_lattice_dir.empty();
+  if (keepLattices) {
+    if (FLAGS_lexicon.empty()) {
+      LOG(FATAL) << "[Rescore] Lattices need a lexicon decoder (--lexicon)";
+    }
+    if (!sweep.empty()) {
+      LOG(FATAL) << "[Rescore] Lattices can't be kept with --sweep";
+    }
+    decoderOpt.lattice_ = true;
+  }
+  std::vector<Lattice> lattices(keepLattices ? nSample : 0);
+  std::vector<DecoderOptions> configOpts(nConfigs, decoderOpt);
+  for (int c = 0; c < sweep.size(); c++) {
+    configOpts[c].lmWeight_ = static_cast<float>(sweep[c].lmweight);
+    configOpts[c].wordScore_ = static_cast<float>(sweep[c].wordscore);
+    configOpts[c].silWeight_ = static_cast<float>(sweep[c].silweight);
+    configOpts[c].unkScore_ = static_cast<float>(sweep[c].unkweight);
+  }
 
   // Prepare log writer
   std::mutex hypMutex, refMutex, logMutex;
@@ -259,6 +585,12 @@ int main(int argc, char** argv) {
   }
   LOG(INFO) << "[Decoder] LM constructed.\n";
 
+  std::shared_ptr<LM> rescoreLm;
+  if (rescore) {
+    rescoreLm = std::make_shared<KenLM>(FLAGS_rescore_lm);
+    LOG(INFO) << "[Rescore] LM constructed.\n";
+  }
+
   // Build Trie
   if (std::strlen(kSilToken) != 1) {
     LOG(FATAL) << "[Decoder] Invalid unknown_symbol: " << kSilToken;
@@ -273,10 +605,20 @@ int main(int argc, char** argv) {
   std::shared_ptr<TrieLabel> unk = nullptr;
 
   std::shared_ptr<Trie> trie = nullptr;
-  if (!FLAGS_lexicon.empty()) {
+  FlatTriePtr flatTrie = nullptr;
+  if (trieCache) {
+    flatTrie = trieCache->trie();
+    unk = std::make_shared<TrieLabel>(unkIdx, wordDict.getIndex(kUnkToken));
+    LOG(INFO) << "[Decoder] Trie mapped from " << FLAGS_lexicon_cache << ": "
+              << flatTrie->getNumNodes() << " nodes.\n";
+  } else if (!FLAGS_lexicon.empty()) {
     trie = std::make_shared<Trie>(tokenDict.indexSize(), silIdx);
     auto start_state = lm->start(false);
 
+    // Gather the spellings, then build the subtries in parallel
+    std::vector<std::vector<int>> spellings;
+    std::vector<TrieLabelPtr> labels;
+    std::vector<float> scores;
     for (auto& it : lexicon) {
       const std::string& word = it.first;
       int lmIdx = -1;
@@ -285,14 +627,14 @@ int main(int argc, char** argv) {
         lmIdx = lm->index(word);
         auto dummyState = lm->score(start_state, lmIdx, score);
       }
+      auto label = std::make_shared<TrieLabel>(lmIdx, wordDict.getIndex(word));
       for (auto& tokens : it.second) {
-        auto tokensTensor = tokens2Tensor(tokens, tokenDict);
-        trie->insert(
-            tokensTensor,
-            std::make_shared<TrieLabel>(lmIdx, wordDict.getIndex(word)),
-            score);
+        spellings.push_back(tokens2Tensor(tokens, tokenDict));
+        labels.push_back(label);
+        scores.push_back(score);
       }
     }
+    trie->insert(spellings, labels, scores, FLAGS_nthread_decoder);
     unk = std::make_shared<TrieLabel>(unkIdx, wordDict.getIndex(kUnkToken));
     LOG(INFO) << "[Decoder] Trie planted.\n";
 
@@ -305,19 +647,78 @@ int main(int argc, char** argv) {
     } else if (FLAGS_smearing != "none") {
       LOG(FATAL) << "[Decoder] Invalid smearing mode: " << FLAGS_smearing;
     }
-    trie->smear(smear_mode);
+    trie->smear(smear_mode, FLAGS_nthread_decoder);
     LOG(INFO) << "[Decoder] Trie smeared.\n";
+
+    // Freeze into the flat layout walked by the decoders
+    flatTrie = std::make_shared<FlatTrie>(trie);
+    trie.reset();
+    LOG(INFO) << "[Decoder] Trie flattened: " << flatTrie->getNumNodes()
+              << " nodes.\n";
+
+    if (!FLAGS_lexicon_cache.empty()) {
+      saveTrieCache(FLAGS_lexicon_cache, trieCacheKey, *flatTrie, wordDict);
+      LOG(INFO) << "[Decoder] Trie cached to " << FLAGS_lexicon_cache;
+    }
   }
 
+  // Streaming: feed the emissions in chunks and prune after each of them.
+  // The frames dropped by pruning are committed with the best path leading to
+  // them, so that only the last few frames of the beam are kept in memory.
+  auto decodeStream =
+      [&](Decoder* decoder, const EmissionMatrix& emission, int tid) {
+        const int T = emission.T_;
+        DecodeResult result;
+        fl::TimeMeter chunkTimer;
+        decoder->decodeBegin();
+        for (int t = 0; t < T; t += FLAGS_streamchunk) {
+          int nFrames = std::min(FLAGS_streamchunk, T - t);
+
+          // Latency of the partial result once a chunk is available
+          chunkTimer.reset();
+          chunkTimer.resume();
+          decoder->decodeStep(emission.frames(t, nFrames));
+          auto partial = decoder->getBestHypothesis(FLAGS_streamlookback);
+          chunkTimer.stop();
+          double latency = chunkTimer.value();
+          sliceNumChunks[tid]++;
+          sliceChunkLatency[tid] += latency;
+          sliceMaxChunkLatency[tid] =
+              std::max(sliceMaxChunkLatency[tid], latency);
+
+          // Prune, and commit the dropped frames of the partial result
+          decoder->pruneAndCommit(FLAGS_streamlookback, partial, result);
+        }
+        decoder->decodeEnd();
+
+        auto finalResults = decoder->getAllFinalHypothesis();
+        if (!finalResults.empty()) {
+          auto& best = finalResults[0];
+          result.score_ = best.score_;
+          result.words_.insert(
+              result.words_.end(), best.words_.begin(), best.words_.end());
+          result.tokens_.insert(
+              result.tokens_.end(), best.tokens_.begin(), best.tokens_.end());
+        }
+        return result;
+      };
+
   // Decoding
-  auto runDecoder = [&](int tid, int start, int end) {
+  auto runDecoder = [&](int tid) {
     try {
-      // Build Decoder
+      // Build Decoder, each thread owns an LM instance (and its state pool)
+      // sharing the loaded model, and memoizing its queries if required
       std::unique_ptr<Decoder> decoder;
+      LMPtr threadLm = lm->clone();
+      CachedLMPtr cachedLm = nullptr;
+      if (FLAGS_lmcachesize > 0) {
+        cachedLm = std::make_shared<CachedLM>(threadLm, FLAGS_lmcachesize);
+        threadLm = cachedLm;
+      }
 
       if (FLAGS_decodertype == "wrd") {
         decoder = std::make_unique<WordLMDecoder>(
-            decoderOpt, trie, lm, silIdx, blankIdx, unk, transition);
+            decoderOpt, flatTrie, threadLm, silIdx, blankIdx, unk, transition);
         LOG(INFO) << "[Decoder] Decoder with word-LM loaded in thread: " << tid;
       } else if (FLAGS_decodertype == "tkn") {
         std::unordered_map<int, int> lmIndMap;
@@ -329,8 +730,8 @@ int main(int argc, char** argv) {
         if (!FLAGS_lexicon.empty()) {
           decoder = std::make_unique<TokenLMDecoder>(
               decoderOpt,
-              trie,
-              lm,
+              flatTrie,
+              threadLm,
               silIdx,
               blankIdx,
               unk,
@@ -340,7 +741,7 @@ int main(int argc, char** argv) {
                     << tid;
         } else {
           decoder = std::make_unique<LexiconFreeDecoder>(
-              decoderOpt, lm, silIdx, blankIdx, transition, lmIndMap);
+              decoderOpt, threadLm, silIdx, blankIdx, transition, lmIndMap);
           LOG(INFO) << "[Decoder] Decoder with token-LM loaded in thread: "
                     << tid;
         }
@@ -350,83 +751,129 @@ int main(int argc, char** argv) {
 
       // Get data and run decoder
       TestMeters meters;
-      int sliceSize = end - start;
       meters.timer.resume();
-      for (int s = start; s < end; s++) {
-        auto emission = emissionSet.emissions[s];
+      auto fetchSample = [&](int& s) {
+        if (ds) {
+          return emissionQueue.pop(s);
+        }
+        int i = nextSample++;
+        if (i >= nSample) {
+          return false;
+        }
+        s = sampleOrder[i];
+        return true;
+      };
+      int s;
+      while (fetchSample(s)) {
         auto wordTarget = emissionSet.wordTargets[s];
         auto tokenTarget = emissionSet.tokenTargets[s];
         auto sampleId = emissionSet.sampleIds[s];
         auto T = emissionSet.emissionT[s];
         auto N = emissionSet.emissionN;
 
-        // DecodeResult
-        auto results = decoder->decode(emission.data(), T, N);
-
-        // Cleanup predictions
-        auto& rawWordPrediction = results[0].words_;
-        auto& rawTokenPrediction = results[0].tokens_;
+        // Emissions are read in place, possibly quantized
+        EmissionMatrix emission = emissionFile
+            ? emissionFile->emission(s)
+            : EmissionMatrix(emissionSet.emissions[s].data(), T, N);
 
         auto letterTarget = tkn2Ltr(tokenTarget, tokenDict);
-        auto letterPrediction = tkn2Ltr(rawTokenPrediction, tokenDict);
-        std::vector<std::string> wordPrediction;
-        if (!FLAGS_lexicon.empty() && FLAGS_criterion != kSeq2SeqCriterion) {
-          rawWordPrediction =
-              validateTensor(rawWordPrediction, wordDict.getIndex(kUnkToken));
-          wordPrediction = wrdTensor2Words(rawWordPrediction, wordDict);
-        } else {
-          wordPrediction = tknTensor2Words(letterPrediction, tokenDict);
-        }
+        for (int c = 0; c < nConfigs; c++) {
+          if (!sweep.empty()) {
+            decoder->setOptions(configOpts[c]);
+          }
 
-        // Update meters & print out predictions
-        meters.werSlice.add(wordPrediction, wordTarget);
-        meters.lerSlice.add(letterPrediction, letterTarget);
-
-        if (FLAGS_show) {
-          meters.wer.reset();
-          meters.ler.reset();
-          meters.wer.add(wordPrediction, wordTarget);
-          meters.ler.add(letterPrediction, letterTarget);
-
-          auto wordTargetStr = join(" ", wordTarget);
-          auto wordPredictionStr = join(" ", wordPrediction);
-
-          std::stringstream buffer;
-          buffer << "|T|: " << wordTargetStr << std::endl;
-          buffer << "|P|: " << wordPredictionStr << std::endl;
-          if (FLAGS_showletters) {
-            buffer << "|t|: " << tensor2String(letterTarget, tokenDict)
-                   << std::endl;
-            buffer << "|p|: " << tensor2String(letterPrediction, tokenDict)
-                   << std::endl;
+          // DecodeResult
+          std::vector<DecodeResult> results;
+          if (FLAGS_streamchunk > 0) {
+            results.push_back(decodeStream(decoder.get(), emission, tid));
+          } else {
+            results = decoder->decode(emission);
           }
-          buffer << "[sample: " << sampleId
-                 << ", WER: " << meters.wer.value()[0]
-                 << "\%, LER: " << meters.ler.value()[0]
-                 << "\%, slice WER: " << meters.werSlice.value()[0]
-                 << "\%, slice LER: " << meters.lerSlice.value()[0]
-                 << "\%, progress: "
-                 << static_cast<float>(s - start + 1) / sliceSize * 100 << "\%]"
-                 << std::endl;
-
-          std::cout << buffer.str();
-          if (!FLAGS_sclite.empty()) {
-            std::string suffix = "(" + sampleId + ")\n";
-            writeHyp(wordPredictionStr + suffix);
-            writeRef(wordTargetStr + suffix);
-            writeLog(buffer.str());
+
+          // Cleanup predictions
+          auto& rawWordPrediction = results[0].words_;
+          auto& rawTokenPrediction = results[0].tokens_;
+
+          auto letterPrediction = tkn2Ltr(rawTokenPrediction, tokenDict);
+          std::vector<std::string> wordPrediction;
+          if (!FLAGS_lexicon.empty() && FLAGS_criterion != kSeq2SeqCriterion) {
+            rawWordPrediction =
+                validateTensor(rawWordPrediction, wordDict.getIndex(kUnkToken));
+            wordPrediction = wrdTensor2Words(rawWordPrediction, wordDict);
+          } else {
+            wordPrediction = tknTensor2Words(letterPrediction, tokenDict);
+          }
+
+          // Update meters & print out predictions
+          meters.werSlice.add(wordPrediction, wordTarget);
+          meters.lerSlice.add(letterPrediction, letterTarget);
+
+          if (FLAGS_show && sweep.empty()) {
+            meters.wer.reset();
+            meters.ler.reset();
+            meters.wer.add(wordPrediction, wordTarget);
+            meters.ler.add(letterPrediction, letterTarget);
+
+            auto wordTargetStr = join(" ", wordTarget);
+            auto wordPredictionStr = join(" ", wordPrediction);
+
+            std::stringstream buffer;
+            buffer << "|T|: " << wordTargetStr << std::endl;
+            buffer << "|P|: " << wordPredictionStr << std::endl;
+            if (FLAGS_showletters) {
+              buffer << "|t|: " << tensor2String(letterTarget, tokenDict)
+                     << std::endl;
+              buffer << "|p|: " << tensor2String(letterPrediction, tokenDict)
+                     << std::endl;
+            }
+            buffer << "[sample: " << sampleId
+                   << ", WER: " << meters.wer.value()[0]
+                   << "\%, LER: " << meters.ler.value()[0]
+                   << "\%, slice WER: " << meters.werSlice.value()[0]
+                   << "\%, slice LER: " << meters.lerSlice.value()[0]
+                   << "\%, progress: "
+                   << static_cast<float>(nDoneSamples + 1) / nSample * 100
+                   << "\%]" << std::endl;
+
+            std::cout << buffer.str();
+            if (!FLAGS_sclite.empty()) {
+              std::string suffix = "(" + sampleId + ")\n";
+              writeHyp(wordPredictionStr + suffix);
+              writeRef(wordTargetStr + suffix);
+              writeLog(buffer.str());
+            }
+          }
+          const DecoderStats& decoderStats = decoder->getStats();
+          sliceDecoderStats[tid] += decoderStats;
+          if (W2L_DECODER_STATS && !FLAGS_sclite.empty() && sweep.empty()) {
+            writeLog(
+                "[sample: " + sampleId +
+                ", decoder stats: " + decoderStats.toString() + "]\n");
+          }
+
+          wordPredictions[c][s] = std::move(wordPrediction);
+          letterPredictions[c][s] = std::move(letterPrediction);
+          if (keepLattices) {
+            lattices[s] =
+                static_cast<LexiconDecoder*>(decoder.get())->getLattice();
           }
         }
 
         // Update conters
-        sliceNumWords[tid] += wordTarget.size();
-        sliceNumTokens[tid] += tokenTarget.size();
+        letterTargets[s] = std::move(letterTarget);
+        if (ds) {
+          // Done with this emission, which came from the forward pass
+          std::vector<float>().swap(emissionSet.emissions[s]);
+        }
+        sliceNumSamples[tid]++;
+        nDoneSamples++;
       }
       meters.timer.stop();
-      sliceWer[tid] = meters.werSlice.value()[0];
-      sliceLer[tid] = meters.lerSlice.value()[0];
-      sliceNumSamples[tid] = sliceSize;
       sliceTime[tid] = meters.timer.value();
+      if (cachedLm) {
+        sliceLmHits[tid] = cachedLm->nHits();
+        sliceLmMisses[tid] = cachedLm->nMisses();
+      }
     } catch (const std::exception& exc) {
       LOG(FATAL) << "Exception in thread " << tid << "\n" << exc.what();
     }
@@ -435,16 +882,11 @@ int main(int argc, char** argv) {
   /* Spread threades */
   auto startThreads = [&]() {
     if (FLAGS_nthread_decoder == 1) {
-      runDecoder(0, 0, nSample);
+      runDecoder(0);
     } else if (FLAGS_nthread_decoder > 1) {
       fl::ThreadPool threadPool(FLAGS_nthread_decoder);
-      for (int i = 0; i < FLAGS_nthread_decoder; i++) {
-        int start = i * nSamplePerThread;
-        if (start >= nSample) {
-          break;
-        }
-        int end = std::min((i + 1) * nSamplePerThread, nSample);
-        threadPool.enqueue(runDecoder, i, start, end);
+      for (int i = 0; i < std::min(FLAGS_nthread_decoder, nSample); i++) {
+        threadPool.enqueue(runDecoder, i);
       }
     } else {
       LOG(FATAL) << "Invalid nthread_decoder";
@@ -452,20 +894,67 @@ int main(int argc, char** argv) {
   };
   auto timer = fl::TimeMeter();
   timer.resume();
+  std::thread forwardThread;
+  if (ds) {
+    forwardThread = std::thread(runForward);
+  }
   startThreads();
+  if (forwardThread.joinable()) {
+    forwardThread.join();
+  }
   timer.stop();
 
+  /* ===================== Save Lattices ===================== */
+  // The lattices are saved in sample order, before they are rescored, and
+  // the sample ids and references are saved alongside as in the sclite files
+  if (!FLAGS_lattice_dir.empty()) {
+    auto latticePath =
+        pathsConcat(FLAGS_lattice_dir, cleanFilepath(FLAGS_test) + ".lat");
+    std::ofstream latticeStream(latticePath, std::ios::binary);
+    std::ofstream latticeRefStream(latticePath + ".ref");
+    if (!latticeStream.is_open() || !latticeStream.good()) {
+      LOG(FATAL) << "Error opening lattice file: " << latticePath;
+    }
+    if (!latticeRefStream.is_open() || !latticeRefStream.good()) {
+      LOG(FATAL) << "Error opening lattice file: " << latticePath << ".ref";
+    }
+    for (int s = 0; s < nSample; s++) {
+      saveLattice(latticeStream, lattices[s]);
+      latticeRefStream << join(" ", emissionSet.wordTargets[s]) << " ("
+                       << emissionSet.sampleIds[s] << ")\n";
+    }
+    LOG(INFO) << "[Rescore] " << nSample << " lattices saved to "
+              << latticePath;
+  }
+
+  /* ===================== Rescore ===================== */
+  std::vector<std::vector<std::string>> rescoredPredictions;
+  RescoreMeters rescoreMeters;
+  if (rescore) {
+    rescoredPredictions =
+        rescoreLattices(lattices, rescoreLm, wordDict, rescoreMeters);
+  }
+
   /* Compute statistics */
-  int totalTokens = 0, totalWords = 0, totalSamples = 0;
-  for (int i = 0; i < FLAGS_nthread_decoder; i++) {
-    totalTokens += sliceNumTokens[i];
-    totalWords += sliceNumWords[i];
-    totalSamples += sliceNumSamples[i];
+  std::vector<double> configWer(nConfigs), configLer(nConfigs);
+  int bestConfig = 0;
+  for (int c = 0; c < nConfigs; c++) {
+    fl::EditDistanceMeter werMeter, lerMeter;
+    for (int s = 0; s < nSample; s++) {
+      werMeter.add(wordPredictions[c][s], emissionSet.wordTargets[s]);
+      lerMeter.add(letterPredictions[c][s], letterTargets[s]);
+    }
+    configWer[c] = werMeter.value()[0];
+    configLer[c] = lerMeter.value()[0];
+    if (configWer[c] < configWer[bestConfig]) {
+      bestConfig = c;
+    }
   }
-  double totalWer = 0, totalLer = 0, totalTime = 0;
+  double totalWer = configWer[bestConfig], totalLer = configLer[bestConfig];
+  int totalSamples = 0;
+  double totalTime = 0;
   for (int i = 0; i < FLAGS_nthread_decoder; i++) {
-    totalWer += sliceWer[i] * sliceNumWords[i] / totalWords;
-    totalLer += sliceLer[i] * sliceNumTokens[i] / totalTokens;
+    totalSamples += sliceNumSamples[i];
     totalTime += sliceTime[i];
   }
 
@@ -476,6 +965,73 @@ int main(int argc, char** argv) {
          << totalTime / totalSamples
          << "s/sample) -- WER: " << std::setprecision(6) << totalWer
          << ", LER: " << totalLer << "]" << std::endl;
+  if (!sweep.empty()) {
+    // One line per configuration, the best one is reported above
+    std::stringstream table;
+    table << "lmweight\twordscore\tsilweight\tunkweight\tWER\tLER\n";
+    for (int c = 0; c < nConfigs; c++) {
+      table << sweep[c].lmweight << "\t" << sweep[c].wordscore << "\t"
+            << sweep[c].silweight << "\t" << sweep[c].unkweight << "\t"
+            << configWer[c] << "\t" << configLer[c] << "\n";
+    }
+    buffer << "[Sweep of " << nConfigs << " configurations ("
+           << std::setprecision(3) << totalTime / totalSamples / nConfigs
+           << "s/sample each) -- best: " << std::setprecision(6)
+           << sweep[bestConfig].toString() << "]" << std::endl
+           << table.str();
+    if (!FLAGS_sclite.empty()) {
+      auto sweepPath =
+          pathsConcat(FLAGS_sclite, cleanFilepath(FLAGS_test) + ".sweep");
+      std::ofstream sweepStream(sweepPath);
+      if (!sweepStream.is_open() || !sweepStream.good()) {
+        LOG(FATAL) << "Error opening sweep file: " << sweepPath;
+      }
+      sweepStream << table.str();
+    }
+  }
+  if (rescore) {
+    buffer << rescoreReport(
+        rescoredPredictions,
+        emissionSet.wordTargets,
+        emissionSet.sampleIds,
+        rescoreMeters);
+  }
+  if (FLAGS_streamchunk > 0) {
+    int totalChunks = 0;
+    double totalChunkLatency = 0, maxChunkLatency = 0;
+    for (int i = 0; i < FLAGS_nthread_decoder; i++) {
+      totalChunks += sliceNumChunks[i];
+      totalChunkLatency += sliceChunkLatency[i];
+      maxChunkLatency = std::max(maxChunkLatency, sliceMaxChunkLatency[i]);
+    }
+    buffer << "[Streaming " << totalChunks << " chunks of "
+           << FLAGS_streamchunk << " frames -- partial result latency: "
+           << 1000 * totalChunkLatency / std::max(1, totalChunks)
+           << "ms/chunk on average, " << 1000 * maxChunkLatency << "ms max]"
+           << std::endl;
+  }
+  if (FLAGS_lmcachesize > 0) {
+    int64_t totalLmHits = 0, totalLmMisses = 0;
+    for (int i = 0; i < FLAGS_nthread_decoder; i++) {
+      totalLmHits += sliceLmHits[i];
+      totalLmMisses += sliceLmMisses[i];
+    }
+    int64_t totalLmQueries = std::max<int64_t>(1, totalLmHits + totalLmMisses);
+    buffer << "[LM cache: " << totalLmHits << " hits, " << totalLmMisses
+           << " misses, hit rate " << 100.0 * totalLmHits / totalLmQueries
+           << "\%]" << std::endl;
+  }
+  DecoderStats totalDecoderStats;
+  for (int i = 0; i < FLAGS_nthread_decoder; i++) {
+    totalDecoderStats += sliceDecoderStats[i];
+  }
+  if (W2L_DECODER_STATS) {
+    buffer << "[Decoder stats -- " << totalDecoderStats.toString() << "]"
+           << std::endl;
+  } else if (FLAGS_blankskip > 0) {
+    buffer << "[Blank frames skipped: " << totalDecoderStats.nBlankFrames_
+           << "]" << std::endl;
+  }
   LOG(INFO) << buffer.str();
   if (!FLAGS_sclite.empty()) {
     writeLog(buffer.str());
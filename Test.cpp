@@ -22,6 +22,7 @@
 #include "criterion/criterion.h"
 #include "module/module.h"
 #include "runtime/Data.h"
+#include "runtime/EmissionFile.h"
 #include "runtime/Logger.h"
 #include "runtime/Serial.h"
 
@@ -110,6 +111,17 @@ int main(int argc, char** argv) {
   /* ===================== Test ===================== */
   TestMeters meters;
 
+  // Emissions are either written to an emission file as they are computed,
+  // or kept in an EmissionSet serialized at the end
+  std::string savePath =
+      emissionPath(FLAGS_emission_dir, FLAGS_test, FLAGS_emission_format);
+  std::unique_ptr<EmissionFileWriter> emissionWriter;
+  if (FLAGS_emission_format != "cereal") {
+    LOG(INFO) << "[Serialization] Writing into file: " << savePath;
+    emissionWriter = std::make_unique<EmissionFileWriter>(
+        savePath, emissionType(FLAGS_emission_format));
+  }
+
   EmissionSet emissionSet;
   meters.timer.resume();
   int cnt = 1;
@@ -165,6 +177,11 @@ int main(int argc, char** argv) {
     /* Save emission and targets */
     int N = rawEmission.dims(0);
     int T = rawEmission.dims(1);
+    if (emissionWriter) {
+      emissionWriter->add(
+          emission, T, N, wordTargetStr, tokenTarget, sampleId);
+      continue;
+    }
     emissionSet.emissions.emplace_back(emission);
     emissionSet.tokenTargets.emplace_back(tokenTarget);
     emissionSet.wordTargets.emplace_back(wordTargetStr);
@@ -187,11 +204,12 @@ int main(int argc, char** argv) {
             << "\%, time: " << meters.timer.value() << "s]" << std::endl;
 
   /* ====== Serialize emission and targets for decoding ====== */
-  std::string cleanedTestPath = cleanFilepath(FLAGS_test);
-  std::string savePath =
-      pathsConcat(FLAGS_emission_dir, cleanedTestPath + ".bin");
-  LOG(INFO) << "[Serialization] Saving into file: " << savePath;
-  W2lSerializer::save(savePath, emissionSet);
+  if (emissionWriter) {
+    emissionWriter->close(emissionSet.transition, emissionSet.gflags);
+  } else {
+    LOG(INFO) << "[Serialization] Saving into file: " << savePath;
+    W2lSerializer::save(savePath, emissionSet);
+  }
 
   return 0;
 }
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace w2l {
+
+/**
+ * BlockingQueue is a bounded first-in first-out queue to hand items over from
+ * producer threads to consumer threads. push() blocks while the queue is full
+ * and pop() blocks while it is empty, so that the producers never run more
+ * than `capacity` items ahead of the consumers.
+ */
+template <class T>
+class BlockingQueue {
+ public:
+  explicit BlockingQueue(int capacity) : capacity_(capacity), closed_(false) {}
+
+  /* Add an item, waiting for some room. Returns false if the queue is closed */
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(
+        lock, [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Take the oldest item, waiting for one. Returns false once the queue is
+   * closed and all of its items have been taken.
+   */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  /* Signal that no more items will be pushed, and wake up all the waiters */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notEmpty_.notify_all();
+    notFull_.notify_all();
+  }
+
+ private:
+  int capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+};
+
+} // namespace w2l
@@ -140,11 +140,71 @@ DEFINE_int64(encoderdim, 0, "Dimension of encoded hidden state.");
 DEFINE_bool(show, false, "show predictions");
 DEFINE_bool(showletters, false, "show letter predictions");
 DEFINE_bool(logadd, false, "use logadd when merging decoder nodes");
+DEFINE_bool(hashmerge, false, "merge decoder nodes with a hash table");
+DEFINE_bool(
+    histogrampruning,
+    false,
+    "select the decoder beam with a score histogram instead of a partial sort");
+DEFINE_int32(
+    maxcandidates,
+    0,
+    "tighten the beam threshold when a frame has more decoder candidates "
+    "(0 for no limit)");
+DEFINE_double(
+    blankskip,
+    0.0,
+    "CTC frames with a blank posterior above this threshold only extend the "
+    "decoder beam with blank or the same token (0 to disable)");
+DEFINE_int32(
+    tokentopk,
+    0,
+    "decoders only expand to the k best tokens of each frame (0 for all)");
+DEFINE_double(
+    tokenthreshold,
+    0.0,
+    "decoders only expand to the tokens within this threshold of the best "
+    "token of each frame (0 for all)");
+DEFINE_int32(
+    nthread_beam,
+    1,
+    "threads expanding the beam of each utterance in the wrd and tkn "
+    "decoders, e.g. for one live stream (1 to expand it serially)");
+DEFINE_int32(
+    emission_queue_size,
+    16,
+    "max number of emissions computed ahead of the decoder threads");
+DEFINE_int32(
+    streamchunk,
+    0,
+    "stream emissions to the decoder in chunks of this many frames, "
+    "0 to decode each sample at once");
+DEFINE_int32(
+    streamlookback,
+    20,
+    "number of most recent frames kept unpruned while streaming, or when "
+    "pruning with --maxbufferframes");
+DEFINE_int32(
+    maxbufferframes,
+    0,
+    "decoders prune each sample back to streamlookback frames whenever they "
+    "hold more frames, so that long samples are decoded in bounded memory "
+    "(0 to keep all the frames)");
 
 DEFINE_string(smearing, "none", "none, max or logadd");
 DEFINE_string(lmtype, "kenlm", "kenlm, cnnlm");
 DEFINE_string(lexicon, "", "path/to/lexicon.txt");
+DEFINE_string(
+    lexicon_cache,
+    "",
+    "path/to/trie_cache: flattened trie and word dictionary of the lexicon, "
+    "mapped if built for the same lexicon, lm and tokens, rebuilt otherwise");
 DEFINE_string(emission_dir, "", "path/to/emission_dir/");
+DEFINE_string(
+    emission_format,
+    "cereal",
+    "format of the files in emission_dir: cereal (serialized EmissionSet), "
+    "float32, float16 or int8 (memory-mapped emission file, the decoder "
+    "reads the type from its header)");
 DEFINE_string(lm, "", "path/to/language_model");
 DEFINE_string(am, "", "path/to/acoustic_model");
 DEFINE_string(sclite, "", "path/to/sclite to be written");
@@ -163,6 +223,43 @@ DEFINE_int32(maxload, -1, "max number of testing examples.");
 DEFINE_int32(maxword, -1, "maximum number of words to use");
 DEFINE_int32(beamsize, 2500, "max beam size");
 DEFINE_int32(nthread_decoder, 1, "number of threads for decoding");
+DEFINE_int32(
+    lmcachesize,
+    1 << 20,
+    "entries of the LM score cache of each decoding thread (0 to disable)");
+DEFINE_string(
+    sweep,
+    "",
+    "decode with each configuration of weights of this spec and print a WER "
+    "table, e.g. lmweight=0.5:3:0.5,wordscore=-2:2:1 (see DecodeSweep.h)");
+DEFINE_int32(
+    sweep_random,
+    0,
+    "number of configurations drawn at random from the sweep spec (0 to "
+    "decode its whole grid)");
+DEFINE_string(
+    rescore_lm,
+    "",
+    "path/to/lm: rescore the lattices of the decoder with this (e.g. larger) "
+    "word LM in a second pass, and report its WER and throughput separately");
+DEFINE_double(
+    rescore_lmweight,
+    -1,
+    "lm weight of the rescoring LM (negative to use lmweight)");
+DEFINE_int32(
+    nthread_rescore,
+    1,
+    "number of threads rescoring the lattices, one sample at a time each");
+DEFINE_string(
+    lattice_dir,
+    "",
+    "save the lattices of the decoder (the final hypothesis of each sample as "
+    "a prefix tree) to this directory, with their sample ids and references");
+DEFINE_bool(
+    rescore_only,
+    false,
+    "do not decode: rescore the lattices saved to lattice_dir by a previous "
+    "run with rescore_lm");
 
 // ASG OPTIONS
 DEFINE_int64(linseg, 0, "# of epochs of LinSeg to init transitions for ASG");
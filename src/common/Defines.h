@@ -153,11 +153,24 @@ DECLARE_int64(encoderdim);
 DECLARE_bool(show);
 DECLARE_bool(showletters);
 DECLARE_bool(logadd);
+DECLARE_bool(hashmerge);
+DECLARE_bool(histogrampruning);
+DECLARE_int32(maxcandidates);
+DECLARE_double(blankskip);
+DECLARE_int32(tokentopk);
+DECLARE_double(tokenthreshold);
+DECLARE_int32(nthread_beam);
+DECLARE_int32(emission_queue_size);
+DECLARE_int32(streamchunk);
+DECLARE_int32(streamlookback);
+DECLARE_int32(maxbufferframes);
 
 DECLARE_string(smearing);
 DECLARE_string(lmtype);
 DECLARE_string(lexicon);
+DECLARE_string(lexicon_cache);
 DECLARE_string(emission_dir);
+DECLARE_string(emission_format);
 DECLARE_string(lm);
 DECLARE_string(am);
 DECLARE_string(sclite);
@@ -173,6 +186,14 @@ DECLARE_int32(maxload);
 DECLARE_int32(maxword);
 DECLARE_int32(beamsize);
 DECLARE_int32(nthread_decoder);
+DECLARE_int32(lmcachesize);
+DECLARE_string(sweep);
+DECLARE_int32(sweep_random);
+DECLARE_string(rescore_lm);
+DECLARE_double(rescore_lmweight);
+DECLARE_int32(nthread_rescore);
+DECLARE_string(lattice_dir);
+DECLARE_bool(rescore_only);
 
 /* ========== ASG OPTIONS ========== */
 
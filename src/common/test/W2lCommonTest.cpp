@@ -13,6 +13,7 @@
 #include <future>
 #include <memory>
 
+#include "common/BlockingQueue.h"
 #include "common/Dictionary.h"
 #include "common/Transforms.h"
 #include "common/Utils.h"
@@ -473,6 +474,24 @@ TEST(W2lCommonTest, UT8Split) {
   }
 }
 
+TEST(W2lCommonTest, BlockingQueue) {
+  BlockingQueue<int> queue(2);
+  auto producer = std::async(std::launch::async, [&queue]() {
+    for (int i = 0; i < 100; i++) {
+      queue.push(i);
+    }
+    queue.close();
+  });
+
+  int item, expected = 0;
+  while (queue.pop(item)) {
+    ASSERT_EQ(item, expected++);
+  }
+  producer.wait();
+  ASSERT_EQ(expected, 100);
+  ASSERT_FALSE(queue.push(100));
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
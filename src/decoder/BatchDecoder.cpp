@@ -0,0 +1,343 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+#include "BatchDecoder.h"
+
+namespace w2l {
+
+/* ===================== Stream ===================== */
+
+class BatchDecoder::Stream : public Decoder {
+ public:
+  /* Decode with the options of `decoder` */
+  Stream(BatchDecoder* batch, std::unique_ptr<LexiconDecoder> decoder)
+      : Decoder(decoder->opt_),
+        batch_(batch),
+        decoder_(std::move(decoder)),
+        active_(false),
+        expanded_(false) {}
+
+  void setOptions(const DecoderOptions& opt) override {
+    Decoder::setOptions(opt);
+    decoder_->setOptions(opt);
+  }
+
+  void decodeBegin() override {
+    pending_.clear();
+    batch_->beginStream(this);
+    stats_ = decoder_->getStats();
+  }
+
+  void decodeStep(const EmissionMatrix& emissions) override {
+    if (emissions.T_ > 0) {
+      pending_.emplace_back(emissions);
+    }
+  }
+
+  void decodeEnd() override {
+    batch_->run();
+    batch_->endStream(this);
+  }
+
+  void prune(int lookBack = 0) override {
+    decoder_->prune(lookBack);
+  }
+
+  DecodeResult getBestHypothesis(int lookBack = 0) const override {
+    return decoder_->getBestHypothesis(lookBack);
+  }
+
+  std::vector<DecodeResult> getAllFinalHypothesis() const override {
+    return decoder_->getAllFinalHypothesis();
+  }
+
+  int nHypothesis() const override {
+    return decoder_->nHypothesis();
+  }
+
+  size_t peakHypothesisBytes() const override {
+    return decoder_->peakHypothesisBytes();
+  }
+
+  int nDecodedFramesInBuffer() const override {
+    return decoder_->nDecodedFramesInBuffer();
+  }
+
+ private:
+  /* A copy of the emissions given to decodeStep(), decoded frame by frame */
+  struct Chunk {
+    std::vector<char> data_;
+    std::vector<float> scales_; // INT8 only
+    std::vector<float> offsets_;
+    EmissionMatrix emissions_; // View of the copy
+    int next_; // Next frame to decode
+
+    explicit Chunk(const EmissionMatrix& emissions)
+        : emissions_(emissions), next_(0) {
+      const int T = emissions.T_;
+      const int N = emissions.N_;
+      const char* data = static_cast<const char*>(emissions.data_);
+      switch (emissions.type_) {
+        case EmissionType::FLOAT32:
+          data_.assign(data, data + T * N * sizeof(float));
+          break;
+        case EmissionType::FLOAT16:
+          data_.assign(data, data + T * N * sizeof(uint16_t));
+          break;
+        case EmissionType::INT8:
+          data_.assign(data, data + T * N * sizeof(int8_t));
+          scales_.assign(emissions.scales_, emissions.scales_ + T);
+          offsets_.assign(emissions.offsets_, emissions.offsets_ + T);
+          emissions_.scales_ = scales_.data();
+          emissions_.offsets_ = offsets_.data();
+          break;
+      }
+      emissions_.data_ = data_.data();
+    }
+  };
+
+  BatchDecoder* batch_;
+  std::unique_ptr<LexiconDecoder> decoder_;
+  std::deque<Chunk> pending_; // Queued emissions
+  bool active_; // Between decodeBegin() and decodeEnd()
+  bool expanded_; // The frame of the current step needs an LM score
+
+  bool hasPendingFrame() const {
+    return !pending_.empty();
+  }
+
+  /* The next queued frame, as a 1 x N view */
+  EmissionMatrix pendingFrame() const {
+    const Chunk& chunk = pending_.front();
+    return chunk.emissions_.frames(chunk.next_, 1);
+  }
+
+  void popFrame() {
+    Chunk& chunk = pending_.front();
+    if (++chunk.next_ == chunk.emissions_.T_) {
+      pending_.pop_front();
+    }
+  }
+
+  friend class BatchDecoder;
+};
+
+/* ===================== BatchDecoder ===================== */
+
+BatchDecoder::BatchDecoder(
+    const LMPtr& lm,
+    const DecoderFactory& factory,
+    int maxLmStates)
+    : lm_(lm),
+      factory_(factory),
+      nActive_(0),
+      startState_(-1),
+      maxLmStates_(maxLmStates),
+      nLiveLmStates_(0) {}
+
+BatchDecoder::~BatchDecoder() = default;
+
+Decoder* BatchDecoder::addStream() {
+  std::unique_ptr<LexiconDecoder> decoder = factory_(lm_);
+  /* The candidates are only ever stored in the arenas */
+  std::vector<LexiconCandidates>().swap(decoder->buffers_);
+  /* The LM states of the other streams are in the same pool */
+  decoder->ownsLmStates_ = false;
+  streams_.emplace_back(new Stream(this, std::move(decoder)));
+  return streams_.back().get();
+}
+
+void BatchDecoder::removeStream(Decoder* stream) {
+  auto it = std::find_if(
+      streams_.begin(),
+      streams_.end(),
+      [stream](const std::unique_ptr<Stream>& s) { return s.get() == stream; });
+  if (it == streams_.end()) {
+    return;
+  }
+  if ((*it)->active_) {
+    nActive_--;
+  }
+  streams_.erase(it);
+}
+
+void BatchDecoder::beginStream(Stream* stream) {
+  if (stream->active_) {
+    nActive_--;
+  }
+  if (nActive_ == 0) {
+    startState_ = lm_->start(0);
+  }
+  stream->active_ = true;
+  nActive_++;
+  stream->decoder_->decodeBegin(startState_);
+}
+
+void BatchDecoder::endStream(Stream* stream) {
+  if (arenas_.empty()) {
+    arenas_.resize(1);
+  }
+  swapArena(*stream->decoder_, arenas_[0]);
+  stream->decoder_->decodeEnd();
+  swapArena(*stream->decoder_, arenas_[0]);
+  stream->stats_ = stream->decoder_->getStats();
+  if (stream->active_) {
+    stream->active_ = false;
+    nActive_--;
+  }
+}
+
+void BatchDecoder::swapArena(LexiconDecoder& decoder, Arena& arena) {
+  std::swap(decoder.buffers_, arena.buffers_);
+  std::swap(decoder.candidatePtrs_, arena.candidatePtrs_);
+  std::swap(decoder.mergeTable_, arena.mergeTable_);
+}
+
+int BatchDecoder::run() {
+  int nSteps = 0;
+  while (step()) {
+    nSteps++;
+  }
+  return nSteps;
+}
+
+bool BatchDecoder::step() {
+  stepStreams_.clear();
+  for (auto& stream : streams_) {
+    if (stream->hasPendingFrame()) {
+      stepStreams_.push_back(stream.get());
+    }
+  }
+  if (stepStreams_.empty()) {
+    return false;
+  }
+  if (arenas_.size() < stepStreams_.size()) {
+    arenas_.resize(stepStreams_.size());
+  }
+
+  const int nStepStreams = stepStreams_.size();
+
+  /* (1) Expand the next frame of each stream */
+  for (int i = 0; i < nStepStreams; i++) {
+    Stream* stream = stepStreams_[i];
+    swapArena(*stream->decoder_, arenas_[i]);
+    stream->expanded_ = stream->decoder_->expandStep(stream->pendingFrame());
+  }
+
+  /* (2) Score the proposals of all the streams at once */
+  scoreProposals();
+
+  /* (3) Store the frames */
+  for (int i = 0; i < nStepStreams; i++) {
+    Stream* stream = stepStreams_[i];
+    stream->decoder_->storeStep(stream->expanded_);
+    swapArena(*stream->decoder_, arenas_[i]);
+    stream->popFrame();
+    stream->stats_ = stream->decoder_->getStats();
+  }
+
+  /* (4) Recycle the LM states, without waiting for all the streams to end */
+  if (lm_->nStates() > std::max(maxLmStates_, 2 * nLiveLmStates_)) {
+    lmStatesCompact();
+  }
+  return true;
+}
+
+void BatchDecoder::scoreProposals() {
+  lmStates_.clear();
+  lmTokens_.clear();
+  for (Stream* stream : stepStreams_) {
+    if (!stream->expanded_) {
+      continue;
+    }
+    LexiconDecoder& decoder = *stream->decoder_;
+    for (int b = 0; b < decoder.nBuffers_; b++) {
+      const LexiconCandidates& buffer = decoder.buffers_[b];
+      lmStates_.insert(
+          lmStates_.end(),
+          buffer.proposalLmStates_.begin(),
+          buffer.proposalLmStates_.end());
+      lmTokens_.insert(
+          lmTokens_.end(),
+          buffer.proposalLmTokens_.begin(),
+          buffer.proposalLmTokens_.end());
+      W2L_DECODER_STATS_ADD(
+          decoder.stats_.nLmCalls_, buffer.proposalLmStates_.size());
+    }
+  }
+
+  const int nProposals = lmStates_.size();
+  lmNewStates_.resize(nProposals);
+  lmScores_.resize(nProposals);
+  lm_->scoreBatch(
+      lmStates_.data(),
+      lmTokens_.data(),
+      nProposals,
+      lmNewStates_.data(),
+      lmScores_.data());
+
+  int offset = 0;
+  for (Stream* stream : stepStreams_) {
+    if (!stream->expanded_) {
+      continue;
+    }
+    LexiconDecoder& decoder = *stream->decoder_;
+    for (int b = 0; b < decoder.nBuffers_; b++) {
+      LexiconCandidates& buffer = decoder.buffers_[b];
+      const int n = buffer.proposals_.size();
+      buffer.proposalNewLmStates_.assign(
+          lmNewStates_.begin() + offset, lmNewStates_.begin() + offset + n);
+      buffer.proposalLmScores_.assign(
+          lmScores_.begin() + offset, lmScores_.begin() + offset + n);
+      for (int i = 0; i < n; i++) {
+        buffer.proposals_[i].lmState_ = lmNewStates_[offset + i];
+      }
+      offset += n;
+    }
+  }
+}
+
+void BatchDecoder::lmStatesCompact() {
+  /* The streams started in this generation share its start state */
+  lmStates_.assign(1, startState_);
+  for (auto& stream : streams_) {
+    if (!stream->active_) {
+      continue;
+    }
+    const auto& hyp = stream->decoder_->hyp_;
+    for (int f = 0; f < hyp.nFrames(); f++) {
+      const LexiconDecoderState* hyps = hyp.frame(f);
+      for (int h = 0; h < hyp.frameSize(f); h++) {
+        lmStates_.push_back(hyps[h].lmState_);
+      }
+    }
+  }
+  lm_->compactStates(lmStates_.data(), lmStates_.size());
+  nLiveLmStates_ = lm_->nStates();
+
+  startState_ = lmStates_[0];
+  int i = 1;
+  for (auto& stream : streams_) {
+    if (!stream->active_) {
+      continue;
+    }
+    auto& hyp = stream->decoder_->hyp_;
+    for (int f = 0; f < hyp.nFrames(); f++) {
+      LexiconDecoderState* hyps = hyp.frame(f);
+      for (int h = 0; h < hyp.frameSize(f); h++) {
+        hyps[h].lmState_ = lmStates_[i++];
+      }
+    }
+  }
+}
+
+} // namespace w2l
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "LM.h"
+#include "LexiconDecoder.h"
+
+namespace w2l {
+
+/**
+ * BatchDecoder decodes many independent streams (utterances) in lock step.
+ * Each stream is decoded by its own lexicon decoder and is driven through the
+ * usual Decoder API, but:
+ *  - decodeStep() only queues the emissions of the stream (they are copied);
+ *  - run() decodes the queued frames of all the streams, one frame of each
+ *    stream at a time, and the proposals of all the streams are scored by a
+ *    single LM::scoreBatch() call per frame;
+ *  - decodeEnd() runs the batch before finishing the stream.
+ *
+ * Online:
+ *  for each stream: stream->decodeBegin()
+ *  while (streams)
+ *    for each stream with new data: stream->decodeStep(someData)
+ *    batch.run()
+ *    for each stream: stream->getBestHypothesis(), stream->prune()
+ *  for each stream: stream->decodeEnd()
+ *
+ * All the streams share the LM given to the BatchDecoder (pass a CachedLM so
+ * that they also share its cache): the sentence starts and frequent words are
+ * scored from the same contexts across streams. They also share the candidate
+ * buffers of a frame, which are lent to the streams decoded in the current
+ * step, so that the memory of the candidates grows with the number of streams
+ * decoding at once instead of with the number of streams.
+ *
+ * The LM recycles its state pool in LM::start(), which invalidates the states
+ * held by the streams: a stream starts from the state of the first stream
+ * started in a pool generation, and the LM is only started (and possibly
+ * recycled) when no other stream is between decodeBegin() and decodeEnd().
+ * Streams may overlap forever, so once the pool holds more than `maxLmStates`
+ * states after a step, it is compacted to the states of the hypothesis of all
+ * the streams, which are renumbered (see LM::compactStates()).
+ *
+ * A BatchDecoder and its streams are to be used by one thread; the decoders
+ * of the streams may still use several threads for each of their frames.
+ */
+class BatchDecoder {
+ public:
+  /* Create the decoder of a stream over `lm`, e.g. a WordLMDecoder */
+  typedef std::function<std::unique_ptr<LexiconDecoder>(const LMPtr& lm)>
+      DecoderFactory;
+
+  BatchDecoder(
+      const LMPtr& lm,
+      const DecoderFactory& factory,
+      int maxLmStates = kLMStatePoolCapacity);
+
+  ~BatchDecoder();
+
+  /* Add a stream, which is owned by the BatchDecoder */
+  Decoder* addStream();
+
+  /* Remove a stream, which is deleted */
+  void removeStream(Decoder* stream);
+
+  int nStreams() const {
+    return streams_.size();
+  }
+
+  /* Decode all the queued frames, return the number of lock steps */
+  int run();
+
+  /**
+   * Decode one queued frame of each stream which has some, return false if
+   * none has
+   */
+  bool step();
+
+  LMPtr getLM() const {
+    return lm_;
+  }
+
+ private:
+  class Stream;
+
+  /**
+   * Candidate buffers and merge table of a stream decoded in the current
+   * step, swapped with the (empty) ones of its decoder for the step.
+   */
+  struct Arena {
+    std::vector<LexiconCandidates> buffers_;
+    std::vector<LexiconDecoderState*> candidatePtrs_;
+    CandidateMergeTable<LexiconDecoderState> mergeTable_;
+  };
+
+  LMPtr lm_;
+  DecoderFactory factory_;
+  std::vector<std::unique_ptr<Stream>> streams_;
+  std::vector<Stream*> stepStreams_; // Streams decoded in the current step
+  std::vector<Arena> arenas_; // One per stream decoded in the current step
+  int nActive_; // Streams between decodeBegin() and decodeEnd()
+  LMStateIdx startState_; // LM start state of the current pool generation
+  int maxLmStates_; // Size of the LM state pool which triggers a compaction
+  int nLiveLmStates_; // Size of the LM state pool after the last compaction
+
+  std::vector<LMStateIdx> lmStates_; // LM queries of all the streams
+  std::vector<int> lmTokens_;
+  std::vector<LMStateIdx> lmNewStates_; // LM answers for them
+  std::vector<float> lmScores_;
+
+  void beginStream(Stream* stream);
+
+  void endStream(Stream* stream);
+
+  /* Swap the candidate buffers of `decoder` with the ones of `arena` */
+  static void swapArena(LexiconDecoder& decoder, Arena& arena);
+
+  /* Score the proposals of the streams expanded in the current step at once */
+  void scoreProposals();
+
+  /* Drop the LM states which are the state of no hypothesis of any stream */
+  void lmStatesCompact();
+};
+
+} // namespace w2l
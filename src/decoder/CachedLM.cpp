@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+
+#include "CachedLM.h"
+
+namespace w2l {
+
+CachedLM::CachedLM(const LMPtr& lm, int cacheSize)
+    : lm_(lm), generation_(lm->stateGeneration()), nHits_(0), nMisses_(0) {
+  size_t nEntries = 1;
+  while (nEntries < static_cast<size_t>(std::max(cacheSize, 1))) {
+    nEntries *= 2;
+  }
+  entries_.resize(nEntries);
+  mask_ = nEntries - 1;
+}
+
+int CachedLM::index(const std::string& token) {
+  return lm_->index(token);
+}
+
+LMStateIdx CachedLM::start(bool isNull) {
+  LMStateIdx state = lm_->start(isNull);
+  if (lm_->stateGeneration() != generation_) {
+    flush();
+    generation_ = lm_->stateGeneration();
+  }
+  return state;
+}
+
+LMStateIdx CachedLM::score(LMStateIdx inState, int tokenIdx, float& score) {
+  Entry& entry = lookup(inState, tokenIdx);
+  if (entry.inState == inState && entry.tokenIdx == tokenIdx) {
+    nHits_++;
+    score = entry.score;
+    return entry.outState;
+  }
+  nMisses_++;
+  entry.inState = inState;
+  entry.tokenIdx = tokenIdx;
+  entry.outState = lm_->score(inState, tokenIdx, entry.score);
+  score = entry.score;
+  return entry.outState;
+}
+
+void CachedLM::scoreBatch(
+    const LMStateIdx* inStates,
+    const int* tokenIdx,
+    int n,
+    LMStateIdx* outStates,
+    float* scores) {
+  /* Answer what we can from the cache and forward the rest as one batch */
+  missIdx_.clear();
+  missInStates_.clear();
+  missTokenIdx_.clear();
+  for (int i = 0; i < n; i++) {
+    const Entry& entry = lookup(inStates[i], tokenIdx[i]);
+    if (entry.inState == inStates[i] && entry.tokenIdx == tokenIdx[i]) {
+      outStates[i] = entry.outState;
+      scores[i] = entry.score;
+    } else {
+      missIdx_.push_back(i);
+      missInStates_.push_back(inStates[i]);
+      missTokenIdx_.push_back(tokenIdx[i]);
+    }
+  }
+  const int nMisses = missIdx_.size();
+  nHits_ += n - nMisses;
+  nMisses_ += nMisses;
+  if (nMisses == 0) {
+    return;
+  }
+
+  missOutStates_.resize(nMisses);
+  missScores_.resize(nMisses);
+  lm_->scoreBatch(
+      missInStates_.data(),
+      missTokenIdx_.data(),
+      nMisses,
+      missOutStates_.data(),
+      missScores_.data());
+  for (int j = 0; j < nMisses; j++) {
+    const int i = missIdx_[j];
+    outStates[i] = missOutStates_[j];
+    scores[i] = missScores_[j];
+    Entry& entry = lookup(inStates[i], tokenIdx[i]);
+    entry.inState = inStates[i];
+    entry.tokenIdx = tokenIdx[i];
+    entry.outState = outStates[i];
+    entry.score = scores[i];
+  }
+}
+
+LMStateIdx CachedLM::finish(LMStateIdx inState, float& score) {
+  return lm_->finish(inState, score);
+}
+
+int CachedLM::stateGeneration() const {
+  return lm_->stateGeneration();
+}
+
+void CachedLM::compactStates(LMStateIdx* states, int n) {
+  lm_->compactStates(states, n);
+  flush();
+  generation_ = lm_->stateGeneration();
+}
+
+int CachedLM::nStates() const {
+  return lm_->nStates();
+}
+
+LMPtr CachedLM::clone() const {
+  return std::make_shared<CachedLM>(lm_->clone(), entries_.size());
+}
+
+void CachedLM::flush() {
+  std::fill(entries_.begin(), entries_.end(), Entry());
+}
+
+} // namespace w2l
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "LM.h"
+
+namespace w2l {
+
+const int kLMCacheSize = 1 << 20;
+
+/**
+ * CachedLM wraps any LM and memoizes score() queries: a bounded table maps
+ * (state, token) to (next state, score). Most of the words proposed by the
+ * decoder are queried again and again from the same contexts, across beam
+ * entries and across frames, so that most queries never reach the wrapped LM.
+ *
+ * The table is direct-mapped (a new entry replaces the colliding one), so its
+ * memory is fixed. The state handles are the ones of the wrapped LM, and the
+ * table is flushed whenever the wrapped LM recycles its state pool. Like any
+ * LM instance, a CachedLM is to be used by one decoder (thread) at a time.
+ */
+class CachedLM : public LM {
+ public:
+  /* `cacheSize` is the number of entries, rounded up to a power of 2 */
+  explicit CachedLM(const LMPtr& lm, int cacheSize = kLMCacheSize);
+
+  int index(const std::string& token) override;
+
+  LMStateIdx start(bool isNull) override;
+
+  LMStateIdx score(LMStateIdx inState, int tokenIdx, float& score) override;
+
+  void scoreBatch(
+      const LMStateIdx* inStates,
+      const int* tokenIdx,
+      int n,
+      LMStateIdx* outStates,
+      float* scores) override;
+
+  LMStateIdx finish(LMStateIdx inState, float& score) override;
+
+  int stateGeneration() const override;
+
+  /* Compact the pool of the wrapped LM and flush the cache */
+  void compactStates(LMStateIdx* states, int n) override;
+
+  int nStates() const override;
+
+  /* Return a CachedLM of the same size over a clone of the wrapped LM */
+  LMPtr clone() const override;
+
+  /* Number of score() queries answered from the cache */
+  int64_t nHits() const {
+    return nHits_;
+  }
+
+  /* Number of score() queries forwarded to the wrapped LM */
+  int64_t nMisses() const {
+    return nMisses_;
+  }
+
+  void resetCounters() {
+    nHits_ = 0;
+    nMisses_ = 0;
+  }
+
+ private:
+  struct Entry {
+    LMStateIdx inState = -1; // -1 for empty entries
+    int tokenIdx = 0;
+    LMStateIdx outState = -1;
+    float score = 0;
+  };
+
+  LMPtr lm_;
+  std::vector<Entry> entries_;
+  size_t mask_;
+  int generation_; // Pool generation of the wrapped LM the entries belong to
+  int64_t nHits_;
+  int64_t nMisses_;
+
+  std::vector<int> missIdx_; // Queries of a batch not found in the cache
+  std::vector<LMStateIdx> missInStates_;
+  std::vector<int> missTokenIdx_;
+  std::vector<LMStateIdx> missOutStates_;
+  std::vector<float> missScores_;
+
+  Entry& lookup(LMStateIdx inState, int tokenIdx) {
+    uint64_t key = ((uint64_t)(uint32_t)inState << 32) | (uint32_t)tokenIdx;
+    return entries_[(key * 0x9E3779B97F4A7C15ULL >> 32) & mask_];
+  }
+
+  void flush();
+};
+
+typedef std::shared_ptr<CachedLM> CachedLMPtr;
+
+} // namespace w2l
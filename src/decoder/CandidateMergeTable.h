@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "Utils.h"
+
+namespace w2l {
+
+/**
+ * CandidateMergeTable merges the candidates of a frame which share the same
+ * key (e.g. LM state and lexicon node) in linear time, with an open-addressing
+ * (linear probing) table of merged groups. The table is reused from frame to
+ * frame: slots are invalidated by bumping a stamp instead of being cleared.
+ *
+ * The result matches the sort-based merging of the decoders: each group is
+ * represented by its best candidate, and with logAdd the scores of a group are
+ * accumulated in decreasing order. Only the order of the groups differs.
+ */
+template <class DecoderState>
+class CandidateMergeTable {
+ public:
+  CandidateMergeTable() : mask_(0), stamp_(0) {}
+
+  /**
+   * Merge the first `size` candidates of `candidatePtrs`, where `keyOf(state)`
+   * returns the 64-bit key of a candidate. The merged candidates are moved to
+   * the front of `candidatePtrs` and their number is returned.
+   */
+  template <class KeyFunc>
+  int merge(
+      std::vector<DecoderState*>& candidatePtrs,
+      const int size,
+      const bool logAdd,
+      const KeyFunc& keyOf) {
+    reset(size);
+
+    /* (1) Find the group of each candidate, and the best one of each group */
+    int nGroups = 0;
+    for (int i = 0; i < size; i++) {
+      DecoderState* candidate = candidatePtrs[i];
+      const uint64_t key = keyOf(candidate);
+      size_t s = (key * 0x9E3779B97F4A7C15ULL >> 32) & mask_;
+      while (slots_[s].stamp == stamp_ && slots_[s].key != key) {
+        s = (s + 1) & mask_;
+      }
+      Slot& slot = slots_[s];
+      if (slot.stamp != stamp_) {
+        slot.key = key;
+        slot.group = nGroups++;
+        slot.stamp = stamp_;
+        best_[slot.group] = candidate;
+        groupSize_[slot.group] = 1;
+      } else {
+        if (candidate->score_ > best_[slot.group]->score_) {
+          best_[slot.group] = candidate;
+        }
+        groupSize_[slot.group]++;
+      }
+      groupOf_[i] = slot.group;
+    }
+
+    if (logAdd && nGroups < size) {
+      /* (2) Bucket the candidates by group and accumulate each group in
+       * decreasing order of score, as the sort-based merging does, so that
+       * the rounding is the same */
+      int offset = 0;
+      for (int g = 0; g < nGroups; g++) {
+        groupStart_[g] = offset;
+        offset += groupSize_[g];
+      }
+      for (int i = 0; i < size; i++) {
+        members_[groupStart_[groupOf_[i]]++] = candidatePtrs[i];
+      }
+      auto compareNodes = [](const DecoderState* node1,
+                             const DecoderState* node2) {
+        return node1->score_ > node2->score_;
+      };
+      for (int g = 0; g < nGroups; g++) {
+        if (groupSize_[g] == 1) {
+          continue;
+        }
+        auto begin = members_.begin() + groupStart_[g] - groupSize_[g];
+        auto end = members_.begin() + groupStart_[g];
+        std::sort(begin, end, compareNodes);
+        best_[g] = *begin;
+        for (auto it = begin + 1; it != end; ++it) {
+          mergeStates(best_[g], *it, true);
+        }
+      }
+    }
+
+    std::copy(best_.begin(), best_.begin() + nGroups, candidatePtrs.begin());
+    return nGroups;
+  }
+
+ private:
+  struct Slot {
+    uint64_t key = 0;
+    int group = 0;
+    uint32_t stamp = 0; // Slot is in use only if equal to stamp_
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  uint32_t stamp_;
+  std::vector<int> groupOf_; // Group of each candidate
+  std::vector<int> groupSize_;
+  std::vector<int> groupStart_;
+  std::vector<DecoderState*> best_; // Best candidate of each group
+  std::vector<DecoderState*> members_; // Candidates bucketed by group
+
+  void reset(const int size) {
+    if (groupOf_.size() < size) {
+      groupOf_.resize(size);
+      groupSize_.resize(size);
+      groupStart_.resize(size);
+      best_.resize(size);
+      members_.resize(size);
+    }
+    if (2 * size > slots_.size()) {
+      size_t nSlots = std::max<size_t>(slots_.size(), 1024);
+      while (nSlots < 2 * size) {
+        nSlots *= 2;
+      }
+      slots_.assign(nSlots, Slot());
+      mask_ = nSlots - 1;
+      stamp_ = 0;
+    }
+    if (++stamp_ == 0) {
+      std::fill(slots_.begin(), slots_.end(), Slot());
+      stamp_ = 1;
+    }
+  }
+};
+
+} // namespace w2l
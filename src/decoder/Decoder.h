@@ -8,6 +8,10 @@
 
 #pragma once
 
+#include <algorithm>
+
+#include "DecoderStats.h"
+#include "Emissions.h"
 #include "Utils.h"
 
 namespace w2l {
@@ -28,28 +32,108 @@ namespace w2l {
  * to supports online decoding. It will also add a offset to the scores in beam
  * to avoid underflow/overflow.
  *
+ * decoder.getStats() returns the work done since decoder.decodeBegin().
  */
 class Decoder {
  public:
   explicit Decoder(const DecoderOptions& opt) : opt_(opt) {}
   virtual ~Decoder() = default;
 
+  /**
+   * Change the options, e.g. the weights, before decoding another utterance.
+   * The buffers of the decoder are kept.
+   */
+  virtual void setOptions(const DecoderOptions& opt) {
+    opt_ = opt;
+  }
+
   /* Initialize decoder before starting consume emissions */
   virtual void decodeBegin() {}
 
   /* Consume emissions in T x N chunks and increase the hypothesis space */
-  virtual void decodeStep(const float* emissions, int T, int N) = 0;
+  virtual void decodeStep(const EmissionMatrix& emissions) = 0;
+
+  void decodeStep(const float* emissions, int T, int N) {
+    decodeStep(EmissionMatrix(emissions, T, N));
+  }
 
   /* Finish up decoding after consuming all emissions */
   virtual void decodeEnd() {}
 
-  /* Offline decode function, which consume all emissions at once */
-  virtual std::vector<DecodeResult>
-  decode(const float* emissions, int T, int N) {
+  /**
+   * Offline decode function, which consume all emissions at once. If
+   * opt_.maxBufferFrames_ is set, the emissions are decoded in chunks and the
+   * decoder is pruned back to opt_.pruneLookBack_ frames whenever it holds
+   * more frames, so that long utterances are decoded in bounded memory. The
+   * dropped frames are committed with the best path leading to them at the
+   * time, and prepended to all the final hypothesis. The scores of the final
+   * hypothesis are the ones of the paths they actually took, which only go
+   * through the committed frames if the best path did not change more than
+   * opt_.pruneLookBack_ frames back: the hypothesis are then the same as
+   * without pruning.
+   */
+  virtual std::vector<DecodeResult> decode(const EmissionMatrix& emissions) {
     decodeBegin();
-    decodeStep(emissions, T, N);
+    if (opt_.maxBufferFrames_ <= 0) {
+      decodeStep(emissions);
+      decodeEnd();
+      return getAllFinalHypothesis();
+    }
+
+    DecodeResult prefix;
+    const int chunkSize =
+        std::max(opt_.maxBufferFrames_ - opt_.pruneLookBack_, 1);
+    for (int t = 0; t < emissions.T_; t += chunkSize) {
+      decodeStep(emissions.frames(t, std::min(chunkSize, emissions.T_ - t)));
+      const int nFramesInBuffer = nDecodedFramesInBuffer();
+      if (nFramesInBuffer <= opt_.maxBufferFrames_) {
+        continue;
+      }
+
+      pruneAndCommit(
+          opt_.pruneLookBack_,
+          getBestHypothesis(opt_.pruneLookBack_),
+          prefix);
+    }
     decodeEnd();
-    return getAllFinalHypothesis();
+
+    auto results = getAllFinalHypothesis();
+    for (auto& result : results) {
+      result.words_.insert(
+          result.words_.begin(), prefix.words_.begin(), prefix.words_.end());
+      result.tokens_.insert(
+          result.tokens_.begin(), prefix.tokens_.begin(), prefix.tokens_.end());
+    }
+    return results;
+  }
+
+  std::vector<DecodeResult> decode(const float* emissions, int T, int N) {
+    return decode(EmissionMatrix(emissions, T, N));
+  }
+
+  /**
+   * Prune back to `lookBack` frames, and append the frames dropped to
+   * `committed`. `partial` is the best hypothesis `lookBack` frames back,
+   * i.e. getBestHypothesis(lookBack) before pruning.
+   */
+  void pruneAndCommit(
+      int lookBack,
+      const DecodeResult& partial,
+      DecodeResult& committed) {
+    const int nFramesInBuffer = nDecodedFramesInBuffer();
+    prune(lookBack);
+    const int nPruned = nFramesInBuffer - nDecodedFramesInBuffer();
+    if (nPruned <= 0) {
+      return;
+    }
+    committed.words_.insert(
+        committed.words_.end(),
+        partial.words_.begin(),
+        partial.words_.begin() + nPruned);
+    committed.tokens_.insert(
+        committed.tokens_.end(),
+        partial.tokens_.begin(),
+        partial.tokens_.begin() + nPruned);
   }
 
   /* Prune the hypothesis space */
@@ -67,8 +151,27 @@ class Decoder {
    */
   virtual std::vector<DecodeResult> getAllFinalHypothesis() const = 0;
 
+  /* Get the number of hypothesis in the last decoded frame */
+  virtual int nHypothesis() const = 0;
+
+  /* Get the peak memory held by the hypothesis of the decoder (bytes) */
+  virtual size_t peakHypothesisBytes() const = 0;
+
+  /*
+   * Get the number of frames held in the buffer (decoded but not pruned yet),
+   * including the initial one.
+   */
+  virtual int nDecodedFramesInBuffer() const = 0;
+
+  /* Get the counters of the current utterance (zero if compiled out) */
+  const DecoderStats& getStats() const {
+    return stats_;
+  }
+
  protected:
   DecoderOptions opt_;
+  DecoderStats stats_;
+  DecoderStatsTimer statsTimer_;
 };
 
 } // namespace w2l
@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+/**
+ * The hot-path counters of the decoders are collected unless the library is
+ * built with W2L_DECODER_STATS=0, in which case the macros below expand to
+ * nothing and DecoderStats stays at zero. The blank frames skipped by
+ * opt_.blankSkipThreshold_ are counted in both builds.
+ */
+#ifndef W2L_DECODER_STATS
+#define W2L_DECODER_STATS 1
+#endif
+
+#if W2L_DECODER_STATS
+#define W2L_DECODER_STATS_ADD(counter, n) ((counter) += (n))
+#define W2L_DECODER_STATS_MAX(counter, n) \
+  ((counter) = std::max<int64_t>((counter), (n)))
+#define W2L_DECODER_STATS_TIC(timer) (timer).tic()
+#define W2L_DECODER_STATS_TOC(timer, seconds) ((seconds) += (timer).toc())
+#else
+#define W2L_DECODER_STATS_ADD(counter, n) ((void)0)
+#define W2L_DECODER_STATS_MAX(counter, n) ((void)0)
+#define W2L_DECODER_STATS_TIC(timer) ((void)0)
+#define W2L_DECODER_STATS_TOC(timer, seconds) ((void)0)
+#endif
+
+namespace w2l {
+
+/**
+ * DecoderStats counts the work done by a decoder since the last
+ * decodeBegin(), i.e. for one utterance.
+ */
+struct DecoderStats {
+  int64_t nFrames_ = 0; // Decoded frames
+  int64_t nBlankFrames_ = 0; // Frames skipped as blank (CTC), always counted
+  int64_t nCandidates_ = 0; // Candidates proposed
+  int64_t nRejected_ = 0; // Candidates rejected by isGoodCandidate()
+  int64_t nPruned_ = 0; // Candidates dropped by the final beam threshold
+  int64_t nMerged_ = 0; // Candidates merged into another one
+  int64_t nCapHits_ = 0; // Times the candidate cap tightened the threshold
+  int64_t nCapped_ = 0; // Candidates dropped when tightening it
+  int64_t maxBufferSize_ = 0; // Most candidates held at once by a buffer
+  int64_t nLmCalls_ = 0; // LM queries (score and finish)
+  int64_t nTrieNodes_ = 0; // Trie nodes visited
+  double expandTime_ = 0; // Seconds spent expanding the hypothesis
+  double pruneTime_ = 0; // Seconds spent in pruneCandidates()
+  double mergeTime_ = 0; // Seconds spent in mergeCandidates()
+  double topKTime_ = 0; // Seconds spent in storeTopCandidates()
+
+  DecoderStats& operator+=(const DecoderStats& other) {
+    nFrames_ += other.nFrames_;
+    nBlankFrames_ += other.nBlankFrames_;
+    nCandidates_ += other.nCandidates_;
+    nRejected_ += other.nRejected_;
+    nPruned_ += other.nPruned_;
+    nMerged_ += other.nMerged_;
+    nCapHits_ += other.nCapHits_;
+    nCapped_ += other.nCapped_;
+    maxBufferSize_ = std::max(maxBufferSize_, other.maxBufferSize_);
+    nLmCalls_ += other.nLmCalls_;
+    nTrieNodes_ += other.nTrieNodes_;
+    expandTime_ += other.expandTime_;
+    pruneTime_ += other.pruneTime_;
+    mergeTime_ += other.mergeTime_;
+    topKTime_ += other.topKTime_;
+    return *this;
+  }
+
+  /* One line of `key: value` pairs, times in milliseconds */
+  std::string toString() const {
+    std::ostringstream ss;
+    ss << "frames: " << nFrames_ << ", blank frames: " << nBlankFrames_
+       << ", candidates: " << nCandidates_
+       << ", rejected: " << nRejected_ << ", pruned: " << nPruned_
+       << ", merged: " << nMerged_ << ", cap hits: " << nCapHits_
+       << ", capped: " << nCapped_ << ", max buffer: " << maxBufferSize_
+       << ", LM calls: " << nLmCalls_
+       << ", trie nodes: " << nTrieNodes_
+       << ", expand: " << expandTime_ * 1000
+       << " ms, prune: " << pruneTime_ * 1000
+       << " ms, merge: " << mergeTime_ * 1000
+       << " ms, top-k: " << topKTime_ * 1000 << " ms";
+    return ss.str();
+  }
+};
+
+/* Lap timer for the phases of a frame: toc() returns the time since the last
+ * tic() or toc() */
+class DecoderStatsTimer {
+ public:
+  void tic() {
+    last_ = std::chrono::steady_clock::now();
+  }
+
+  double toc() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    return seconds;
+  }
+
+ private:
+  std::chrono::steady_clock::time_point last_;
+};
+
+} // namespace w2l
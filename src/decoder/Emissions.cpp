@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+
+#include "Emissions.h"
+
+namespace w2l {
+
+EmissionMatrix EmissionMatrix::frames(int start, int nFrames) const {
+  EmissionMatrix view = *this;
+  view.T_ = nFrames;
+  switch (type_) {
+    case EmissionType::FLOAT32:
+      view.data_ = static_cast<const float*>(data_) + start * N_;
+      break;
+    case EmissionType::FLOAT16:
+      view.data_ = static_cast<const uint16_t*>(data_) + start * N_;
+      break;
+    case EmissionType::INT8:
+      view.data_ = static_cast<const int8_t*>(data_) + start * N_;
+      view.scales_ = scales_ + start;
+      view.offsets_ = offsets_ + start;
+      break;
+  }
+  return view;
+}
+
+float EmissionMatrix::get(int t, int n) const {
+  switch (type_) {
+    case EmissionType::FLOAT16:
+      return HalfEmissionReader(*this)(t, n);
+    case EmissionType::INT8:
+      return Int8EmissionReader(*this)(t, n);
+    default:
+      return FloatEmissionReader(*this)(t, n);
+  }
+}
+
+uint16_t floatToHalf(float value) {
+  uint32_t x;
+  std::memcpy(&x, &value, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const uint32_t absX = x & 0x7fffffff;
+
+  if (absX >= 0x7f800000) {
+    /* Inf or NaN */
+    return sign | 0x7c00 | (absX > 0x7f800000 ? 0x200 : 0);
+  }
+  if (absX >= 0x477ff000) {
+    /* Rounds above the largest half */
+    return sign | 0x7c00;
+  }
+  if (absX < 0x38800000) {
+    /* Subnormal half, or zero */
+    if (absX < 0x33000000) {
+      return sign;
+    }
+    const uint32_t exponent = absX >> 23;
+    const uint32_t mantissa = (absX & 0x7fffff) | 0x800000;
+    const uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t middle = 1u << (shift - 1);
+    if (rest > middle || (rest == middle && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+
+  /* Normal half: rebias the exponent and round the mantissa */
+  const uint32_t rebiased = absX - 0x38000000;
+  uint32_t half = rebiased >> 13;
+  const uint32_t rest = rebiased & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    half++;
+  }
+  return sign | half;
+}
+
+void quantizeFrame(
+    const float* frame,
+    int N,
+    int8_t* quantized,
+    float& scale,
+    float& offset) {
+  const auto range = std::minmax_element(frame, frame + N);
+  const float minScore = *range.first;
+  const float maxScore = *range.second;
+
+  /* Map [min, max] onto [-128, 127] */
+  scale = maxScore > minScore ? (maxScore - minScore) / 255 : 1;
+  offset = minScore + 128 * scale;
+  for (int n = 0; n < N; n++) {
+    float q = std::round((frame[n] - offset) / scale);
+    quantized[n] = static_cast<int8_t>(std::max(-128.f, std::min(127.f, q)));
+  }
+}
+
+} // namespace w2l
@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace w2l {
+
+/**
+ * EmissionType is the storage type of emissions:
+ * - FLOAT32: plain floats.
+ * - FLOAT16: IEEE half precision.
+ * - INT8: each frame t is quantized as offset[t] + scale[t] * q, where q is
+ *   in [-128, 127]: the error is at most scale[t] / 2, i.e. 1/510 of the range
+ *   of the scores in the frame.
+ */
+enum class EmissionType { FLOAT32 = 0, FLOAT16 = 1, INT8 = 2 };
+
+/**
+ * EmissionMatrix is a read-only view of T x N (row-major) emissions in any
+ * EmissionType. The decoders read the scores of the tokens they expand
+ * directly from it, so that quantized emissions are never dequantized as a
+ * whole.
+ */
+struct EmissionMatrix {
+  EmissionType type_;
+  const void* data_;
+  const float* scales_; // INT8 only, one per frame
+  const float* offsets_; // INT8 only, one per frame
+  int T_;
+  int N_;
+
+  EmissionMatrix(const float* data, int T, int N)
+      : type_(EmissionType::FLOAT32),
+        data_(data),
+        scales_(nullptr),
+        offsets_(nullptr),
+        T_(T),
+        N_(N) {}
+
+  EmissionMatrix(const uint16_t* data, int T, int N)
+      : type_(EmissionType::FLOAT16),
+        data_(data),
+        scales_(nullptr),
+        offsets_(nullptr),
+        T_(T),
+        N_(N) {}
+
+  EmissionMatrix(
+      const int8_t* data,
+      const float* scales,
+      const float* offsets,
+      int T,
+      int N)
+      : type_(EmissionType::INT8),
+        data_(data),
+        scales_(scales),
+        offsets_(offsets),
+        T_(T),
+        N_(N) {}
+
+  /* View of the frames [start, start + nFrames) */
+  EmissionMatrix frames(int start, int nFrames) const;
+
+  /* Score of token n at frame t (dispatches on the type at each call) */
+  float get(int t, int n) const;
+};
+
+/* Convert to and from IEEE half precision (round to nearest even) */
+uint16_t floatToHalf(float value);
+
+inline float halfToFloat(uint16_t value) {
+  const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  const uint32_t exponent = (value >> 10) & 0x1f;
+  const uint32_t mantissa = value & 0x3ff;
+
+  if (exponent == 0) {
+    /* Zero or subnormal */
+    float result = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -result : result;
+  }
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  float result;
+  std::memcpy(&result, &x, sizeof(result));
+  return result;
+}
+
+/* Quantize a frame of N scores to int8, see EmissionType::INT8 */
+void quantizeFrame(
+    const float* frame,
+    int N,
+    int8_t* quantized,
+    float& scale,
+    float& offset);
+
+/**
+ * Emission readers give the score of token n at frame t for one EmissionType,
+ * so that the decoders can be instantiated for each type without dispatching
+ * on every read. Only the scores actually read are converted.
+ */
+struct FloatEmissionReader {
+  const float* data_;
+  int N_;
+
+  explicit FloatEmissionReader(const EmissionMatrix& emissions)
+      : data_(static_cast<const float*>(emissions.data_)), N_(emissions.N_) {}
+
+  float operator()(int t, int n) const {
+    return data_[t * N_ + n];
+  }
+};
+
+struct HalfEmissionReader {
+  const uint16_t* data_;
+  int N_;
+
+  explicit HalfEmissionReader(const EmissionMatrix& emissions)
+      : data_(static_cast<const uint16_t*>(emissions.data_)),
+        N_(emissions.N_) {}
+
+  float operator()(int t, int n) const {
+    return halfToFloat(data_[t * N_ + n]);
+  }
+};
+
+struct Int8EmissionReader {
+  const int8_t* data_;
+  const float* scales_;
+  const float* offsets_;
+  int N_;
+
+  explicit Int8EmissionReader(const EmissionMatrix& emissions)
+      : data_(static_cast<const int8_t*>(emissions.data_)),
+        scales_(emissions.scales_),
+        offsets_(emissions.offsets_),
+        N_(emissions.N_) {}
+
+  float operator()(int t, int n) const {
+    return offsets_[t] + scales_[t] * data_[t * N_ + n];
+  }
+};
+
+/**
+ * TokenSelection holds the tokens of a frame worth expanding: the `topK` best
+ * ones and/or the ones within `threshold` of the best one (0 to disable
+ * either). The decoders skip the other tokens when expanding hypothesis to
+ * new tokens. The loops over the N scores are branch-free, so that they are
+ * vectorized; only the top-k selection partially sorts a copy of the scores.
+ */
+class TokenSelection {
+ public:
+  template <class EmissionReader>
+  void select(
+      const EmissionReader& emissions,
+      int t,
+      int N,
+      int topK,
+      float threshold) {
+    scores_.resize(N);
+    selected_.resize(N);
+    float maxScore = -std::numeric_limits<float>::infinity();
+    for (int n = 0; n < N; n++) {
+      scores_[n] = emissions(t, n);
+      maxScore = std::max(maxScore, scores_[n]);
+    }
+
+    float cutoff = -std::numeric_limits<float>::infinity();
+    if (threshold > 0) {
+      cutoff = maxScore - threshold;
+    }
+    if (topK > 0 && topK < N) {
+      sorted_.assign(scores_.begin(), scores_.end());
+      std::nth_element(
+          sorted_.begin(),
+          sorted_.begin() + topK - 1,
+          sorted_.end(),
+          std::greater<float>());
+      cutoff = std::max(cutoff, sorted_[topK - 1]);
+    }
+
+    for (int n = 0; n < N; n++) {
+      selected_[n] = scores_[n] >= cutoff;
+    }
+  }
+
+  bool contains(int n) const {
+    return selected_[n];
+  }
+
+ private:
+  std::vector<float> scores_;
+  std::vector<float> sorted_;
+  std::vector<uint8_t> selected_;
+};
+
+} // namespace w2l
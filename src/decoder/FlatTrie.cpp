@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <utility>
+
+#include "FlatTrie.h"
+
+namespace w2l {
+
+FlatTrie::FlatTrie(const TriePtr& trie) {
+  /* Breadth-first traversal: the children of each node get consecutive node
+   * indices, sorted by token index. */
+  std::vector<const TrieNode*> queue{trie->getRoot().get()};
+  for (int head = 0; head < queue.size(); head++) {
+    const TrieNode* node = queue[head];
+
+    std::vector<std::pair<int, const TrieNode*>> children;
+    children.reserve(node->children_.size());
+    for (const auto& child : node->children_) {
+      children.emplace_back(child.first, child.second.get());
+    }
+    std::sort(children.begin(), children.end());
+
+    FlatTrieNode flatNode;
+    flatNode.idx_ = node->idx_;
+    flatNode.firstChild_ = queue.size();
+    flatNode.nChildren_ = children.size();
+    flatNode.firstLabel_ = labelStorage_.size();
+    flatNode.nLabel_ = node->nLabel_;
+    flatNode.maxScore_ = node->maxScore_;
+    nodeStorage_.push_back(flatNode);
+
+    for (int i = 0; i < node->nLabel_; i++) {
+      labelStorage_.push_back(*node->label_[i]);
+      scoreStorage_.push_back(node->score_[i]);
+    }
+    for (const auto& child : children) {
+      queue.push_back(child.second);
+    }
+  }
+
+  nodes_ = nodeStorage_.data();
+  nNodes_ = nodeStorage_.size();
+  labels_ = labelStorage_.data();
+  scores_ = scoreStorage_.data();
+  nLabels_ = labelStorage_.size();
+}
+
+FlatTrie::FlatTrie(
+    const FlatTrieNode* nodes,
+    int nNodes,
+    const TrieLabel* labels,
+    const float* scores,
+    int nLabels,
+    std::shared_ptr<const void> storage)
+    : storage_(std::move(storage)),
+      nodes_(nodes),
+      nNodes_(nNodes),
+      labels_(labels),
+      scores_(scores),
+      nLabels_(nLabels) {}
+
+int FlatTrie::search(const std::vector<int>& indices) const {
+  int node = getRoot();
+  for (auto idx : indices) {
+    const FlatTrieNode* current = getNode(node);
+    const FlatTrieNode* begin = nodes_ + current->firstChild_;
+    const FlatTrieNode* end = begin + current->nChildren_;
+    auto child = std::lower_bound(
+        begin, end, idx, [](const FlatTrieNode& n, int idx) {
+          return n.idx_ < idx;
+        });
+    if (child == end || child->idx_ != idx) {
+      return -1;
+    }
+    node = child - nodes_;
+  }
+  return node;
+}
+
+} // namespace w2l
@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "Trie.h"
+
+namespace w2l {
+
+/**
+ * FlatTrieNode is the node structure in FlatTrie. Nodes are referred to by
+ * their 32-bit index in FlatTrie, and the children of a node are stored
+ * contiguously in [firstChild_, firstChild_ + nChildren_).
+ */
+struct FlatTrieNode {
+  int idx_; // Token index
+  int firstChild_; // Node index of the first child
+  int nChildren_; // Number of children
+  int firstLabel_; // Index of the first label in the label array
+  int nLabel_; // Number of labels, positive only for completed tokens
+  float maxScore_; // Same as TrieNode::maxScore_ (smeared score)
+};
+
+/**
+ * FlatTrie is a frozen, read-only copy of a (smeared) Trie. Nodes are laid out
+ * in breadth-first order in a single array, and labels and their scores in two
+ * more arrays, so that the decoders can walk the lexicon with plain node
+ * indices instead of chasing pointers and hashing in each TrieNode.
+ */
+class FlatTrie {
+ public:
+  /* Build from a Trie. Smearing should be done before freezing it. */
+  explicit FlatTrie(const TriePtr& trie);
+
+  /**
+   * Wrap arrays laid out as in a FlatTrie, e.g. mapped from a file, without
+   * copying them. `storage` owns the memory and is kept alive with the trie.
+   */
+  FlatTrie(
+      const FlatTrieNode* nodes,
+      int nNodes,
+      const TrieLabel* labels,
+      const float* scores,
+      int nLabels,
+      std::shared_ptr<const void> storage);
+
+  /* Return the index of the root node */
+  int getRoot() const {
+    return 0;
+  }
+
+  /* Return the node with a given node index */
+  const FlatTrieNode* getNode(int node) const {
+    return &nodes_[node];
+  }
+
+  /* Return the i-th label of a node */
+  const TrieLabel* getLabel(const FlatTrieNode* node, int i) const {
+    return &labels_[node->firstLabel_ + i];
+  }
+
+  /* Return the score of the i-th label of a node */
+  float getScore(const FlatTrieNode* node, int i) const {
+    return scores_[node->firstLabel_ + i];
+  }
+
+  /* Returns the number of nodes */
+  int getNumNodes() const {
+    return nNodes_;
+  }
+
+  /* Returns the number of labels */
+  int getNumLabels() const {
+    return nLabels_;
+  }
+
+  /* The arrays of nodes, labels and scores, e.g. to serialize them */
+  const FlatTrieNode* nodes() const {
+    return nodes_;
+  }
+
+  const TrieLabel* labels() const {
+    return labels_;
+  }
+
+  const float* scores() const {
+    return scores_;
+  }
+
+  /* Get the node index for a given token (-1 if not found) */
+  int search(const std::vector<int>& indices) const;
+
+ private:
+  /* Storage of a trie built from a Trie */
+  std::vector<FlatTrieNode> nodeStorage_;
+  std::vector<TrieLabel> labelStorage_;
+  std::vector<float> scoreStorage_;
+  /* Storage of a trie wrapping external arrays */
+  std::shared_ptr<const void> storage_;
+
+  const FlatTrieNode* nodes_;
+  int nNodes_;
+  const TrieLabel* labels_;
+  const float* scores_;
+  int nLabels_;
+};
+
+typedef std::shared_ptr<FlatTrie> FlatTriePtr;
+
+} // namespace w2l
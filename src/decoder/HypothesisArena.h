@@ -0,0 +1,140 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+namespace w2l {
+
+const int kArenaBlockSize = 65536;
+
+/**
+ * HypothesisArena stores the hypothesis of each decoded frame. Frames are
+ * appended one after another and carved out of large blocks of states, so that
+ * the states of a frame are contiguous and never move once allocated (parent
+ * back-pointers stay valid). Dropping frames from the front (after pruning)
+ * recycles the blocks which are no longer used by any frame, so that steady
+ * state online decoding does not allocate at all.
+ */
+template <class DecoderState>
+class HypothesisArena {
+ public:
+  explicit HypothesisArena(int blockSize = kArenaBlockSize)
+      : blockSize_(blockSize), nDroppedFrames_(0), bytes_(0), peakBytes_(0) {}
+
+  /* Drop all the frames, but keep the blocks for reuse */
+  void clear() {
+    for (auto& block : blocks_) {
+      recycle(block);
+    }
+    blocks_.clear();
+    frames_.clear();
+    nDroppedFrames_ = 0;
+  }
+
+  /* Number of frames in the arena */
+  int nFrames() const {
+    return frames_.size();
+  }
+
+  /* Append a new frame with `size` states and return its first state */
+  DecoderState* append(int size) {
+    if (blocks_.empty() ||
+        blocks_.back().states.size() - blocks_.back().used < size) {
+      blocks_.push_back(newBlock(size));
+    }
+    Block& block = blocks_.back();
+    DecoderState* states = block.states.data() + block.used;
+    block.used += size;
+    block.lastFrame = nDroppedFrames_ + frames_.size();
+    frames_.push_back(Frame{states, size});
+    return states;
+  }
+
+  DecoderState* frame(int i) {
+    return frames_[i].states;
+  }
+
+  const DecoderState* frame(int i) const {
+    return frames_[i].states;
+  }
+
+  int frameSize(int i) const {
+    return frames_[i].size;
+  }
+
+  /**
+   * Drop the first `n` frames. The remaining frames are renumbered from 0 but
+   * keep their memory location. Blocks with no remaining frame are recycled.
+   */
+  void dropFront(int n) {
+    frames_.erase(frames_.begin(), frames_.begin() + n);
+    nDroppedFrames_ += n;
+    while (!blocks_.empty() && blocks_.front().lastFrame < nDroppedFrames_) {
+      recycle(blocks_.front());
+      blocks_.pop_front();
+    }
+  }
+
+  /* Bytes of states currently allocated (in use or free for reuse) */
+  size_t bytes() const {
+    return bytes_;
+  }
+
+  /* Largest value of bytes() so far */
+  size_t peakBytes() const {
+    return peakBytes_;
+  }
+
+ private:
+  struct Frame {
+    DecoderState* states;
+    int size;
+  };
+
+  struct Block {
+    std::vector<DecoderState> states;
+    int used; // Number of states carved out of this block
+    int lastFrame; // Absolute index of the last frame using this block
+  };
+
+  int blockSize_;
+  std::deque<Block> blocks_; // Blocks in use, in frame order
+  std::vector<std::vector<DecoderState>> freeBlocks_; // Blocks for reuse
+  std::vector<Frame> frames_;
+  int nDroppedFrames_; // Number of frames dropped from the front so far
+  size_t bytes_;
+  size_t peakBytes_;
+
+  Block newBlock(int size) {
+    Block block;
+    block.used = 0;
+    block.lastFrame = 0;
+    for (auto it = freeBlocks_.begin(); it != freeBlocks_.end(); ++it) {
+      if (it->size() >= size) {
+        block.states.swap(*it);
+        freeBlocks_.erase(it);
+        return block;
+      }
+    }
+    block.states.resize(std::max(size, blockSize_));
+    bytes_ += block.states.size() * sizeof(DecoderState);
+    peakBytes_ = std::max(peakBytes_, bytes_);
+    return block;
+  }
+
+  void recycle(Block& block) {
+    freeBlocks_.emplace_back();
+    freeBlocks_.back().swap(block.states);
+  }
+};
+
+} // namespace w2l
@@ -11,7 +11,7 @@
 namespace w2l {
 
 KenLM::KenLM(const std::string& path) {
-  model = lm::ngram::LoadVirtual(path.c_str());
+  model.reset(lm::ngram::LoadVirtual(path.c_str()));
   if (!model) {
     LOG(FATAL) << "[KenLM] LM loading failed.";
   }
@@ -21,40 +21,74 @@ KenLM::KenLM(const std::string& path) {
   }
 }
 
+KenLM::KenLM(const std::shared_ptr<const lm::base::Model>& model)
+    : model(model), vocab(&model->BaseVocabulary()) {}
+
 int KenLM::index(const std::string& token) {
   return vocab->Index(token.c_str());
 }
 
-LMStatePtr KenLM::start(bool isNull) {
+LMStateIdx KenLM::start(bool isNull) {
+  if (states_.size() > kLMStatePoolCapacity) {
+    states_.clear();
+    generation_++;
+  }
   lm::ngram::State outState;
   if (isNull) {
     model->NullContextWrite(&outState);
   } else {
     model->BeginSentenceWrite(&outState);
   }
-  return std::make_shared<KenLMState>(outState);
+  return states_.intern(outState);
 }
 
-LMStatePtr KenLM::score(const LMStatePtr& inState, int tokenIdx, float& score) {
-  auto inState_ = static_cast<KenLMState*>(inState.get());
+LMStateIdx KenLM::score(LMStateIdx inState, int tokenIdx, float& score) {
   lm::ngram::State outState;
-  score = model->BaseScore(&inState_->state_, tokenIdx, &outState);
-  return std::make_shared<KenLMState>(outState);
+  score = model->BaseScore(&states_.get(inState), tokenIdx, &outState);
+  return states_.intern(outState);
 }
 
-LMStatePtr KenLM::finish(const LMStatePtr& inState, float& score) {
+void KenLM::scoreBatch(
+    const LMStateIdx* inStates,
+    const int* tokenIdx,
+    int n,
+    LMStateIdx* outStates,
+    float* scores) {
+  lm::ngram::State outState;
+  for (int i = 0; i < n; i++) {
+    scores[i] =
+        model->BaseScore(&states_.get(inStates[i]), tokenIdx[i], &outState);
+    outStates[i] = states_.intern(outState);
+  }
+}
+
+LMStateIdx KenLM::finish(LMStateIdx inState, float& score) {
   /* DEBUG: could skip the end sentence </s> */
-  auto inState_ = static_cast<KenLMState*>(inState.get());
   lm::ngram::State outState;
-  score = model->BaseScore(&inState_->state_, vocab->EndSentence(), &outState);
-  return std::make_shared<KenLMState>(outState);
+  score = model->BaseScore(
+      &states_.get(inState), vocab->EndSentence(), &outState);
+  return states_.intern(outState);
+}
+
+int KenLM::stateGeneration() const {
+  return generation_;
+}
+
+void KenLM::compactStates(LMStateIdx* states, int n) {
+  liveStates_.clear();
+  for (int i = 0; i < n; i++) {
+    states[i] = liveStates_.intern(states_.get(states[i]));
+  }
+  states_.swap(liveStates_);
+  generation_++;
+}
+
+int KenLM::nStates() const {
+  return states_.size();
 }
 
-int KenLM::compareState(const LMStatePtr& state1, const LMStatePtr& state2)
-    const {
-  auto state1_ = static_cast<KenLMState*>(state1.get());
-  auto state2_ = static_cast<KenLMState*>(state2.get());
-  return state1_->state_.Compare(state2_->state_);
+LMPtr KenLM::clone() const {
+  return std::make_shared<KenLM>(model);
 }
 
 } // namespace w2l
@@ -15,14 +15,14 @@
 
 namespace w2l {
 /**
- * KenLMState extends LMState by adding a state object from KenLM, which
- * contains context length, indicies and compare functions
+ * KenLMStateHash hashes a state object from KenLM, which contains context
+ * length, indicies and compare functions
  * https://github.com/kpu/kenlm/blob/master/lm/state.hh.
  */
-struct KenLMState : public LMState {
-  lm::ngram::State state_;
-
-  explicit KenLMState(lm::ngram::State state) : state_(state) {}
+struct KenLMStateHash {
+  size_t operator()(const lm::ngram::State& state) const {
+    return lm::ngram::hash_value(state);
+  }
 };
 
 /**
@@ -32,21 +32,37 @@ class KenLM : public LM {
  public:
   int index(const std::string& token) override;
 
-  LMStatePtr start(bool isNull) override;
+  LMStateIdx start(bool isNull) override;
+
+  LMStateIdx score(LMStateIdx inState, int tokenIdx, float& score) override;
+
+  void scoreBatch(
+      const LMStateIdx* inStates,
+      const int* tokenIdx,
+      int n,
+      LMStateIdx* outStates,
+      float* scores) override;
 
-  LMStatePtr score(const LMStatePtr& inState, int tokenIdx, float& score)
-      override;
+  LMStateIdx finish(LMStateIdx inState, float& score) override;
 
-  LMStatePtr finish(const LMStatePtr& inState, float& score) override;
+  int stateGeneration() const override;
 
-  int compareState(const LMStatePtr& state1, const LMStatePtr& state2)
-      const override;
+  void compactStates(LMStateIdx* states, int n) override;
+
+  int nStates() const override;
+
+  LMPtr clone() const override;
 
   explicit KenLM(const std::string& path);
 
+  explicit KenLM(const std::shared_ptr<const lm::base::Model>& model);
+
  private:
-  const lm::base::Model* model;
+  std::shared_ptr<const lm::base::Model> model;
   const lm::base::Vocabulary* vocab;
+  LMStatePool<lm::ngram::State, KenLMStateHash> states_;
+  LMStatePool<lm::ngram::State, KenLMStateHash> liveStates_; // For compaction
+  int generation_ = 0;
 };
 
 typedef std::shared_ptr<KenLM> KenLMPtr;
@@ -7,18 +7,100 @@
  */
 
 #pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace w2l {
+
+const int kLMStatePoolCapacity = 1 << 20;
+
 /**
- * LMState is a base class for language model states.
+ * LMStateIdx is a handle to a language model state. States are interned in a
+ * pool owned by the LM instance, so that identical contexts share one entry
+ * and comparing two states is an integer comparison. A handle is only valid
+ * for the LM instance that returned it.
  */
-struct LMState {
-  LMState() = default;
-  virtual ~LMState() = default;
-};
+typedef int LMStateIdx;
+
+/**
+ * LMStatePool interns the states of a language model: each distinct state is
+ * stored once and referred to by its index in insertion order. Lookups go
+ * through an open-addressing (linear probing) table of state indices.
+ */
+template <class State, class Hash, class Equal = std::equal_to<State>>
+class LMStatePool {
+ public:
+  LMStatePool() : mask_(0) {}
+
+  /* Return the index of a state, adding it to the pool if needed */
+  LMStateIdx intern(const State& state) {
+    if (2 * (states_.size() + 1) > slots_.size()) {
+      rehash(std::max<size_t>(2 * slots_.size(), 1024));
+    }
+    uint32_t hash = Hash()(state);
+    for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+      Slot& slot = slots_[i];
+      if (slot.idx < 0) {
+        slot.hash = hash;
+        slot.idx = states_.size();
+        states_.push_back(state);
+        return slot.idx;
+      }
+      if (slot.hash == hash && Equal()(states_[slot.idx], state)) {
+        return slot.idx;
+      }
+    }
+  }
 
-typedef std::shared_ptr<LMState> LMStatePtr;
+  const State& get(LMStateIdx idx) const {
+    return states_[idx];
+  }
+
+  int size() const {
+    return states_.size();
+  }
+
+  void clear() {
+    states_.clear();
+    std::fill(slots_.begin(), slots_.end(), Slot());
+  }
+
+  void swap(LMStatePool& other) {
+    states_.swap(other.states_);
+    slots_.swap(other.slots_);
+    std::swap(mask_, other.mask_);
+  }
+
+ private:
+  struct Slot {
+    uint32_t hash = 0;
+    LMStateIdx idx = -1; // -1 for empty slots
+  };
+
+  std::vector<State> states_;
+  std::vector<Slot> slots_;
+  size_t mask_;
+
+  void rehash(size_t nSlots) {
+    std::vector<Slot> oldSlots(nSlots);
+    oldSlots.swap(slots_);
+    mask_ = nSlots - 1;
+    for (const Slot& slot : oldSlots) {
+      if (slot.idx < 0) {
+        continue;
+      }
+      size_t i = slot.hash & mask_;
+      while (slots_[i].idx >= 0) {
+        i = (i + 1) & mask_;
+      }
+      slots_[i] = slot;
+    }
+  }
+};
 
 /**
  * LM is a thin wrapper for laguage models. We abstrct several common methods
@@ -29,22 +111,63 @@ class LM {
   /* Return the index in the language model of a given token. */
   virtual int index(const std::string& token) = 0;
 
-  /* Initialize or reset language model */
-  virtual LMStatePtr start(bool isNull) = 0;
+  /**
+   * Initialize or reset language model. Once the state pool is larger than
+   * kLMStatePoolCapacity it is recycled here, which invalidates all the state
+   * handles returned before.
+   */
+  virtual LMStateIdx start(bool isNull) = 0;
 
   /**
    * Query the language model given input language model state and a specific
    * token, return a new language model state and score.
    */
-  virtual LMStatePtr
-  score(const LMStatePtr& inState, int tokenIdx, float& score) = 0;
+  virtual LMStateIdx score(LMStateIdx inState, int tokenIdx, float& score) = 0;
+
+  /**
+   * Query the language model for `n` (state, token) pairs at once, and fill
+   * the parallel arrays `outStates` and `scores`. Decoders gather the queries
+   * of a frame into one call, so that an LM can amortize work across them.
+   */
+  virtual void scoreBatch(
+      const LMStateIdx* inStates,
+      const int* tokenIdx,
+      int n,
+      LMStateIdx* outStates,
+      float* scores) {
+    for (int i = 0; i < n; i++) {
+      outStates[i] = score(inStates[i], tokenIdx[i], scores[i]);
+    }
+  }
 
   /* Query the language model and finish decoding. */
-  virtual LMStatePtr finish(const LMStatePtr& inState, float& score) = 0;
+  virtual LMStateIdx finish(LMStateIdx inState, float& score) = 0;
+
+  /**
+   * Return the number of times the state pool has been recycled so far. State
+   * handles from different generations must not be mixed.
+   */
+  virtual int stateGeneration() const = 0;
+
+  /**
+   * Recycle the state pool but keep the `n` states of `states`, which are
+   * replaced by their new handles. This starts a new generation: all the
+   * other handles become invalid. Decoders call it with the states of their
+   * live hypothesis when they prune, so that the pool does not grow with the
+   * length of the audio. LMs without a state pool do nothing.
+   */
+  virtual void compactStates(LMStateIdx* /* states */, int /* n */) {}
 
-  /* Compare two language model states. */
-  virtual int compareState(const LMStatePtr& state1, const LMStatePtr& state2)
-      const = 0;
+  /* Return the number of states in the pool */
+  virtual int nStates() const {
+    return 0;
+  }
+
+  /**
+   * Return a new instance sharing the underlying model, but with its own state
+   * pool. An LM instance should be used by one decoder (thread) at a time.
+   */
+  virtual std::shared_ptr<LM> clone() const = 0;
 
  protected:
   LM() = default;
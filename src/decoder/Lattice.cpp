@@ -0,0 +1,175 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "Lattice.h"
+
+namespace w2l {
+
+namespace {
+
+struct LatticeHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t nFrames;
+  int32_t nArcs;
+  int32_t nEnds;
+  float lmWeight;
+  float wordScore;
+  float unkScore;
+  int32_t unkWord;
+};
+
+static_assert(sizeof(LatticeHeader) == 40, "Invalid header size");
+static_assert(sizeof(LatticeArc) == 24, "Invalid arc size");
+static_assert(sizeof(LatticeEnd) == 12, "Invalid end size");
+
+} // namespace
+
+std::vector<int> Lattice::words(int i) const {
+  std::vector<int> res;
+  for (int a = ends_[i].arc_; a >= 0; a = arcs_[a].prev_) {
+    res.push_back(arcs_[a].word_);
+  }
+  std::reverse(res.begin(), res.end());
+  return res;
+}
+
+float Lattice::amScore(int i) const {
+  float score = ends_[i].amScore_;
+  for (int a = ends_[i].arc_; a >= 0; a = arcs_[a].prev_) {
+    score += arcs_[a].amScore_;
+  }
+  return score;
+}
+
+float Lattice::lmScore(int i) const {
+  float score = ends_[i].lmScore_;
+  for (int a = ends_[i].arc_; a >= 0; a = arcs_[a].prev_) {
+    score += arcs_[a].lmScore_;
+  }
+  return score;
+}
+
+float Lattice::score(int i) const {
+  float score = ends_[i].amScore_ + lmWeight_ * ends_[i].lmScore_;
+  for (int a = ends_[i].arc_; a >= 0; a = arcs_[a].prev_) {
+    const LatticeArc& arc = arcs_[a];
+    score += arc.amScore_ + lmWeight_ * arc.lmScore_ +
+        (arc.word_ == unkWord_ ? unkScore_ : wordScore_);
+  }
+  return score;
+}
+
+void saveLattice(std::ostream& stream, const Lattice& lattice) {
+  LatticeHeader header;
+  std::memcpy(header.magic, kLatticeMagic, sizeof(header.magic));
+  header.version = kLatticeVersion;
+  header.nFrames = lattice.nFrames_;
+  header.nArcs = lattice.arcs_.size();
+  header.nEnds = lattice.ends_.size();
+  header.lmWeight = lattice.lmWeight_;
+  header.wordScore = lattice.wordScore_;
+  header.unkScore = lattice.unkScore_;
+  header.unkWord = lattice.unkWord_;
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  stream.write(
+      reinterpret_cast<const char*>(lattice.arcs_.data()),
+      lattice.arcs_.size() * sizeof(LatticeArc));
+  stream.write(
+      reinterpret_cast<const char*>(lattice.ends_.data()),
+      lattice.ends_.size() * sizeof(LatticeEnd));
+  if (!stream.good()) {
+    LOG(FATAL) << "[Lattice] Error writing lattice";
+  }
+}
+
+bool loadLattice(std::istream& stream, Lattice& lattice) {
+  LatticeHeader header;
+  stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (stream.gcount() == 0 && stream.eof()) {
+    return false;
+  }
+  if (stream.gcount() != sizeof(header) ||
+      std::memcmp(header.magic, kLatticeMagic, sizeof(header.magic)) ||
+      header.version != kLatticeVersion || header.nArcs < 0 ||
+      header.nEnds < 0) {
+    LOG(FATAL) << "[Lattice] Invalid lattice header";
+  }
+  lattice.nFrames_ = header.nFrames;
+  lattice.lmWeight_ = header.lmWeight;
+  lattice.wordScore_ = header.wordScore;
+  lattice.unkScore_ = header.unkScore;
+  lattice.unkWord_ = header.unkWord;
+  lattice.arcs_.resize(header.nArcs);
+  lattice.ends_.resize(header.nEnds);
+  stream.read(
+      reinterpret_cast<char*>(lattice.arcs_.data()),
+      lattice.arcs_.size() * sizeof(LatticeArc));
+  stream.read(
+      reinterpret_cast<char*>(lattice.ends_.data()),
+      lattice.ends_.size() * sizeof(LatticeEnd));
+  if (!stream.good()) {
+    LOG(FATAL) << "[Lattice] Truncated lattice";
+  }
+
+  /* The paths are followed without checks from now on */
+  for (int a = 0; a < lattice.arcs_.size(); a++) {
+    if (lattice.arcs_[a].prev_ < -1 || lattice.arcs_[a].prev_ >= a) {
+      LOG(FATAL) << "[Lattice] Invalid previous arc of arc " << a;
+    }
+  }
+  for (const auto& end : lattice.ends_) {
+    if (end.arc_ < -1 || end.arc_ >= static_cast<int>(lattice.arcs_.size())) {
+      LOG(FATAL) << "[Lattice] Invalid arc of a final hypothesis";
+    }
+  }
+  return true;
+}
+
+void rescoreLattice(
+    Lattice& lattice,
+    const LMPtr& lm,
+    const std::vector<int>& lmIndices,
+    const float lmWeight) {
+  /* The previous arc of an arc comes first, so its LM state is known */
+  std::vector<LMStateIdx> lmStates(lattice.arcs_.size());
+  const LMStateIdx startState = lm->start(0);
+  for (int a = 0; a < lattice.arcs_.size(); a++) {
+    LatticeArc& arc = lattice.arcs_[a];
+    lmStates[a] = lm->score(
+        arc.prev_ >= 0 ? lmStates[arc.prev_] : startState,
+        lmIndices[arc.word_],
+        arc.lmScore_);
+  }
+  for (auto& end : lattice.ends_) {
+    lm->finish(end.arc_ >= 0 ? lmStates[end.arc_] : startState, end.lmScore_);
+  }
+  lattice.lmWeight_ = lmWeight;
+
+  std::vector<float> scores(lattice.ends_.size());
+  std::vector<int> order(lattice.ends_.size());
+  for (int i = 0; i < lattice.ends_.size(); i++) {
+    scores[i] = lattice.score(i);
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&scores](int i, int j) {
+    return scores[i] > scores[j];
+  });
+  std::vector<LatticeEnd> ends(lattice.ends_.size());
+  for (int i = 0; i < order.size(); i++) {
+    ends[i] = lattice.ends_[order[i]];
+  }
+  lattice.ends_.swap(ends);
+}
+
+} // namespace w2l
@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+
+#include "LM.h"
+
+namespace w2l {
+
+/**
+ * LatticeArc is a word of a decoded path. Its frames follow the ones of the
+ * previous arc, so that the arc also covers the silences and blanks before
+ * the word.
+ */
+struct LatticeArc {
+  int32_t prev_; // Arc of the previous word in the path (-1 for none)
+  int32_t word_; // Word index (TrieLabel::usr_)
+  int32_t startFrame_; // First frame of the arc
+  int32_t endFrame_; // Frame in which the word is completed
+  float amScore_; // Score of the frames, without the LM and word scores
+  float lmScore_; // Unweighted LM score of the word
+};
+
+/**
+ * LatticeEnd is a final hypothesis of the decoder: the last word of its path
+ * and the frames after it, up to the end of the sentence.
+ */
+struct LatticeEnd {
+  int32_t arc_; // Last arc of the path (-1 for no word)
+  float amScore_; // Score of the frames after the last word
+  float lmScore_; // Unweighted LM score after the last word (sentence end)
+};
+
+/**
+ * Lattice holds the words of the final hypothesis of a lexicon decoder (see
+ * DecoderOptions::lattice_). The arcs form a prefix tree: the paths share the
+ * arcs of their common words, and following prev_ from the arc of an end
+ * gives the words of its hypothesis backwards. The score of a path is:
+ *
+ * sum(amScore_) + lmWeight_ * sum(lmScore_) + wordScore_ * |W_known| +
+ * unkScore_ * |W_unknown|
+ *
+ * so that it can be rescored with other weights, or another LM, without the
+ * hypothesis of the decoder.
+ */
+struct Lattice {
+  int32_t nFrames_ = 0;
+  float lmWeight_ = 0;
+  float wordScore_ = 0;
+  float unkScore_ = 0;
+  int32_t unkWord_ = -1; // Word index of the unknown word
+  std::vector<LatticeArc> arcs_; // Previous arcs first
+  std::vector<LatticeEnd> ends_; // Best first
+
+  /* Words of the path of ends_[i] */
+  std::vector<int> words(int i) const;
+
+  /* Sums of the AM and (unweighted) LM scores of the path of ends_[i] */
+  float amScore(int i) const;
+
+  float lmScore(int i) const;
+
+  /* Score of the path of ends_[i], as in the decoder */
+  float score(int i) const;
+};
+
+/**
+ * Binary lattice format: a fixed size header, then the arcs and the ends as
+ * they are in memory. Several lattices can be written to the same stream one
+ * after another.
+ */
+const char kLatticeMagic[8] = {'W', '2', 'L', 'L', 'A', 'T', 'T', '\0'};
+const uint32_t kLatticeVersion = 1;
+
+void saveLattice(std::ostream& stream, const Lattice& lattice);
+
+/* Read the next lattice of `stream`, return false at the end of the stream */
+bool loadLattice(std::istream& stream, Lattice& lattice);
+
+/**
+ * Second pass: replace the LM scores of `lattice` with the ones of `lm`, e.g.
+ * a larger LM than the one of the decoder, and its LM weight with `lmWeight`.
+ * The ends are then sorted by their new score, best first. lmIndices maps
+ * the words of the arcs to their index in `lm`.
+ *
+ * Each arc is scored once, from the LM state of its previous arc, so that the
+ * paths sharing words share their LM queries. As for the decoders, an LM
+ * instance is to be used by one thread at a time.
+ */
+void rescoreLattice(
+    Lattice& lattice,
+    const LMPtr& lm,
+    const std::vector<int>& lmIndices,
+    const float lmWeight);
+
+} // namespace w2l
@@ -19,85 +19,318 @@
 
 namespace w2l {
 
-void LexiconDecoder::candidatesReset() {
-  nCandidates_ = 0;
+void LexiconDecoder::candidatesReset(const int nHyp) {
   candidatesBestScore_ = kNegativeInfinity;
+  frameThreshold_ =
+      std::min(opt_.beamThreshold_, frameThreshold_ * kBeamRelaxFactor);
+
+  nBuffers_ = std::max(1, std::min(opt_.nThreads_, nHyp / kMinHypPerThread));
+  if (buffers_.size() < nBuffers_) {
+    buffers_.resize(nBuffers_);
+  }
+  for (int b = 0; b < nBuffers_; b++) {
+    LexiconCandidates& buffer = buffers_[b];
+    buffer.nCandidates_ = 0;
+    buffer.maxCandidates_ = (opt_.maxCandidates_ + nBuffers_ - 1) / nBuffers_;
+    buffer.bestScore_ = kNegativeInfinity;
+    buffer.threshold_ = frameThreshold_;
+    buffer.proposals_.clear();
+    buffer.proposalLmStates_.clear();
+    buffer.proposalLmTokens_.clear();
+    buffer.proposalLmOffsets_.clear();
+  }
 }
 
 void LexiconDecoder::candidatesAdd(
-    const LMStatePtr& lmState,
-    const TrieNode* lex,
+    LexiconCandidates& buffer,
+    const LMStateIdx lmState,
+    const int lex,
     const LexiconDecoderState* parent,
     const float score,
     const int token,
     const TrieLabel* word,
-    const bool prevBlank) {
-  if (isGoodCandidate(candidatesBestScore_, score, opt_.beamThreshold_)) {
-    if (nCandidates_ == candidates_.size()) {
-      candidates_.resize(candidates_.size() + kBufferBucketSize);
+    const bool prevBlank,
+    const float lmScore) {
+  W2L_DECODER_STATS_ADD(buffer.stats_.nCandidates_, 1);
+  if (isGoodCandidate(buffer.bestScore_, score, buffer.threshold_)) {
+    if (buffer.maxCandidates_ > 0 &&
+        buffer.nCandidates_ >= buffer.maxCandidates_) {
+      /* Tighten the threshold to stay within the budget of the frame */
+      int nKept = capCandidates(
+          buffer.histogram_,
+          buffer.candidates_,
+          buffer.nCandidates_,
+          buffer.nCandidates_ / 2,
+          buffer.bestScore_,
+          buffer.threshold_);
+      W2L_DECODER_STATS_ADD(buffer.stats_.nCapHits_, 1);
+      W2L_DECODER_STATS_ADD(
+          buffer.stats_.nCapped_, buffer.nCandidates_ - nKept);
+      buffer.nCandidates_ = nKept;
+    }
+    if (buffer.nCandidates_ == buffer.candidates_.size()) {
+      buffer.candidates_.resize(buffer.candidates_.size() + kBufferBucketSize);
     }
 
-    candidates_[nCandidates_] = LexiconDecoderState(
+    LexiconDecoderState& candidate = buffer.candidates_[buffer.nCandidates_];
+    candidate = LexiconDecoderState(
         lmState, lex, parent, score, token, word, prevBlank);
-    ++nCandidates_;
+    candidate.lmScore_ += lmScore;
+    ++buffer.nCandidates_;
+    W2L_DECODER_STATS_MAX(buffer.stats_.maxBufferSize_, buffer.nCandidates_);
+  } else {
+    W2L_DECODER_STATS_ADD(buffer.stats_.nRejected_, 1);
+  }
+}
+
+void LexiconDecoder::proposalsAdd(
+    LexiconCandidates& buffer,
+    const LMStateIdx lmState,
+    const int lmToken,
+    const float lmOffset,
+    const int lex,
+    const LexiconDecoderState* parent,
+    const float score,
+    const int token,
+    const TrieLabel* word) {
+  buffer.proposals_.emplace_back(-1, lex, parent, score, token, word);
+  buffer.proposalLmStates_.push_back(lmState);
+  buffer.proposalLmTokens_.push_back(lmToken);
+  buffer.proposalLmOffsets_.push_back(lmOffset);
+}
+
+void LexiconDecoder::proposalsScore() {
+  W2L_DECODER_STATS_TIC(statsTimer_);
+  for (int b = 0; b < nBuffers_; b++) {
+    LexiconCandidates& buffer = buffers_[b];
+    const int nProposals = buffer.proposals_.size();
+    W2L_DECODER_STATS_ADD(stats_.nLmCalls_, nProposals);
+    buffer.proposalNewLmStates_.resize(nProposals);
+    buffer.proposalLmScores_.resize(nProposals);
+    lm_->scoreBatch(
+        buffer.proposalLmStates_.data(),
+        buffer.proposalLmTokens_.data(),
+        nProposals,
+        buffer.proposalNewLmStates_.data(),
+        buffer.proposalLmScores_.data());
+    for (int i = 0; i < nProposals; i++) {
+      buffer.proposals_[i].lmState_ = buffer.proposalNewLmStates_[i];
+    }
+  }
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.expandTime_);
+}
+
+void LexiconDecoder::storeFrame() {
+  W2L_DECODER_STATS_TIC(statsTimer_);
+#pragma omp parallel for schedule(static, 1) num_threads(nBuffers_) \
+    if (nBuffers_ > 1)
+  for (int b = 0; b < nBuffers_; b++) {
+    storeProposals(buffers_[b]);
+  }
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.expandTime_);
+  candidatesStore(false);
+  if (opt_.lattice_) {
+    latticeStore();
+    /* Drop the arcs of the paths which left the beam once they outnumber the
+     * arcs kept by the last compaction, so that offline decoding does not
+     * accumulate the arcs of every frame */
+    const int maxArcs = std::max(
+        kLatticeCompactBeams * opt_.beamSize_,
+        kLatticeCompactFactor * nLiveArcs_);
+    if (arcs_.size() > maxArcs) {
+      latticeCompact();
+    }
+  }
+  storeTraceback();
+}
+
+void LexiconDecoder::storeStep(const bool expanded) {
+  if (expanded) {
+    storeFrame();
+  }
+  ++nDecodedFrames_;
+  W2L_DECODER_STATS_ADD(stats_.nFrames_, 1);
+}
+
+int LexiconDecoder::mergePartitions() {
+  const float minScore = candidatesBestScore_ - frameThreshold_;
+#pragma omp parallel for schedule(static, 1) num_threads(nBuffers_)
+  for (int p = 0; p < nBuffers_; p++) {
+    LexiconCandidates& partition = buffers_[p];
+    /* Valid candidates of all the buffers whose key falls in partition p */
+    int size = 0;
+    for (int b = 0; b < nBuffers_; b++) {
+      LexiconCandidates& buffer = buffers_[b];
+      for (int i = 0; i < buffer.nCandidates_; i++) {
+        LexiconDecoderState* candidate = &buffer.candidates_[i];
+        if (candidate->score_ < minScore) {
+          if (b == p) {
+            W2L_DECODER_STATS_ADD(partition.stats_.nPruned_, 1);
+          }
+          continue;
+        }
+        const uint64_t hash = mergeKey(candidate) * 0x9E3779B97F4A7C15ULL;
+        if ((hash >> 32) % nBuffers_ != p) {
+          continue;
+        }
+        if (partition.partition_.size() == size) {
+          partition.partition_.resize(size + kBufferBucketSize);
+        }
+        partition.partition_[size++] = candidate;
+      }
+    }
+
+    int nMerged = size > 0
+        ? mergeCandidates(partition.partition_, size, partition.mergeTable_)
+        : 0;
+    W2L_DECODER_STATS_ADD(partition.stats_.nMerged_, size - nMerged);
+
+    /* Only the beamSize_ best of a partition can make it to the beam */
+    if (nMerged > opt_.beamSize_) {
+      std::nth_element(
+          partition.partition_.begin(),
+          partition.partition_.begin() + opt_.beamSize_,
+          partition.partition_.begin() + nMerged,
+          [](const LexiconDecoderState* node1,
+             const LexiconDecoderState* node2) {
+            return node1->score_ > node2->score_;
+          });
+      nMerged = opt_.beamSize_;
+    }
+    partition.nPartition_ = nMerged;
+  }
+
+  int nValidHyp = 0;
+  for (int p = 0; p < nBuffers_; p++) {
+    const LexiconCandidates& partition = buffers_[p];
+    if (candidatePtrs_.size() < nValidHyp + partition.nPartition_) {
+      candidatePtrs_.resize(nValidHyp + partition.nPartition_);
+    }
+    std::copy(
+        partition.partition_.begin(),
+        partition.partition_.begin() + partition.nPartition_,
+        candidatePtrs_.begin() + nValidHyp);
+    nValidHyp += partition.nPartition_;
   }
+  return nValidHyp;
 }
 
-void LexiconDecoder::candidatesStore(
-    std::vector<LexiconDecoderState>& nextHyp,
-    const bool returnSorted) {
-  if (nCandidates_ == 0) {
-    return;
+void LexiconDecoder::candidatesStore(const bool returnSorted) {
+  /* Best score and (capped) threshold over all the buffers */
+  int nCandidates = 0;
+  for (int b = 0; b < nBuffers_; b++) {
+    nCandidates += buffers_[b].nCandidates_;
+    candidatesBestScore_ =
+        std::max(candidatesBestScore_, buffers_[b].bestScore_);
+    frameThreshold_ = std::min(frameThreshold_, buffers_[b].threshold_);
   }
 
-  /* Select valid candidates */
-  int nValidHyp = pruneCandidates(
-      candidatePtrs_,
-      candidates_,
-      nCandidates_,
-      candidatesBestScore_,
-      opt_.beamThreshold_);
+  if (nCandidates == 0) {
+    hyp_.append(0);
+  } else if (nBuffers_ > 1) {
+    W2L_DECODER_STATS_TIC(statsTimer_);
+    int nMergedHyp = mergePartitions();
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.mergeTime_);
 
-  /* Sort by (LmState, lex, score) and copy into next hypothesis */
-  nValidHyp = mergeCandidates(nValidHyp);
+    if (opt_.histogramPruning_ && !returnSorted) {
+      nMergedHyp = histogramSelect(
+          histogram_,
+          candidatePtrs_,
+          nMergedHyp,
+          opt_.beamSize_,
+          candidatesBestScore_,
+          frameThreshold_);
+    }
+    storeTopCandidates(
+        hyp_, candidatePtrs_, nMergedHyp, opt_.beamSize_, returnSorted);
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.topKTime_);
+  } else {
+    LexiconCandidates& buffer = buffers_[0];
+
+    /* Select valid candidates */
+    W2L_DECODER_STATS_TIC(statsTimer_);
+    int nValidHyp = pruneCandidates(
+        candidatePtrs_,
+        buffer.candidates_,
+        buffer.nCandidates_,
+        candidatesBestScore_,
+        frameThreshold_);
+    W2L_DECODER_STATS_ADD(stats_.nPruned_, buffer.nCandidates_ - nValidHyp);
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.pruneTime_);
+
+    /* Sort by (LmState, lex, score) and copy into next hypothesis */
+    int nMergedHyp = mergeCandidates(candidatePtrs_, nValidHyp, mergeTable_);
+    W2L_DECODER_STATS_ADD(stats_.nMerged_, nValidHyp - nMergedHyp);
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.mergeTime_);
+
+    /* Sort hypothesis and select top-K */
+    if (opt_.histogramPruning_ && !returnSorted) {
+      nMergedHyp = histogramSelect(
+          histogram_,
+          candidatePtrs_,
+          nMergedHyp,
+          opt_.beamSize_,
+          candidatesBestScore_,
+          frameThreshold_);
+    }
+    storeTopCandidates(
+        hyp_, candidatePtrs_, nMergedHyp, opt_.beamSize_, returnSorted);
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.topKTime_);
+  }
 
-  /* Sort hypothesis and select top-K */
-  storeTopCandidates(
-      nextHyp, candidatePtrs_, nValidHyp, opt_.beamSize_, returnSorted);
+  for (int b = 0; b < nBuffers_; b++) {
+    stats_ += buffers_[b].stats_;
+    buffers_[b].stats_ = DecoderStats();
+  }
 }
 
 void LexiconDecoder::decodeBegin() {
+  /* note: the lm reset itself with :start() */
+  decodeBegin(lm_->start(0));
+}
+
+void LexiconDecoder::decodeBegin(const LMStateIdx startState) {
   hyp_.clear();
-  hyp_.emplace(0, std::vector<LexiconDecoderState>());
+  traceback_.clear();
 
-  /* note: the lm reset itself with :start() */
-  hyp_[0].emplace_back(
-      lm_->start(0), lexicon_->getRoot().get(), nullptr, 0.0, sil_, nullptr);
+  *hyp_.append(1) = LexiconDecoderState(
+      startState, lexicon_->getRoot(), nullptr, 0.0, sil_, nullptr);
+  storeTraceback();
   nDecodedFrames_ = 0;
   nPrunedFrames_ = 0;
+  arcs_.clear();
+  arcScores_.clear();
+  arcLmScores_.clear();
+  nLiveArcs_ = 0;
+  scoreOffset_ = 0;
+  frameThreshold_ = opt_.beamThreshold_;
+  stats_ = DecoderStats();
 }
 
 void LexiconDecoder::decodeEnd() {
   candidatesReset();
-  for (const LexiconDecoderState& prevHyp :
-       hyp_[nDecodedFrames_ - nPrunedFrames_]) {
-    const TrieNode* prevLex = prevHyp.lex_;
-    const LMStatePtr& prevLmState = prevHyp.lmState_;
+  const LexiconDecoderState* prevHyps = hyp_.frame(0);
+  for (int h = 0; h < hyp_.frameSize(0); h++) {
+    const LexiconDecoderState& prevHyp = prevHyps[h];
+    const LMStateIdx prevLmState = prevHyp.lmState_;
 
     float lmScoreEnd;
-    LMStatePtr newLmState = lm_->finish(prevLmState, lmScoreEnd);
+    LMStateIdx newLmState = lm_->finish(prevLmState, lmScoreEnd);
+    W2L_DECODER_STATS_ADD(stats_.nLmCalls_, 1);
     candidatesAdd(
+        buffers_[0],
         newLmState,
-        prevLex,
+        prevHyp.lex_,
         &prevHyp,
         prevHyp.score_ + opt_.lmWeight_ * lmScoreEnd,
         -1,
         nullptr,
-        false // prevBlank
-    );
+        false, // prevBlank
+        lmScoreEnd);
   }
 
-  candidatesStore(hyp_[nDecodedFrames_ - nPrunedFrames_ + 1], true);
+  candidatesStore(true);
+  storeTraceback();
   ++nDecodedFrames_;
 }
 
@@ -107,7 +340,15 @@ std::vector<DecodeResult> LexiconDecoder::getAllFinalHypothesis() const {
     return std::vector<DecodeResult>{};
   }
 
-  return getAllHypothesis(hyp_.find(finalFrame)->second, finalFrame);
+  const LexiconDecoderState* finalHyps = hyp_.frame(0);
+  std::vector<DecodeResult> res(hyp_.frameSize(0));
+  for (int h = 0; h < res.size(); h++) {
+    res[h] = traceback_.getHypothesis(
+        traceback_.frame(finalFrame) + h,
+        finalFrame,
+        finalHyps[h].score_ + scoreOffset_);
+  }
+  return res;
 }
 
 DecodeResult LexiconDecoder::getBestHypothesis(int lookBack) const {
@@ -115,14 +356,29 @@ DecodeResult LexiconDecoder::getBestHypothesis(int lookBack) const {
     return DecodeResult();
   }
 
-  const LexiconDecoderState* bestNode = findBestAncestor(
-      hyp_.find(nDecodedFrames_ - nPrunedFrames_)->second, lookBack);
-  return getHypothesis(bestNode, nDecodedFrames_ - nPrunedFrames_ - lookBack);
+  const int finalFrame = nDecodedFrames_ - nPrunedFrames_;
+  const int best = bestHypothesis();
+  if (best < 0) {
+    return DecodeResult();
+  }
+
+  /* The states of the ancestor are gone, it gets the score of the best
+   * hypothesis of the last frame (on the scale of getAllFinalHypothesis()) */
+  const int ancestor =
+      traceback_.findAncestor(traceback_.frame(finalFrame) + best, lookBack);
+  return traceback_.getHypothesis(
+      ancestor,
+      finalFrame - lookBack,
+      hyp_.frame(0)[best].score_ + scoreOffset_);
 }
 
 int LexiconDecoder::nHypothesis() const {
-  int finalFrame = nDecodedFrames_ - nPrunedFrames_;
-  return hyp_.find(finalFrame)->second.size();
+  return hyp_.frameSize(0);
+}
+
+size_t LexiconDecoder::peakHypothesisBytes() const {
+  /* The traceback keeps its memory within an utterance */
+  return hyp_.peakBytes() + traceback_.bytes();
 }
 
 int LexiconDecoder::nDecodedFramesInBuffer() const {
@@ -135,9 +391,14 @@ void LexiconDecoder::prune(int lookBack) {
   }
 
   /* (1) Find the last emitted word in the best path */
-  const LexiconDecoderState* bestNode = findBestAncestor(
-      hyp_.find(nDecodedFrames_ - nPrunedFrames_)->second, lookBack);
-  if (!bestNode) {
+  const int finalFrame = nDecodedFrames_ - nPrunedFrames_;
+  const int best = bestHypothesis();
+  if (best < 0) {
+    return; // No hypothesis left
+  }
+  const int ancestor =
+      traceback_.findAncestor(traceback_.frame(finalFrame) + best, lookBack);
+  if (ancestor < 0) {
     return; // Not enough decoded frames to prune
   }
 
@@ -146,10 +407,189 @@ void LexiconDecoder::prune(int lookBack) {
     return; // Not enough decoded frames to prune
   }
 
-  /* (2) Move things from back of hyp_ to front and normalize scores */
-  pruneAndNormalize(hyp_, startFrame, lookBack);
+  /* (2) Drop the frames before startFrame from traceback_ and normalize the
+   * scores */
+  traceback_.dropFront(startFrame);
+  scoreOffset_ += normalizeScores(hyp_.frame(0), hyp_.frameSize(0));
 
   nPrunedFrames_ = nDecodedFrames_ - lookBack;
+  if (opt_.lattice_) {
+    latticeCompact();
+  }
+  if (ownsLmStates_) {
+    lmStatesCompact();
+  }
+}
+
+void LexiconDecoder::latticeStore() {
+  /* The new frame is not in traceback_ yet */
+  const int endFrame = nPrunedFrames_ + traceback_.nFrames() - 1;
+  const int frame = hyp_.nFrames() - 1;
+  LexiconDecoderState* hyps = hyp_.frame(frame);
+  for (int h = 0; h < hyp_.frameSize(frame); h++) {
+    LexiconDecoderState& hyp = hyps[h];
+    if (!hyp.word_) {
+      continue;
+    }
+    LatticeArc arc;
+    arc.prev_ = hyp.arc_;
+    arc.word_ = hyp.word_->usr_;
+    arc.startFrame_ = hyp.arc_ >= 0 ? arcs_[hyp.arc_].endFrame_ + 1 : 0;
+    arc.endFrame_ = endFrame;
+
+    /* The score of the arc is the one added to the path since the previous
+     * arc, the smeared LM scores of the word add up to its LM score */
+    const double score = hyp.score_ + scoreOffset_;
+    const double prevScore = hyp.arc_ >= 0 ? arcScores_[hyp.arc_] : 0;
+    const float prevLmScore = hyp.arc_ >= 0 ? arcLmScores_[hyp.arc_] : 0;
+    arc.lmScore_ = hyp.lmScore_ - prevLmScore;
+    arc.amScore_ = score - prevScore - opt_.lmWeight_ * arc.lmScore_ -
+        (hyp.word_ == unk_.get() ? opt_.unkScore_ : opt_.wordScore_);
+
+    hyp.arc_ = arcs_.size();
+    arcs_.push_back(arc);
+    arcScores_.push_back(score);
+    arcLmScores_.push_back(hyp.lmScore_);
+  }
+}
+
+void LexiconDecoder::latticeCompact() {
+  /* (1) Mark the arcs in the path of a hypothesis */
+  arcMap_.assign(arcs_.size(), -1);
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    const LexiconDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      for (int a = hyps[h].arc_; a >= 0 && arcMap_[a] < 0;
+           a = arcs_[a].prev_) {
+        arcMap_[a] = 0;
+      }
+    }
+  }
+
+  /* (2) Move them to the front, an arc comes after its previous one */
+  int nArcs = 0;
+  for (int a = 0; a < arcs_.size(); a++) {
+    if (arcMap_[a] < 0) {
+      continue;
+    }
+    arcMap_[a] = nArcs;
+    arcs_[nArcs] = arcs_[a];
+    if (arcs_[nArcs].prev_ >= 0) {
+      arcs_[nArcs].prev_ = arcMap_[arcs_[nArcs].prev_];
+    }
+    arcScores_[nArcs] = arcScores_[a];
+    arcLmScores_[nArcs] = arcLmScores_[a];
+    nArcs++;
+  }
+  arcs_.resize(nArcs);
+  arcScores_.resize(nArcs);
+  arcLmScores_.resize(nArcs);
+  nLiveArcs_ = nArcs;
+
+  /* (3) Renumber the arcs of the hypothesis */
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    LexiconDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      if (hyps[h].arc_ >= 0) {
+        hyps[h].arc_ = arcMap_[hyps[h].arc_];
+      }
+    }
+  }
+}
+
+void LexiconDecoder::lmStatesCompact() {
+  liveLmStates_.clear();
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    const LexiconDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      liveLmStates_.push_back(hyps[h].lmState_);
+    }
+  }
+  lm_->compactStates(liveLmStates_.data(), liveLmStates_.size());
+  int i = 0;
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    LexiconDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      hyps[h].lmState_ = liveLmStates_[i++];
+    }
+  }
+}
+
+void LexiconDecoder::storeTraceback() {
+  const int frame = hyp_.nFrames() - 1;
+  LexiconDecoderState* hyps = hyp_.frame(frame);
+  const int nHyp = hyp_.frameSize(frame);
+  traceback_.append(hyps, nHyp, frame > 0 ? hyp_.frame(frame - 1) : nullptr);
+
+  /* Drop the records of the dead paths once they make up half of them */
+  if (traceback_.nRecords() > 2 * traceback_.nLiveRecords()) {
+    traceback_.compact();
+  }
+
+  /* The paths are followed in traceback_ from now on */
+  for (int h = 0; h < nHyp; h++) {
+    hyps[h].parent_ = nullptr;
+  }
+  hyp_.dropFront(frame);
+}
+
+int LexiconDecoder::bestHypothesis() const {
+  const LexiconDecoderState* hyps = hyp_.frame(0);
+  int best = -1;
+  for (int h = 0; h < hyp_.frameSize(0); h++) {
+    if (best < 0 || hyps[h].score_ > hyps[best].score_) {
+      best = h;
+    }
+  }
+  return best;
+}
+
+int LexiconDecoder::nLatticeArcs() const {
+  return arcs_.size();
+}
+
+Lattice LexiconDecoder::getLattice() const {
+  Lattice lattice;
+  lattice.nFrames_ = nDecodedFrames_ - 1; // Without the end of sentence
+  lattice.lmWeight_ = opt_.lmWeight_;
+  lattice.wordScore_ = opt_.wordScore_;
+  lattice.unkScore_ = opt_.unkScore_;
+  lattice.unkWord_ = unk_ ? unk_->usr_ : -1;
+
+  const LexiconDecoderState* finalHyps = hyp_.frame(0);
+  const int nHyp = hyp_.frameSize(0);
+
+  /* Only keep the arcs of the final hypothesis, renumbered */
+  std::vector<int> arcMap(arcs_.size(), -1);
+  for (int h = 0; h < nHyp; h++) {
+    for (int a = finalHyps[h].arc_; a >= 0 && arcMap[a] < 0;
+         a = arcs_[a].prev_) {
+      arcMap[a] = 0;
+    }
+  }
+  for (int a = 0; a < arcs_.size(); a++) {
+    if (arcMap[a] < 0) {
+      continue;
+    }
+    arcMap[a] = lattice.arcs_.size();
+    lattice.arcs_.push_back(arcs_[a]);
+    if (arcs_[a].prev_ >= 0) {
+      lattice.arcs_.back().prev_ = arcMap[arcs_[a].prev_];
+    }
+  }
+
+  for (int h = 0; h < nHyp; h++) {
+    const LexiconDecoderState& hyp = finalHyps[h];
+    const double prevScore = hyp.arc_ >= 0 ? arcScores_[hyp.arc_] : 0;
+    const float prevLmScore = hyp.arc_ >= 0 ? arcLmScores_[hyp.arc_] : 0;
+    LatticeEnd end;
+    end.arc_ = hyp.arc_ >= 0 ? arcMap[hyp.arc_] : -1;
+    end.lmScore_ = hyp.lmScore_ - prevLmScore;
+    end.amScore_ =
+        hyp.score_ + scoreOffset_ - prevScore - opt_.lmWeight_ * end.lmScore_;
+    lattice.ends_.push_back(end);
+  }
+  return lattice;
 }
 
 } // namespace w2l
@@ -8,28 +8,34 @@
 
 #pragma once
 
-#include <unordered_map>
-
+#include "CandidateMergeTable.h"
 #include "Decoder.h"
+#include "FlatTrie.h"
+#include "HypothesisArena.h"
 #include "LM.h"
-#include "Trie.h"
+#include "Lattice.h"
+#include "ScoreHistogram.h"
+#include "Traceback.h"
 
 namespace w2l {
 /**
  * LexiconDecoderState stores information for each hypothesis in the beam.
  */
 struct LexiconDecoderState {
-  LMStatePtr lmState_; // Language model state
-  const TrieNode* lex_; // Trie node in the lexicon
-  const LexiconDecoderState* parent_; // Parent hypothesis
+  LMStateIdx lmState_; // Language model state
+  int lex_; // Trie node index in the lexicon
+  const LexiconDecoderState* parent_; // Parent hypothesis (until the next
+                                      // frame, see Traceback)
   float score_; // Score so far
   int token_; // Label of token
   const TrieLabel* word_; // Label of word (-1 if incomplete)
   bool prevBlank_;
+  float lmScore_; // Unweighted LM score so far (opt_.lattice_ only)
+  int arc_; // Lattice arc of the last word (opt_.lattice_ only)
 
   LexiconDecoderState(
-      const LMStatePtr& lmState,
-      const TrieNode* lex,
+      const LMStateIdx lmState,
+      const int lex,
       const LexiconDecoderState* parent,
       const float score,
       const int token,
@@ -41,24 +47,65 @@ struct LexiconDecoderState {
         score_(score),
         token_(token),
         word_(word),
-        prevBlank_(prevBlank) {}
+        prevBlank_(prevBlank),
+        lmScore_(parent ? parent->lmScore_ : 0),
+        arc_(parent ? parent->arc_ : -1) {}
 
   LexiconDecoderState()
-      : lmState_(nullptr),
-        lex_(nullptr),
+      : lmState_(-1),
+        lex_(-1),
         parent_(nullptr),
         score_(0),
         token_(-1),
         word_(nullptr),
-        prevBlank_(false) {}
+        prevBlank_(false),
+        lmScore_(0),
+        arc_(-1) {}
 
   int getWord() const {
     return word_ ? word_->usr_ : -1;
   }
+};
 
-  bool isComplete() const {
-    return !parent_ || parent_->word_;
-  }
+const int kMinHypPerThread = 64; // Smaller frames are expanded serially
+
+/* The lattice arcs are compacted once they outnumber both
+ * kLatticeCompactBeams x the beam size and kLatticeCompactFactor x the arcs
+ * kept by the last compaction */
+const int kLatticeCompactBeams = 4;
+const int kLatticeCompactFactor = 2;
+
+/**
+ * LexiconCandidates collects candidates for the next frame, and candidates
+ * waiting for an LM score. A frame is expanded into one of them, or into one
+ * per thread when its hypothesis are split between threads (see
+ * DecoderOptions::nThreads_).
+ */
+struct LexiconCandidates {
+  std::vector<LexiconDecoderState>
+      candidates_; // All the hypothesis candidates (can be larger than
+                   // beamsize) for the current frame
+  int nCandidates_ = 0; // Total number of candidates in candidates_. Note
+                        // that candidates is not always equal to
+                        // candidates_.size() since we do not refresh the
+                        // buffer for candidates_ in memory through out the
+                        // whole decoding process.
+  int maxCandidates_ = 0; // Share of opt_.maxCandidates_
+  float bestScore_ = kNegativeInfinity;
+  float threshold_ = 0; // Beam threshold, tightened by maxCandidates_
+  ScoreHistogram histogram_; // Used to cap the candidates
+  std::vector<LexiconDecoderState>
+      proposals_; // Candidates waiting for an LM score
+  std::vector<LMStateIdx> proposalLmStates_; // LM queries of proposals_
+  std::vector<int> proposalLmTokens_;
+  std::vector<float> proposalLmOffsets_; // Subtracted from their LM score
+  std::vector<float> proposalLmScores_; // LM answers for proposals_
+  std::vector<LMStateIdx> proposalNewLmStates_;
+  std::vector<LexiconDecoderState*>
+      partition_; // Candidates merged by this thread
+  int nPartition_ = 0; // Number of them after merging
+  CandidateMergeTable<LexiconDecoderState> mergeTable_;
+  DecoderStats stats_; // Added to the decoder stats after each frame
 };
 
 /**
@@ -78,7 +125,7 @@ class LexiconDecoder : public Decoder {
  public:
   LexiconDecoder(
       const DecoderOptions& opt,
-      const TriePtr lexicon,
+      const FlatTriePtr lexicon,
       const LMPtr lm,
       const int sil,
       const int blank,
@@ -88,20 +135,23 @@ class LexiconDecoder : public Decoder {
         lexicon_(lexicon),
         lm_(lm),
         transitions_(transitions),
+        buffers_(1),
+        nBuffers_(1),
         sil_(sil),
         blank_(blank),
-        unk_(unk),
-        nCandidates_(0) {
-    candidates_.reserve(kBufferBucketSize);
+        unk_(unk) {
+    buffers_[0].candidates_.reserve(kBufferBucketSize);
   }
 
   void decodeBegin() override;
 
   void decodeEnd() override;
 
-  int nHypothesis() const;
+  int nHypothesis() const override;
+
+  size_t peakHypothesisBytes() const override;
 
-  int nDecodedFramesInBuffer() const;
+  int nDecodedFramesInBuffer() const override;
 
   void prune(int lookBack = 0) override;
 
@@ -109,47 +159,247 @@ class LexiconDecoder : public Decoder {
 
   std::vector<DecodeResult> getAllFinalHypothesis() const override;
 
+  /**
+   * The lattice of the final hypothesis, after decodeEnd() (needs
+   * opt_.lattice_). Only the arcs of their paths are kept: it is the N-best
+   * list of the beam as a prefix tree, and the paths merged into others or
+   * pruned while decoding are not in it.
+   */
+  Lattice getLattice() const;
+
+  /* Number of lattice arcs held by the decoder, live or not */
+  int nLatticeArcs() const;
+
  protected:
-  TriePtr lexicon_;
+  FlatTriePtr lexicon_;
   LMPtr lm_;
   std::vector<float> transitions_;
 
-  std::vector<LexiconDecoderState>
-      candidates_; // All the hypothesis candidates (can be larger than
-                   // beamsize) for the current frame
+  std::vector<LexiconCandidates>
+      buffers_; // Candidates of the current frame, one buffer per thread
+  int nBuffers_; // Number of buffers used in the current frame
   std::vector<LexiconDecoderState*>
       candidatePtrs_; // This vector is only used when sort the candidates_, so
                       // instead of moving around objects, we only need to sort
                       // pointers
   float candidatesBestScore_;
+  float frameThreshold_; // Beam threshold of the frame, see
+                         // opt_.maxCandidates_
+  ScoreHistogram histogram_; // Used by the histogram pruning
+  TokenSelection tokenSelection_; // Tokens to expand in the current frame
   int sil_; // Index of silence label
   int blank_; // Index of blank label (for CTC)
   TrieLabelPtr unk_; // Trie label for unknown word
-  std::unordered_map<int, std::vector<LexiconDecoderState>>
-      hyp_; // Vector of hypothesis for all the frames so far
-  int nCandidates_; // Total number of candidates in candidates_. Note that
-                    // candidates is not always equal to candidates_.size()
-                    // since we do not refresh the buffer for candidates_ in
-                    // memory through out the whole decoding process.
+  HypothesisArena<LexiconDecoderState>
+      hyp_; // Hypothesis of the last frame (and of the one being decoded)
+  Traceback traceback_; // Paths of the hypothesis of all the frames so far
+  CandidateMergeTable<LexiconDecoderState>
+      mergeTable_; // Used to merge the candidates if opt_.hashMerge_
   int nDecodedFrames_; // Total number of decoded frames.
   int nPrunedFrames_; // Total number of pruned frames from hyp_.
+  std::vector<LatticeArc> arcs_; // Lattice arcs so far (opt_.lattice_)
+  std::vector<double> arcScores_; // Score of the path at the end of each arc
+  std::vector<float> arcLmScores_; // and its unweighted LM score
+  std::vector<int> arcMap_; // Used to drop the arcs of pruned paths
+  int nLiveArcs_; // Arcs kept by the last latticeCompact()
+  double scoreOffset_; // Total score subtracted from the hypothesis by prune()
+  bool ownsLmStates_ = true; // prune() compacts the LM state pool, unless the
+                             // LM is shared with other decoders
+  std::vector<LMStateIdx> liveLmStates_; // Used by lmStatesCompact()
 
-  void candidatesReset();
+  /**
+   * Start a frame expanding `nHyp` hypothesis, with one buffer per thread if
+   * there are enough of them to share.
+   */
+  void candidatesReset(const int nHyp = 1);
 
   void candidatesAdd(
-      const LMStatePtr& lmState,
-      const TrieNode* lex,
+      LexiconCandidates& buffer,
+      const LMStateIdx lmState,
+      const int lex,
       const LexiconDecoderState* parent,
       const float score,
       const int token,
       const TrieLabel* label,
-      const bool prevBlank);
+      const bool prevBlank,
+      const float lmScore = 0); // Unweighted LM score of the candidate
+
+  void candidatesStore(const bool isSort);
+
+  /**
+   * Add a lattice arc for each word completed in the last frame of hyp_. The
+   * arcs are only created for the hypothesis which made it to the beam.
+   */
+  void latticeStore();
+
+  /* Drop the lattice arcs which are in the path of no hypothesis of hyp_ */
+  void latticeCompact();
 
-  void candidatesStore(
-      std::vector<LexiconDecoderState>& nextHyp,
-      const bool isSort);
+  /* Drop the LM states which are the state of no hypothesis of hyp_ */
+  void lmStatesCompact();
 
-  virtual int mergeCandidates(const int size) = 0;
+  /**
+   * Record the paths of the last frame of hyp_ in traceback_, and drop the
+   * states of the previous frame.
+   */
+  void storeTraceback();
+
+  /* Index of the best hypothesis of the last frame (-1 if there is none) */
+  int bestHypothesis() const;
+
+  /**
+   * Add a candidate whose score is still missing the LM score of `lmToken`
+   * from `lmState` (minus `lmOffset`, e.g. the smeared score already counted).
+   * Its LM state is filled in once the proposals are scored.
+   */
+  void proposalsAdd(
+      LexiconCandidates& buffer,
+      const LMStateIdx lmState,
+      const int lmToken,
+      const float lmOffset,
+      const int lex,
+      const LexiconDecoderState* parent,
+      const float score,
+      const int token,
+      const TrieLabel* label);
+
+  /**
+   * Score the proposals of the frame with one LM::scoreBatch() call per
+   * buffer. The LM (and its state pool) is shared by the threads, so that it
+   * is queried by one of them at a time.
+   */
+  void proposalsScore();
+
+  /* Turn the scored proposals of `buffer` into candidates */
+  virtual void storeProposals(LexiconCandidates& buffer) = 0;
+
+  /**
+   * Expand the `nHyp` hypothesis of the previous frame: call expand(buffer, h)
+   * for each of them. With several buffers, the hypothesis are split in
+   * contiguous ranges and each buffer is filled by its own thread.
+   */
+  template <class ExpandFunc>
+  void expandFrame(const int nHyp, const ExpandFunc& expand) {
+#pragma omp parallel for schedule(static, 1) num_threads(nBuffers_) \
+    if (nBuffers_ > 1)
+    for (int b = 0; b < nBuffers_; b++) {
+      const int end = nHyp * (b + 1) / nBuffers_;
+      for (int h = nHyp * b / nBuffers_; h < end; h++) {
+        expand(buffers_[b], h);
+      }
+    }
+  }
+
+  /**
+   * Store the frame once its proposals are scored: turn them into candidates
+   * (one thread per buffer), then prune and merge the candidates into the
+   * hypothesis of the frame.
+   */
+  void storeFrame();
+
+  /**
+   * Decoding a frame is split in three steps, so that the frames of several
+   * decoders sharing an LM can be scored together (see BatchDecoder):
+   *  - expandStep() expands the hypothesis of the previous frame with the
+   *    single frame of `emissions`. It returns false if the frame is decoded
+   *    already (blank frame), in which case the next steps have nothing to
+   *    do.
+   *  - the proposals of the frame are scored.
+   *  - storeStep() stores the frame.
+   */
+  virtual bool expandStep(const EmissionMatrix& emissions) = 0;
+
+  void storeStep(const bool expanded);
+
+  /* decodeBegin() from the given LM state instead of LM::start() */
+  void decodeBegin(const LMStateIdx startState);
+
+  friend class BatchDecoder;
+
+  /**
+   * Merge the first `size` candidates of `candidatePtrs` which share the same
+   * mergeKey(), moving the merged ones to the front and returning their number
+   */
+  virtual int mergeCandidates(
+      std::vector<LexiconDecoderState*>& candidatePtrs,
+      const int size,
+      CandidateMergeTable<LexiconDecoderState>& mergeTable) = 0;
+
+  /* Key of the candidates which can be merged together */
+  virtual uint64_t mergeKey(const LexiconDecoderState* node) const = 0;
+
+  /**
+   * Prune and merge the candidates of all the buffers in parallel: the
+   * candidates are partitioned by merge key, each thread merges one
+   * partition and keeps its opt_.beamSize_ best candidates. Return the number
+   * of candidates left in candidatePtrs_.
+   */
+  int mergePartitions();
+
+  /**
+   * Return true if the blank posterior of frame t is above
+   * opt_.blankSkipThreshold_ (CTC only). The emissions are normalized with a
+   * softmax over the frame.
+   */
+  template <class EmissionReader>
+  bool isBlankFrame(const EmissionReader& emissions, int t, int N) const {
+    if (opt_.blankSkipThreshold_ <= 0 ||
+        opt_.criterionType_ != CriterionType::CTC) {
+      return false;
+    }
+    float maxScore = emissions(t, 0);
+    for (int n = 1; n < N; n++) {
+      maxScore = std::max(maxScore, emissions(t, n));
+    }
+    float sumExp = 0;
+    for (int n = 0; n < N; n++) {
+      sumExp += std::exp(emissions(t, n) - maxScore);
+    }
+    return emissions(t, blank_) - maxScore - std::log(sumExp) >=
+        std::log(opt_.blankSkipThreshold_);
+  }
+
+  /**
+   * Decode a blank frame t following the hypothesis of the last frame: each
+   * hypothesis only takes the blank, or stays on its token, so that there is
+   * nothing to merge, prune or score with the LM.
+   */
+  template <class EmissionReader>
+  void decodeBlankFrame(const EmissionReader& emissions, int t) {
+    const int nHyp = hyp_.frameSize(0);
+    const LexiconDecoderState* prevHyps = hyp_.frame(0);
+    LexiconDecoderState* hyps = hyp_.append(nHyp);
+    const float blankScore = emissions(t, blank_);
+    for (int h = 0; h < nHyp; h++) {
+      const LexiconDecoderState& prevHyp = prevHyps[h];
+      LexiconDecoderState& hyp = hyps[h];
+      hyp = LexiconDecoderState(
+          prevHyp.lmState_,
+          prevHyp.lex_,
+          &prevHyp,
+          prevHyp.score_ + blankScore,
+          blank_,
+          nullptr,
+          true // prevBlank
+      );
+      if (!prevHyp.prevBlank_) {
+        /* Same token, merged with the blank as mergeCandidates() would */
+        const int n = lexicon_->getNode(prevHyp.lex_)->idx_;
+        float score = prevHyp.score_ + emissions(t, n);
+        if (n == sil_) {
+          score += opt_.silWeight_;
+        }
+        LexiconDecoderState same(
+            prevHyp.lmState_, prevHyp.lex_, &prevHyp, score, n, nullptr);
+        if (score > hyp.score_) {
+          std::swap(hyp, same);
+        }
+        mergeStates(&hyp, &same, opt_.logAdd_);
+      }
+    }
+    storeTraceback();
+    stats_.nBlankFrames_++; // Counted even without W2L_DECODER_STATS
+  }
 };
 
 } // namespace w2l
@@ -21,14 +21,25 @@ namespace w2l {
 void LexiconFreeDecoder::candidatesReset() {
   nCandidates_ = 0;
   candidatesBestScore_ = kNegativeInfinity;
+  frameThreshold_ =
+      std::min(opt_.beamThreshold_, frameThreshold_ * kBeamRelaxFactor);
 }
 
 int LexiconFreeDecoder::mergeCandidates(const int size) {
+  if (opt_.hashMerge_) {
+    return mergeTable_.merge(
+        candidatePtrs_,
+        size,
+        opt_.logAdd_,
+        [](const LexiconFreeDecoderState* node) {
+          return (uint64_t)(uint32_t)node->lmState_;
+        });
+  }
+
   auto compareNodesShortList = [&](const LexiconFreeDecoderState* node1,
                                    const LexiconFreeDecoderState* node2) {
-    int lmCmp = lm_->compareState(node1->lmState_, node2->lmState_);
-    if (lmCmp != 0) {
-      return lmCmp > 0;
+    if (node1->lmState_ != node2->lmState_) {
+      return node1->lmState_ > node2->lmState_;
     } else { /* same LmState */
       return node1->score_ > node2->score_;
     }
@@ -40,9 +51,8 @@ int LexiconFreeDecoder::mergeCandidates(const int size) {
 
   int nHypAfterMerging = 1;
   for (int i = 1; i < size; i++) {
-    if (lm_->compareState(
-            candidatePtrs_[i]->lmState_,
-            candidatePtrs_[nHypAfterMerging - 1]->lmState_)) {
+    if (candidatePtrs_[i]->lmState_ !=
+        candidatePtrs_[nHypAfterMerging - 1]->lmState_) {
       candidatePtrs_[nHypAfterMerging] = candidatePtrs_[i];
       nHypAfterMerging++;
     } else {
@@ -57,12 +67,26 @@ int LexiconFreeDecoder::mergeCandidates(const int size) {
 }
 
 void LexiconFreeDecoder::candidatesAdd(
-    const LMStatePtr& lmState,
+    const LMStateIdx lmState,
     const LexiconFreeDecoderState* parent,
     const float score,
     const int token,
     const bool prevBlank) {
-  if (isGoodCandidate(candidatesBestScore_, score, opt_.beamThreshold_)) {
+  W2L_DECODER_STATS_ADD(stats_.nCandidates_, 1);
+  if (isGoodCandidate(candidatesBestScore_, score, frameThreshold_)) {
+    if (opt_.maxCandidates_ > 0 && nCandidates_ >= opt_.maxCandidates_) {
+      /* Tighten the threshold to stay within the budget of the frame */
+      int nKept = capCandidates(
+          histogram_,
+          candidates_,
+          nCandidates_,
+          nCandidates_ / 2,
+          candidatesBestScore_,
+          frameThreshold_);
+      W2L_DECODER_STATS_ADD(stats_.nCapHits_, 1);
+      W2L_DECODER_STATS_ADD(stats_.nCapped_, nCandidates_ - nKept);
+      nCandidates_ = nKept;
+    }
     if (nCandidates_ == candidates_.size()) {
       candidates_.resize(candidates_.size() + kBufferBucketSize);
     }
@@ -70,60 +94,89 @@ void LexiconFreeDecoder::candidatesAdd(
     candidates_[nCandidates_] =
         LexiconFreeDecoderState(lmState, parent, score, token, prevBlank);
     ++nCandidates_;
+    W2L_DECODER_STATS_MAX(stats_.maxBufferSize_, nCandidates_);
+  } else {
+    W2L_DECODER_STATS_ADD(stats_.nRejected_, 1);
   }
 }
 
-void LexiconFreeDecoder::candidatesStore(
-    std::vector<LexiconFreeDecoderState>& nextHyp,
-    const bool returnSorted) {
+void LexiconFreeDecoder::candidatesStore(const bool returnSorted) {
   if (nCandidates_ == 0) {
+    hyp_.append(0);
     return;
   }
 
   /* Select valid candidates */
+  W2L_DECODER_STATS_TIC(statsTimer_);
   int nValidHyp = pruneCandidates(
       candidatePtrs_,
       candidates_,
       nCandidates_,
       candidatesBestScore_,
-      opt_.beamThreshold_);
+      frameThreshold_);
+  W2L_DECODER_STATS_ADD(stats_.nPruned_, nCandidates_ - nValidHyp);
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.pruneTime_);
 
   /* Sort by (LmState, lex, score) and copy into next hypothesis */
-  nValidHyp = mergeCandidates(nValidHyp);
+  int nMergedHyp = mergeCandidates(nValidHyp);
+  W2L_DECODER_STATS_ADD(stats_.nMerged_, nValidHyp - nMergedHyp);
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.mergeTime_);
 
   /* Sort hypothesis and select top-K */
+  if (opt_.histogramPruning_ && !returnSorted) {
+    nMergedHyp = histogramSelect(
+        histogram_,
+        candidatePtrs_,
+        nMergedHyp,
+        opt_.beamSize_,
+        candidatesBestScore_,
+        frameThreshold_);
+  }
   storeTopCandidates(
-      nextHyp, candidatePtrs_, nValidHyp, opt_.beamSize_, returnSorted);
+      hyp_, candidatePtrs_, nMergedHyp, opt_.beamSize_, returnSorted);
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.topKTime_);
 }
 
 void LexiconFreeDecoder::decodeBegin() {
   hyp_.clear();
-  hyp_.emplace(0, std::vector<LexiconFreeDecoderState>());
 
   /* note: the lm reset itself with :start() */
-  hyp_[0].emplace_back(lm_->start(0), nullptr, 0.0, sil_);
+  *hyp_.append(1) = LexiconFreeDecoderState(lm_->start(0), nullptr, 0.0, sil_);
   nDecodedFrames_ = 0;
   nPrunedFrames_ = 0;
+  scoreOffset_ = 0;
+  frameThreshold_ = opt_.beamThreshold_;
+  stats_ = DecoderStats();
 }
 
-void LexiconFreeDecoder::decodeStep(const float* emissions, int T, int N) {
+template <class EmissionReader>
+void LexiconFreeDecoder::decodeFrames(
+    const EmissionReader& emissions,
+    int T,
+    int N) {
   int startFrame = nDecodedFrames_ - nPrunedFrames_;
-  // Extend hyp_ buffer
-  if (hyp_.size() < startFrame + T + 2) {
-    for (int i = hyp_.size(); i < startFrame + T + 2; i++) {
-      hyp_.emplace(i, std::vector<LexiconFreeDecoderState>());
-    }
-  }
-
+  const bool preselect = opt_.tokenTopK_ > 0 || opt_.tokenThreshold_ > 0;
   // Looping over all the frames
   for (int t = 0; t < T; t++) {
+    W2L_DECODER_STATS_TIC(statsTimer_);
     candidatesReset();
-    for (const LexiconFreeDecoderState& prevHyp : hyp_[startFrame + t]) {
-      const LMStatePtr& prevLmState = prevHyp.lmState_;
+    if (preselect) {
+      tokenSelection_.select(
+          emissions, t, N, opt_.tokenTopK_, opt_.tokenThreshold_);
+    }
+    const LexiconFreeDecoderState* prevHyps = hyp_.frame(startFrame + t);
+    for (int h = 0; h < hyp_.frameSize(startFrame + t); h++) {
+      const LexiconFreeDecoderState& prevHyp = prevHyps[h];
+      const LMStateIdx prevLmState = prevHyp.lmState_;
 
       const int prevIdx = prevHyp.token_;
       for (int n = 0; n < N; n++) {
-        float score = prevHyp.score_ + emissions[t * N + n];
+        // Staying on the same token and blank are always allowed
+        if (preselect && !tokenSelection_.contains(n) && n != prevIdx &&
+            n != blank_) {
+          continue;
+        }
+        float score = prevHyp.score_ + emissions(t, n);
         if (nDecodedFrames_ + t > 0 &&
             opt_.criterionType_ == CriterionType::ASG) {
           score += transitions_[n * N + prevIdx];
@@ -139,7 +192,8 @@ void LexiconFreeDecoder::decodeStep(const float* emissions, int T, int N) {
             (opt_.criterionType_ == CriterionType::CTC && n != blank_)) {
           int lmIdx = lmIndMap_.find(n)->second;
           float lmScore = 0;
-          const LMStatePtr newLmState = lm_->score(prevLmState, lmIdx, lmScore);
+          const LMStateIdx newLmState = lm_->score(prevLmState, lmIdx, lmScore);
+          W2L_DECODER_STATS_ADD(stats_.nLmCalls_, 1);
           score += lmScore * opt_.lmWeight_;
 
           candidatesAdd(
@@ -161,19 +215,38 @@ void LexiconFreeDecoder::decodeStep(const float* emissions, int T, int N) {
       }
     }
 
-    candidatesStore(hyp_[startFrame + t + 1], false);
+    W2L_DECODER_STATS_TOC(statsTimer_, stats_.expandTime_);
+    candidatesStore(false);
   }
   nDecodedFrames_ += T;
+  W2L_DECODER_STATS_ADD(stats_.nFrames_, T);
+}
+
+void LexiconFreeDecoder::decodeStep(const EmissionMatrix& emissions) {
+  switch (emissions.type_) {
+    case EmissionType::FLOAT32:
+      decodeFrames(FloatEmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+    case EmissionType::FLOAT16:
+      decodeFrames(HalfEmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+    case EmissionType::INT8:
+      decodeFrames(Int8EmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+  }
 }
 
 void LexiconFreeDecoder::decodeEnd() {
   candidatesReset();
-  for (const LexiconFreeDecoderState& prevHyp :
-       hyp_[nDecodedFrames_ - nPrunedFrames_]) {
-    const LMStatePtr& prevLmState = prevHyp.lmState_;
+  const int finalFrame = nDecodedFrames_ - nPrunedFrames_;
+  const LexiconFreeDecoderState* prevHyps = hyp_.frame(finalFrame);
+  for (int h = 0; h < hyp_.frameSize(finalFrame); h++) {
+    const LexiconFreeDecoderState& prevHyp = prevHyps[h];
+    const LMStateIdx prevLmState = prevHyp.lmState_;
 
     float lmScoreEnd;
-    LMStatePtr newLmState = lm_->finish(prevLmState, lmScoreEnd);
+    LMStateIdx newLmState = lm_->finish(prevLmState, lmScoreEnd);
+    W2L_DECODER_STATS_ADD(stats_.nLmCalls_, 1);
     candidatesAdd(
         newLmState,
         &prevHyp,
@@ -183,26 +256,42 @@ void LexiconFreeDecoder::decodeEnd() {
     );
   }
 
-  candidatesStore(hyp_[nDecodedFrames_ - nPrunedFrames_ + 1], true);
+  candidatesStore(true);
   ++nDecodedFrames_;
 }
 
 std::vector<DecodeResult> LexiconFreeDecoder::getAllFinalHypothesis() const {
   int finalFrame = nDecodedFrames_ - nPrunedFrames_;
-  return getAllHypothesis(hyp_.find(finalFrame)->second, finalFrame);
+  auto res = getAllHypothesis(
+      hyp_.frame(finalFrame), hyp_.frameSize(finalFrame), finalFrame);
+  for (auto& hyp : res) {
+    hyp.score_ += scoreOffset_;
+  }
+  return res;
 }
 
 DecodeResult LexiconFreeDecoder::getBestHypothesis(int lookBack) const {
-  int finalFrame = nDecodedFrames_ - nPrunedFrames_ - lookBack;
-  const LexiconFreeDecoderState* bestNode =
-      findBestAncestor(hyp_.find(finalFrame)->second, lookBack);
+  int finalFrame = nDecodedFrames_ - nPrunedFrames_;
+  const LexiconFreeDecoderState* bestNode = findBestAncestor(
+      hyp_.frame(finalFrame), hyp_.frameSize(finalFrame), lookBack);
+
+  if (!bestNode) {
+    return DecodeResult();
+  }
 
-  return getHypothesis(bestNode, nDecodedFrames_ - nPrunedFrames_ - lookBack);
+  auto res =
+      getHypothesis(bestNode, nDecodedFrames_ - nPrunedFrames_ - lookBack);
+  res.score_ += scoreOffset_;
+  return res;
 }
 
 int LexiconFreeDecoder::nHypothesis() const {
   int finalFrame = nDecodedFrames_ - nPrunedFrames_;
-  return hyp_.find(finalFrame)->second.size();
+  return hyp_.frameSize(finalFrame);
+}
+
+size_t LexiconFreeDecoder::peakHypothesisBytes() const {
+  return hyp_.peakBytes();
 }
 
 int LexiconFreeDecoder::nDecodedFramesInBuffer() const {
@@ -215,9 +304,9 @@ void LexiconFreeDecoder::prune(int lookBack) {
   }
 
   /* (1) Find the last emitted word in the best path */
-  int finalFrame = nDecodedFrames_ - nPrunedFrames_ - lookBack;
-  const LexiconFreeDecoderState* bestNode =
-      findBestAncestor(hyp_.find(finalFrame)->second, lookBack);
+  int finalFrame = nDecodedFrames_ - nPrunedFrames_;
+  const LexiconFreeDecoderState* bestNode = findBestAncestor(
+      hyp_.frame(finalFrame), hyp_.frameSize(finalFrame), lookBack);
   if (!bestNode) {
     return; // Not enough decoded frames to prune
   }
@@ -228,9 +317,28 @@ void LexiconFreeDecoder::prune(int lookBack) {
   }
 
   /* (2) Move things from back of hyp_ to front and normalize scores */
-  pruneAndNormalize(hyp_, startFrame, lookBack);
+  scoreOffset_ += pruneAndNormalize(hyp_, startFrame, lookBack);
 
   nPrunedFrames_ = nDecodedFrames_ - lookBack;
+  lmStatesCompact();
+}
+
+void LexiconFreeDecoder::lmStatesCompact() {
+  liveLmStates_.clear();
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    const LexiconFreeDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      liveLmStates_.push_back(hyps[h].lmState_);
+    }
+  }
+  lm_->compactStates(liveLmStates_.data(), liveLmStates_.size());
+  int i = 0;
+  for (int f = 0; f < hyp_.nFrames(); f++) {
+    LexiconFreeDecoderState* hyps = hyp_.frame(f);
+    for (int h = 0; h < hyp_.frameSize(f); h++) {
+      hyps[h].lmState_ = liveLmStates_[i++];
+    }
+  }
 }
 
 } // namespace w2l
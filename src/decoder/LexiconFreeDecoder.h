@@ -10,22 +10,25 @@
 
 #include <unordered_map>
 
+#include "CandidateMergeTable.h"
 #include "Decoder.h"
+#include "HypothesisArena.h"
 #include "LM.h"
+#include "ScoreHistogram.h"
 
 namespace w2l {
 /**
  * LexiconFreeDecoderState stores information for each hypothesis in the beam.
  */
 struct LexiconFreeDecoderState {
-  LMStatePtr lmState_; // Language model state
+  LMStateIdx lmState_; // Language model state
   const LexiconFreeDecoderState* parent_; // Parent hypothesis
   float score_; // Score so far
   int token_; // Label of token
   bool prevBlank_;
 
   LexiconFreeDecoderState(
-      const LMStatePtr& lmState,
+      const LMStateIdx lmState,
       const LexiconFreeDecoderState* parent,
       const float score,
       const int token,
@@ -37,7 +40,7 @@ struct LexiconFreeDecoderState {
         prevBlank_(prevBlank) {}
 
   LexiconFreeDecoderState()
-      : lmState_(nullptr),
+      : lmState_(-1),
         parent_(nullptr),
         score_(0),
         token_(-1),
@@ -85,13 +88,17 @@ class LexiconFreeDecoder : public Decoder {
 
   void decodeBegin() override;
 
-  void decodeStep(const float* emissions, int T, int N) override;
+  using Decoder::decodeStep;
+
+  void decodeStep(const EmissionMatrix& emissions) override;
 
   void decodeEnd() override;
 
-  int nHypothesis() const;
+  int nHypothesis() const override;
+
+  size_t peakHypothesisBytes() const override;
 
-  int nDecodedFramesInBuffer() const;
+  int nDecodedFramesInBuffer() const override;
 
   void prune(int lookBack = 0) override;
 
@@ -100,6 +107,10 @@ class LexiconFreeDecoder : public Decoder {
   std::vector<DecodeResult> getAllFinalHypothesis() const override;
 
  protected:
+  /* Decode T frames, reading the scores of the expanded tokens only */
+  template <class EmissionReader>
+  void decodeFrames(const EmissionReader& emissions, int T, int N);
+
   LMPtr lm_;
   std::vector<float> transitions_;
 
@@ -111,31 +122,40 @@ class LexiconFreeDecoder : public Decoder {
                       // instead of moving around objects, we only need to sort
                       // pointers
   float candidatesBestScore_;
+  float frameThreshold_; // Beam threshold of the frame, see
+                         // opt_.maxCandidates_
+  ScoreHistogram histogram_; // Used by the histogram pruning
+  TokenSelection tokenSelection_; // Tokens to expand in the current frame
   int sil_; // Index of silence label
   int blank_; // Index of blank label (for CTC)
-  std::unordered_map<int, std::vector<LexiconFreeDecoderState>>
-      hyp_; // Vector of hypothesis for all the frames so far
+  HypothesisArena<LexiconFreeDecoderState>
+      hyp_; // Hypothesis for all the frames so far
+  CandidateMergeTable<LexiconFreeDecoderState>
+      mergeTable_; // Used to merge the candidates if opt_.hashMerge_
   int nCandidates_; // Total number of candidates in candidates_. Note that
                     // candidates is not always equal to candidates_.size()
                     // since we do not refresh the buffer for candidates_ in
                     // memory through out the whole decoding process.
   int nDecodedFrames_; // Total number of decoded frames.
   int nPrunedFrames_; // Total number of pruned frames from hyp_.
+  double scoreOffset_; // Total score subtracted from the hypothesis by prune()
+  std::vector<LMStateIdx> liveLmStates_; // Used by lmStatesCompact()
 
   std::unordered_map<int, int> lmIndMap_;
 
+  /* Drop the LM states which are the state of no hypothesis of hyp_ */
+  void lmStatesCompact();
+
   void candidatesReset();
 
   void candidatesAdd(
-      const LMStatePtr& lmState,
+      const LMStateIdx lmState,
       const LexiconFreeDecoderState* parent,
       const float score,
       const int token,
       const bool prevBlank);
 
-  void candidatesStore(
-      std::vector<LexiconFreeDecoderState>& nextHyp,
-      const bool isSort);
+  void candidatesStore(const bool isSort);
 
   int mergeCandidates(const int size);
 };
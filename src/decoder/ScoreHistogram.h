@@ -0,0 +1,173 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace w2l {
+
+const int kHistogramBins = 256;
+const float kBeamRelaxFactor = 1.25; // Per frame, after capping candidates
+
+/**
+ * ScoreHistogram counts scores in kHistogramBins equal bins spanning
+ * [bestScore - beamThreshold, bestScore], bin 0 holding the best scores.
+ * Scores out of the range are clamped into the first or the last bin. It is
+ * used to find a pruning threshold in one pass over the candidates, instead of
+ * partially sorting them.
+ */
+class ScoreHistogram {
+ public:
+  ScoreHistogram() : counts_(kHistogramBins) {}
+
+  void reset(float bestScore, float beamThreshold) {
+    bestScore_ = bestScore;
+    binWidth_ = beamThreshold / kHistogramBins;
+    std::fill(counts_.begin(), counts_.end(), 0);
+  }
+
+  int bin(float score) const {
+    int b = static_cast<int>((bestScore_ - score) / binWidth_);
+    return std::min(std::max(b, 0), kHistogramBins - 1);
+  }
+
+  void add(float score) {
+    counts_[bin(score)]++;
+  }
+
+  /**
+   * Return the first bin b such that the bins [0, b] hold at least `size`
+   * scores (the last bin if there are fewer scores), and set `nAbove` to the
+   * number of scores in [0, b).
+   */
+  int boundary(int size, int& nAbove) const {
+    nAbove = 0;
+    for (int b = 0; b < kHistogramBins - 1; b++) {
+      if (nAbove + counts_[b] >= size) {
+        return b;
+      }
+      nAbove += counts_[b];
+    }
+    return kHistogramBins - 1;
+  }
+
+  /* Beam threshold keeping the bins [0, b] */
+  float threshold(int b) const {
+    return (b + 1) * binWidth_;
+  }
+
+ private:
+  std::vector<int> counts_;
+  float bestScore_;
+  float binWidth_;
+};
+
+/**
+ * Move the `beamSize` best of the `size` candidates to the front of
+ * `candidatePtrs` (in no particular order) and return their number. This
+ * selects the same candidates as std::nth_element in storeTopCandidates():
+ * candidates are placed in a histogram with one pass, only the bin straddling
+ * the beam size is partially sorted.
+ */
+template <class DecoderState>
+int histogramSelect(
+    ScoreHistogram& histogram,
+    std::vector<DecoderState*>& candidatePtrs,
+    const int size,
+    const int beamSize,
+    const float bestScore,
+    const float beamThreshold) {
+  if (size <= beamSize || !std::isfinite(beamThreshold) ||
+      beamThreshold <= 0) {
+    return std::min(size, beamSize); // storeTopCandidates() does the rest
+  }
+
+  histogram.reset(bestScore, beamThreshold);
+  for (int i = 0; i < size; i++) {
+    histogram.add(candidatePtrs[i]->score_);
+  }
+  int nAbove;
+  const int boundary = histogram.boundary(beamSize, nAbove);
+
+  /* Candidates above the boundary bin first, then the boundary bin */
+  auto begin = candidatePtrs.begin();
+  auto middle = std::partition(begin, begin + size, [&](DecoderState* node) {
+    return histogram.bin(node->score_) < boundary;
+  });
+  auto end = std::partition(middle, begin + size, [&](DecoderState* node) {
+    return histogram.bin(node->score_) == boundary;
+  });
+  std::nth_element(
+      middle,
+      middle + (beamSize - nAbove),
+      end,
+      [](const DecoderState* node1, const DecoderState* node2) {
+        return node1->score_ > node2->score_;
+      });
+  return beamSize;
+}
+
+/**
+ * Tighten `beamThreshold` so that about `targetSize` of the `size` candidates
+ * remain, drop the other ones and return the new number of candidates. Used
+ * to bound the work of a frame when the candidate buffer reaches its cap. If
+ * the threshold can't free anything (tied scores, or all of them in the best
+ * bin), only the `targetSize` best candidates are kept, so that the cap is not
+ * hit again by the next candidate.
+ */
+template <class DecoderState>
+int capCandidates(
+    ScoreHistogram& histogram,
+    std::vector<DecoderState>& candidates,
+    const int size,
+    const int targetSize,
+    const float bestScore,
+    float& beamThreshold) {
+  float minScore = bestScore;
+  for (int i = 0; i < size; i++) {
+    minScore = std::min(minScore, candidates[i].score_);
+  }
+  const float range = std::min(beamThreshold, bestScore - minScore);
+  int nKept = size;
+  if (range > 0) {
+    histogram.reset(bestScore, range);
+    for (int i = 0; i < size; i++) {
+      histogram.add(candidates[i].score_);
+    }
+    int nAbove;
+    int boundary = histogram.boundary(targetSize, nAbove);
+    if (boundary > 0 && nAbove > 0) {
+      boundary--; // Stay below the target
+    }
+    beamThreshold = std::min(beamThreshold, histogram.threshold(boundary));
+
+    nKept = 0;
+    for (int i = 0; i < size; i++) {
+      if (candidates[i].score_ >= bestScore - beamThreshold) {
+        candidates[nKept++] = std::move(candidates[i]);
+      }
+    }
+  }
+
+  if (nKept == size && targetSize < size) {
+    std::nth_element(
+        candidates.begin(),
+        candidates.begin() + targetSize,
+        candidates.begin() + size,
+        [](const DecoderState& node1, const DecoderState& node2) {
+          return node1.score_ > node2.score_;
+        });
+    nKept = targetSize;
+  }
+  return nKept;
+}
+
+} // namespace w2l
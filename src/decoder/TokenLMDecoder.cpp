@@ -19,159 +19,263 @@
 
 namespace w2l {
 
-int TokenLMDecoder::mergeCandidates(const int size) {
+uint64_t TokenLMDecoder::mergeKey(const LexiconDecoderState* node) const {
+  return (uint64_t)(uint32_t)node->lmState_;
+}
+
+int TokenLMDecoder::mergeCandidates(
+    std::vector<LexiconDecoderState*>& candidatePtrs,
+    const int size,
+    CandidateMergeTable<LexiconDecoderState>& mergeTable) {
+  if (opt_.hashMerge_) {
+    return mergeTable.merge(
+        candidatePtrs,
+        size,
+        opt_.logAdd_,
+        [this](const LexiconDecoderState* node) { return mergeKey(node); });
+  }
+
   auto compareNodesShortList = [&](const LexiconDecoderState* node1,
                                    const LexiconDecoderState* node2) {
-    int lmCmp = lm_->compareState(node1->lmState_, node2->lmState_);
-    if (lmCmp != 0) {
-      return lmCmp > 0;
+    if (node1->lmState_ != node2->lmState_) {
+      return node1->lmState_ > node2->lmState_;
     } else { /* same LmState */
       return node1->score_ > node2->score_;
     }
   };
   std::sort(
-      candidatePtrs_.begin(),
-      candidatePtrs_.begin() + size,
+      candidatePtrs.begin(),
+      candidatePtrs.begin() + size,
       compareNodesShortList);
 
   int nHypAfterMerging = 1;
   for (int i = 1; i < size; i++) {
-    if (lm_->compareState(
-            candidatePtrs_[i]->lmState_,
-            candidatePtrs_[nHypAfterMerging - 1]->lmState_)) {
-      candidatePtrs_[nHypAfterMerging] = candidatePtrs_[i];
+    if (candidatePtrs[i]->lmState_ !=
+        candidatePtrs[nHypAfterMerging - 1]->lmState_) {
+      candidatePtrs[nHypAfterMerging] = candidatePtrs[i];
       nHypAfterMerging++;
     } else {
       mergeStates(
-          candidatePtrs_[nHypAfterMerging - 1],
-          candidatePtrs_[i],
-          opt_.logAdd_);
+          candidatePtrs[nHypAfterMerging - 1], candidatePtrs[i], opt_.logAdd_);
     }
   }
 
   return nHypAfterMerging;
 }
 
-void TokenLMDecoder::decodeStep(const float* emissions, int T, int N) {
-  int startFrame = nDecodedFrames_ - nPrunedFrames_;
-  // Extend hyp_ buffer
-  if (hyp_.size() < startFrame + T + 2) {
-    for (int i = hyp_.size(); i < startFrame + T + 2; i++) {
-      hyp_.emplace(i, std::vector<LexiconDecoderState>());
+template <class EmissionReader>
+void TokenLMDecoder::expandHyp(
+    const EmissionReader& emissions,
+    int t,
+    int N,
+    const LexiconDecoderState& prevHyp,
+    bool preselect,
+    LexiconCandidates& buffer) {
+  const LMStateIdx prevLmState = prevHyp.lmState_;
+  const FlatTrieNode* prevLex = lexicon_->getNode(prevHyp.lex_);
+  const int prevIdx = prevLex->idx_;
+
+  /* (1) Try children */
+  const int lastChild = prevLex->firstChild_ + prevLex->nChildren_;
+  W2L_DECODER_STATS_ADD(buffer.stats_.nTrieNodes_, prevLex->nChildren_);
+  for (int child = prevLex->firstChild_; child < lastChild; child++) {
+    const FlatTrieNode* lex = lexicon_->getNode(child);
+    int n = lex->idx_;
+    if (preselect && !tokenSelection_.contains(n)) {
+      continue;
+    }
+    float score = prevHyp.score_ + emissions(t, n);
+    if (nDecodedFrames_ + t > 0 && opt_.criterionType_ == CriterionType::ASG) {
+      score += transitions_[n * N + prevIdx];
+    }
+    if (n == sil_) {
+      score += opt_.silWeight_;
+    }
+
+    // Expanding to the child needs its LM score: it is queried at the end
+    // of the frame, if the child may give any candidate
+    bool eatToken = lex->nChildren_ > 0 &&
+        (opt_.criterionType_ != CriterionType::CTC || prevHyp.prevBlank_ ||
+         n != prevIdx);
+    bool emitUnk = lex->nLabel_ == 0 && (opt_.unkScore_ > kNegativeInfinity);
+    if (eatToken || lex->nLabel_ > 0 || emitUnk) {
+      proposalsAdd(
+          buffer,
+          prevLmState,
+          lmIndMap_.find(n)->second,
+          0,
+          child,
+          &prevHyp,
+          score,
+          n,
+          nullptr);
     }
   }
 
-  // Looping over all the frames
-  for (int t = 0; t < T; t++) {
-    candidatesReset();
-    for (const LexiconDecoderState& prevHyp : hyp_[startFrame + t]) {
-      const LMStatePtr& prevLmState = prevHyp.lmState_;
-      const TrieNode* prevLex = prevHyp.lex_;
-      const int prevIdx = prevLex->idx_;
-
-      /* (1) Try children */
-      for (auto& child : prevLex->children_) {
-        int n = child.first;
-        const TrieNodePtr& lex = child.second;
-        float score = prevHyp.score_ + emissions[t * N + n];
-        if (nDecodedFrames_ + t > 0 &&
-            opt_.criterionType_ == CriterionType::ASG) {
-          score += transitions_[n * N + prevIdx];
-        }
-        if (n == sil_) {
-          score += opt_.silWeight_;
-        }
-
-        int lmIdx = lmIndMap_.find(n)->second;
-        float lmScore = 0;
-        const LMStatePtr newLmState = lm_->score(prevLmState, lmIdx, lmScore);
-        score += lmScore * opt_.lmWeight_;
-
-        // We eat-up a new token
-        if (opt_.criterionType_ != CriterionType::CTC || prevHyp.prevBlank_ ||
-            n != prevIdx) {
-          if (!lex->children_.empty()) {
-            candidatesAdd(
-                newLmState,
-                lex.get(),
-                &prevHyp,
-                score,
-                n,
-                nullptr,
-                false // prevBlank
-            );
-          }
-        }
-
-        // If we got a true word
-        for (int i = 0; i < lex->nLabel_; i++) {
-          candidatesAdd(
-              newLmState,
-              lexicon_->getRoot().get(),
-              &prevHyp,
-              score + opt_.wordScore_,
-              n,
-              lex->label_[i].get(),
-              false // prevBlank
-          );
-        }
-
-        // If we got an unknown word and we want to emit
-        if (lex->nLabel_ == 0 && (opt_.unkScore_ > kNegativeInfinity)) {
-          candidatesAdd(
-              newLmState,
-              lexicon_->getRoot().get(),
-              &prevHyp,
-              score + opt_.unkScore_,
-              n,
-              unk_.get(),
-              false // prevBlank
-          );
-        }
-      }
+  /* (2) Try same lexicon node */
+  if (opt_.criterionType_ != CriterionType::CTC || !prevHyp.prevBlank_) {
+    int n = prevIdx;
+    float score = prevHyp.score_ + emissions(t, n);
+    if (nDecodedFrames_ + t > 0 && opt_.criterionType_ == CriterionType::ASG) {
+      score += transitions_[n * N + prevIdx];
+    }
+    if (n == sil_) {
+      score += opt_.silWeight_;
+    }
 
-      /* (2) Try same lexicon node */
-      if (opt_.criterionType_ != CriterionType::CTC || !prevHyp.prevBlank_) {
-        int n = prevIdx;
-        float score = prevHyp.score_ + emissions[t * N + n];
-        if (nDecodedFrames_ + t > 0 &&
-            opt_.criterionType_ == CriterionType::ASG) {
-          score += transitions_[n * N + prevIdx];
-        }
-        if (n == sil_) {
-          score += opt_.silWeight_;
-        }
+    candidatesAdd(
+        buffer,
+        prevLmState,
+        prevHyp.lex_,
+        &prevHyp,
+        score,
+        n,
+        nullptr,
+        false // prevBlank
+    );
+  }
 
-        candidatesAdd(
-            prevLmState,
-            prevLex,
-            &prevHyp,
-            score,
-            n,
-            nullptr,
-            false // prevBlank
-        );
-      }
+  /* (3) CTC only, try blank */
+  if (opt_.criterionType_ == CriterionType::CTC) {
+    int n = blank_;
+    float score = prevHyp.score_ + emissions(t, n);
+    candidatesAdd(
+        buffer,
+        prevLmState,
+        prevHyp.lex_,
+        &prevHyp,
+        score,
+        n,
+        nullptr,
+        true // prevBlank
+    );
+  }
+}
+
+void TokenLMDecoder::storeProposals(LexiconCandidates& buffer) {
+  for (int p = 0; p < buffer.proposals_.size(); p++) {
+    const LexiconDecoderState& proposal = buffer.proposals_[p];
+    const FlatTrieNode* lex = lexicon_->getNode(proposal.lex_);
+    const LexiconDecoderState& prevHyp = *proposal.parent_;
+    const int prevIdx = lexicon_->getNode(prevHyp.lex_)->idx_;
+    const int n = proposal.token_;
+    const float lmScore = buffer.proposalLmScores_[p];
+    const float score = proposal.score_ + lmScore * opt_.lmWeight_;
 
-      /* (3) CTC only, try blank */
-      if (opt_.criterionType_ == CriterionType::CTC) {
-        int n = blank_;
-        float score = prevHyp.score_ + emissions[t * N + n];
+    // We eat-up a new token
+    if (opt_.criterionType_ != CriterionType::CTC || prevHyp.prevBlank_ ||
+        n != prevIdx) {
+      if (lex->nChildren_ > 0) {
         candidatesAdd(
-            prevLmState,
-            prevLex,
+            buffer,
+            proposal.lmState_,
+            proposal.lex_,
             &prevHyp,
             score,
             n,
             nullptr,
-            true // prevBlank
-        );
+            false, // prevBlank
+            lmScore);
       }
     }
 
-    candidatesStore(hyp_[startFrame + t + 1], false);
+    // If we got a true word
+    for (int i = 0; i < lex->nLabel_; i++) {
+      candidatesAdd(
+          buffer,
+          proposal.lmState_,
+          lexicon_->getRoot(),
+          &prevHyp,
+          score + opt_.wordScore_,
+          n,
+          lexicon_->getLabel(lex, i),
+          false, // prevBlank
+          lmScore);
+    }
+
+    // If we got an unknown word and we want to emit
+    if (lex->nLabel_ == 0 && (opt_.unkScore_ > kNegativeInfinity)) {
+      candidatesAdd(
+          buffer,
+          proposal.lmState_,
+          lexicon_->getRoot(),
+          &prevHyp,
+          score + opt_.unkScore_,
+          n,
+          unk_.get(),
+          false, // prevBlank
+          lmScore);
+    }
+  }
+}
+
+template <class EmissionReader>
+bool TokenLMDecoder::expandFrameAt(
+    const EmissionReader& emissions,
+    int t,
+    int N) {
+  if (isBlankFrame(emissions, t, N)) {
+    decodeBlankFrame(emissions, t);
+    return false;
+  }
+  W2L_DECODER_STATS_TIC(statsTimer_);
+  const LexiconDecoderState* prevHyps = hyp_.frame(0);
+  const int nHyp = hyp_.frameSize(0);
+  candidatesReset(nHyp);
+  const bool preselect = opt_.tokenTopK_ > 0 || opt_.tokenThreshold_ > 0;
+  if (preselect) {
+    tokenSelection_.select(
+        emissions, t, N, opt_.tokenTopK_, opt_.tokenThreshold_);
+  }
+
+  /* (1)-(3) Expand each hypothesis, the expanded tokens of the frame are
+   * then (4) scored at once */
+  expandFrame(nHyp, [&](LexiconCandidates& buffer, int h) {
+    expandHyp(emissions, t, N, prevHyps[h], preselect, buffer);
+  });
+  W2L_DECODER_STATS_TOC(statsTimer_, stats_.expandTime_);
+  return true;
+}
+
+template <class EmissionReader>
+void TokenLMDecoder::decodeFrames(
+    const EmissionReader& emissions,
+    int T,
+    int N) {
+  for (int t = 0; t < T; t++) {
+    if (expandFrameAt(emissions, t, N)) {
+      proposalsScore();
+      storeFrame();
+    }
   }
   nDecodedFrames_ += T;
+  W2L_DECODER_STATS_ADD(stats_.nFrames_, T);
+}
+
+bool TokenLMDecoder::expandStep(const EmissionMatrix& emissions) {
+  switch (emissions.type_) {
+    case EmissionType::FLOAT32:
+      return expandFrameAt(FloatEmissionReader(emissions), 0, emissions.N_);
+    case EmissionType::FLOAT16:
+      return expandFrameAt(HalfEmissionReader(emissions), 0, emissions.N_);
+    case EmissionType::INT8:
+      return expandFrameAt(Int8EmissionReader(emissions), 0, emissions.N_);
+  }
+  return false;
+}
+
+void TokenLMDecoder::decodeStep(const EmissionMatrix& emissions) {
+  switch (emissions.type_) {
+    case EmissionType::FLOAT32:
+      decodeFrames(FloatEmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+    case EmissionType::FLOAT16:
+      decodeFrames(HalfEmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+    case EmissionType::INT8:
+      decodeFrames(Int8EmissionReader(emissions), emissions.T_, emissions.N_);
+      break;
+  }
 }
 
 } // namespace w2l
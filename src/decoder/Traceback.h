@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Utils.h"
+
+namespace w2l {
+
+/* What is left of a hypothesis once its frame is decoded */
+struct TracebackRecord {
+  int parent_; // Record of the parent hypothesis (-1 for none)
+  int token_; // Label of token
+  int word_; // Label of word (-1 if incomplete)
+};
+
+/**
+ * Traceback keeps the back-pointers of the hypothesis of each decoded frame,
+ * as one small record per hypothesis in a flat arena, frame after frame. The
+ * paths are followed through the records, so that a decoder only keeps the
+ * (much larger) states of the frame it expands: their LM states, trie nodes
+ * and scores are dropped as soon as the next frame is stored.
+ *
+ * Most of the records end up in no path of the last frame; compact() drops
+ * them, so that the records grow with the paths kept instead of with the
+ * frames times the beam size.
+ */
+class Traceback {
+ public:
+  Traceback() : nLiveRecords_(0) {}
+
+  /* Drop all the frames, but keep the memory for reuse */
+  void clear() {
+    records_.clear();
+    frames_.clear();
+    nLiveRecords_ = 0;
+  }
+
+  /* Number of records, live or not */
+  int nRecords() const {
+    return records_.size();
+  }
+
+  /* Number of records kept by the last compact() */
+  int nLiveRecords() const {
+    return nLiveRecords_;
+  }
+
+  /* Number of frames in the traceback */
+  int nFrames() const {
+    return frames_.size();
+  }
+
+  /* Index of the first record of frame i */
+  int frame(int i) const {
+    return frames_[i];
+  }
+
+  /**
+   * Append a frame of `size` states. The parent of a state, if any, is one of
+   * `prevStates`, the states of the previous frame.
+   */
+  template <class DecoderState>
+  void append(
+      const DecoderState* states,
+      int size,
+      const DecoderState* prevStates) {
+    const int prevFrame = frames_.empty() ? 0 : frames_.back();
+    frames_.push_back(records_.size());
+    for (int i = 0; i < size; i++) {
+      const DecoderState& state = states[i];
+      const int parent = state.parent_
+          ? prevFrame + static_cast<int>(state.parent_ - prevStates)
+          : -1;
+      TracebackRecord record{parent, state.token_, state.getWord()};
+      records_.push_back(record);
+    }
+  }
+
+  /**
+   * Drop the first `n` frames. The remaining frames are renumbered from 0,
+   * and the records of the new first frame lose their parent.
+   */
+  void dropFront(int n) {
+    const int offset = frames_[n];
+    records_.erase(records_.begin(), records_.begin() + offset);
+    frames_.erase(frames_.begin(), frames_.begin() + n);
+    for (auto& frame : frames_) {
+      frame -= offset;
+    }
+    for (auto& record : records_) {
+      record.parent_ = record.parent_ >= offset ? record.parent_ - offset : -1;
+    }
+    nLiveRecords_ = std::max(nLiveRecords_ - offset, 0);
+  }
+
+  /**
+   * Drop the records which are in the path of no record of the last frame.
+   * The records of the last frame are all kept, in the same order.
+   */
+  void compact() {
+    if (frames_.empty()) {
+      return;
+    }
+
+    /* (1) Mark the records in the path of the last frame */
+    recordMap_.assign(records_.size(), -1);
+    for (int r = frames_.back(); r < records_.size(); r++) {
+      for (int p = r; p >= 0 && recordMap_[p] < 0; p = records_[p].parent_) {
+        recordMap_[p] = 0;
+      }
+    }
+
+    /* (2) Move them to the front, a record comes after its parent */
+    int nRecords = 0;
+    int frame = 0;
+    for (int r = 0; r < records_.size(); r++) {
+      while (frame < frames_.size() && frames_[frame] == r) {
+        frames_[frame++] = nRecords;
+      }
+      if (recordMap_[r] < 0) {
+        continue;
+      }
+      recordMap_[r] = nRecords;
+      records_[nRecords] = records_[r];
+      if (records_[nRecords].parent_ >= 0) {
+        records_[nRecords].parent_ = recordMap_[records_[nRecords].parent_];
+      }
+      nRecords++;
+    }
+    while (frame < frames_.size()) {
+      frames_[frame++] = nRecords; // Empty frames at the end
+    }
+    records_.resize(nRecords);
+    nLiveRecords_ = nRecords;
+  }
+
+  /**
+   * Path of `record` of frame `finalFrame`, as getHypothesis() does with the
+   * parent pointers of the states
+   */
+  DecodeResult getHypothesis(int record, int finalFrame, float score) const {
+    if (record < 0) {
+      return DecodeResult();
+    }
+
+    DecodeResult res(finalFrame + 1);
+    res.score_ = score;
+    for (int i = 0; record >= 0; i++) {
+      res.words_[finalFrame - i] = records_[record].word_;
+      res.tokens_[finalFrame - i] = records_[record].token_;
+      record = records_[record].parent_;
+    }
+    return res;
+  }
+
+  /**
+   * Ancestor of `record` as in findBestAncestor(): the first hypothesis at
+   * least `lookBack` frames back whose parent completed a word. lookBack is
+   * set to its distance from `record`.
+   */
+  int findAncestor(int record, int& lookBack) const {
+    int n = 0;
+    while (record >= 0 && n < lookBack) {
+      n++;
+      record = records_[record].parent_;
+    }
+
+    const int maxLookBack = lookBack + kLookBackLimit;
+    while (record >= 0) {
+      const int parent = records_[record].parent_;
+      if (parent < 0 || records_[parent].word_ >= 0) {
+        break;
+      }
+
+      n++;
+      record = parent;
+
+      if (n == maxLookBack) {
+        break;
+      }
+    }
+
+    lookBack = n;
+    return record;
+  }
+
+  /* Bytes of records currently allocated */
+  size_t bytes() const {
+    return records_.capacity() * sizeof(TracebackRecord) +
+        (frames_.capacity() + recordMap_.capacity()) * sizeof(int);
+  }
+
+ private:
+  std::vector<TracebackRecord> records_;
+  std::vector<int> frames_; // First record of each frame
+  std::vector<int> recordMap_; // Used by compact()
+  int nLiveRecords_;
+};
+
+} // namespace w2l
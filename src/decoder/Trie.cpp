@@ -9,6 +9,7 @@
 #include <glog/logging.h>
 #include <math.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <limits>
 
 #include "Trie.h"
@@ -25,18 +26,21 @@ int Trie::getNumChildren() {
   return nChildren_;
 }
 
-TrieNodePtr Trie::insert(
+/* Insert indices[begin:] under `node` */
+TrieNodePtr insertNode(
+    TrieNodePtr node,
     const std::vector<int>& indices,
+    int begin,
     const TrieLabelPtr label,
-    float score) {
-  TrieNodePtr node = root_;
-  for (int i = 0; i < indices.size(); i++) {
+    float score,
+    int nChildren) {
+  for (int i = begin; i < indices.size(); i++) {
     int idx = indices[i];
-    if (idx < 0 || idx >= nChildren_) {
+    if (idx < 0 || idx >= nChildren) {
       LOG(FATAL) << "[Trie] Invalid letter index: " << idx;
     }
     if (node->children_.find(idx) == node->children_.end()) {
-      node->children_[idx] = std::make_shared<TrieNode>(nChildren_, idx);
+      node->children_[idx] = std::make_shared<TrieNode>(nChildren, idx);
     }
     node = node->children_[idx];
   }
@@ -50,6 +54,64 @@ TrieNodePtr Trie::insert(
   return node;
 }
 
+TrieNodePtr Trie::insert(
+    const std::vector<int>& indices,
+    const TrieLabelPtr label,
+    float score) {
+  return insertNode(root_, indices, 0, label, score, nChildren_);
+}
+
+void Trie::insert(
+    const std::vector<std::vector<int>>& indices,
+    const std::vector<TrieLabelPtr>& labels,
+    const std::vector<float>& scores,
+    int nThreads) {
+  /* Partition by first index. The children of the root are created here in
+   * order of first appearance, so that the tree (and the iteration order of
+   * its hash maps) is the same as with sequential insertions. */
+  std::vector<TrieNodePtr> subtries;
+  std::unordered_map<int, int> partitionOf;
+  std::vector<std::vector<int>> partitions;
+  for (int i = 0; i < indices.size(); i++) {
+    if (indices[i].empty()) {
+      insertNode(root_, indices[i], 0, labels[i], scores[i], nChildren_);
+      continue;
+    }
+    int idx = indices[i][0];
+    if (idx < 0 || idx >= nChildren_) {
+      LOG(FATAL) << "[Trie] Invalid letter index: " << idx;
+    }
+    auto it = partitionOf.find(idx);
+    if (it == partitionOf.end()) {
+      auto& child = root_->children_[idx];
+      if (!child) {
+        child = std::make_shared<TrieNode>(nChildren_, idx);
+      }
+      it = partitionOf.emplace(idx, partitions.size()).first;
+      subtries.push_back(child);
+      partitions.emplace_back();
+    }
+    partitions[it->second].push_back(i);
+  }
+
+  /* Largest subtries first, to balance the threads */
+  std::vector<int> order(partitions.size());
+  for (int i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return partitions[a].size() > partitions[b].size();
+  });
+
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+  for (int i = 0; i < order.size(); i++) {
+    const int p = order[i];
+    for (int j : partitions[p]) {
+      insertNode(subtries[p], indices[j], 1, labels[j], scores[j], nChildren_);
+    }
+  }
+}
+
 TrieNodePtr Trie::search(const std::vector<int>& indices) {
   TrieNodePtr node = root_;
   for (auto idx : indices) {
@@ -78,27 +140,54 @@ double TrieLogAdd(double log_a, double log_b) {
   }
 }
 
-void smearNode(TrieNodePtr node, SmearingMode smearMode) {
+/* Score of a node from its own labels */
+void smearLabels(TrieNodePtr node) {
   node->maxScore_ = -std::numeric_limits<float>::infinity();
   for (int idx = 0; idx < node->nLabel_; idx++) {
     node->maxScore_ = TrieLogAdd(node->maxScore_, node->score_[idx]);
   }
+}
+
+/* Add the score of a smeared child to its parent */
+void smearChild(
+    TrieNodePtr node,
+    TrieNodePtr childNode,
+    SmearingMode smearMode) {
+  if (smearMode == SmearingMode::LOGADD) {
+    node->maxScore_ = TrieLogAdd(node->maxScore_, childNode->maxScore_);
+  } else if (
+      smearMode == SmearingMode::MAX &&
+      childNode->maxScore_ > node->maxScore_) {
+    node->maxScore_ = childNode->maxScore_;
+  }
+}
+
+void smearNode(TrieNodePtr node, SmearingMode smearMode) {
+  smearLabels(node);
   for (auto child : node->children_) {
     auto childNode = child.second;
     smearNode(childNode, smearMode);
-    if (smearMode == SmearingMode::LOGADD) {
-      node->maxScore_ = TrieLogAdd(node->maxScore_, childNode->maxScore_);
-    } else if (
-        smearMode == SmearingMode::MAX &&
-        childNode->maxScore_ > node->maxScore_) {
-      node->maxScore_ = childNode->maxScore_;
-    }
+    smearChild(node, childNode, smearMode);
   }
 }
 
-void Trie::smear(SmearingMode smearMode) {
-  if (smearMode != SmearingMode::NONE) {
-    smearNode(root_, smearMode);
+void Trie::smear(SmearingMode smearMode, int nThreads) {
+  if (smearMode == SmearingMode::NONE) {
+    return;
+  }
+  /* The subtries are independent, only the root is combined sequentially, in
+   * the same order as smearNode() */
+  std::vector<TrieNodePtr> subtries;
+  for (auto child : root_->children_) {
+    subtries.push_back(child.second);
+  }
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+  for (int i = 0; i < subtries.size(); i++) {
+    smearNode(subtries[i], smearMode);
+  }
+  smearLabels(root_);
+  for (auto childNode : subtries) {
+    smearChild(root_, childNode, smearMode);
   }
 }
 
@@ -83,6 +83,17 @@ class Trie {
       const TrieLabelPtr label,
       float score);
 
+  /**
+   * Insert several tokens, the same as calling insert() on each of them in
+   * order. Tokens are partitioned by their first index, and the subtries
+   * under the root are built by up to `nThreads` threads.
+   */
+  void insert(
+      const std::vector<std::vector<int>>& indices,
+      const std::vector<TrieLabelPtr>& labels,
+      const std::vector<float>& scores,
+      int nThreads);
+
   /* Get the labels for a given token */
   TrieNodePtr search(const std::vector<int>& indices);
 
@@ -93,8 +104,10 @@ class Trie {
    * will select the maximum score from all its children like "c"->"a"->"t",
    * "c"->"a"->"n", "c"->"a"->"r"->"e" and so on.
    * This process will be carry out recusively on all the nodes.
+   * The subtries under the root are smeared by up to `nThreads` threads; the
+   * result doesn't depend on it.
    */
-  void smear(const SmearingMode smear_mode);
+  void smear(const SmearingMode smear_mode, int nThreads = 1);
 
  private:
   TrieNodePtr root_;
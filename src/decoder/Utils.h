@@ -10,9 +10,11 @@
 
 #include <algorithm>
 #include <cmath>
-#include <unordered_map>
+#include <limits>
 #include <vector>
 
+#include "HypothesisArena.h"
+
 namespace w2l {
 
 const int kBufferBucketSize = 65536;
@@ -30,6 +32,23 @@ struct DecoderOptions {
   bool logAdd_; // If or not use logadd when merging hypothesis
   float silWeight_; // Silence is golden
   CriterionType criterionType_; // CTC or ASG
+  bool hashMerge_ = false; // Merge candidates with a hash table, not a sort
+  bool histogramPruning_ = false; // Select the beam with a score histogram
+  int maxCandidates_ = 0; // Tighten the threshold past this number of
+                          // candidates in a frame (0 for no cap)
+  float blankSkipThreshold_ = 0; // CTC frames with a larger blank posterior
+                                 // only extend the beam (0 to disable)
+  int tokenTopK_ = 0; // Only expand to the k best tokens of a frame
+  float tokenThreshold_ = 0; // Only expand to the tokens within this
+                             // threshold of the best one in a frame
+  int nThreads_ = 1; // Threads expanding the hypothesis of a frame
+                     // (lexicon decoders only)
+  bool lattice_ = false; // Record the words of the hypothesis in a lattice
+                         // (lexicon decoders only, see Lattice.h)
+  int maxBufferFrames_ = 0; // decode() prunes the frames older than
+                            // pruneLookBack_ whenever the decoder holds
+                            // more frames (0 to keep all the frames)
+  int pruneLookBack_ = 0; // Frames kept by these prunes
 
   DecoderOptions(
       const int beamSize,
@@ -104,7 +123,7 @@ int pruneCandidates(
 
 template <class DecoderState>
 void storeTopCandidates(
-    std::vector<DecoderState>& nextHyp,
+    HypothesisArena<DecoderState>& hypothesis,
     std::vector<DecoderState*>& candidatePtrs,
     int nValidHyp,
     const int beamSize,
@@ -128,7 +147,7 @@ void storeTopCandidates(
         compareNodes);
   }
 
-  nextHyp.resize(finalSize);
+  DecoderState* nextHyp = hypothesis.append(finalSize);
   for (int i = 0; i < finalSize; i++) {
     nextHyp[i] = std::move(*candidatePtrs[i]);
   }
@@ -157,10 +176,9 @@ DecodeResult getHypothesis(const DecoderState* node, const int finalFrame) {
 
 template <class DecoderState>
 std::vector<DecodeResult> getAllHypothesis(
-    const std::vector<DecoderState>& finalHyps,
+    const DecoderState* finalHyps,
+    const int nHyp,
     const int finalFrame) {
-  int nHyp = finalHyps.size();
-
   std::vector<DecodeResult> res(nHyp);
 
   for (int r = 0; r < nHyp; r++) {
@@ -173,15 +191,15 @@ std::vector<DecodeResult> getAllHypothesis(
 
 template <class DecoderState>
 const DecoderState* findBestAncestor(
-    const std::vector<DecoderState>& finalHyps,
+    const DecoderState* finalHyps,
+    const int nHyp,
     int& lookBack) {
-  int nHyp = finalHyps.size();
   if (nHyp == 0) {
     return nullptr;
   }
 
-  float bestScore = finalHyps.front().score_;
-  const DecoderState* bestNode = finalHyps.data();
+  float bestScore = finalHyps[0].score_;
+  const DecoderState* bestNode = finalHyps;
   for (int r = 1; r < nHyp; r++) {
     const DecoderState* node = &finalHyps[r];
     if (node->score_ > bestScore) {
@@ -215,33 +233,44 @@ const DecoderState* findBestAncestor(
   return bestNode;
 }
 
+/**
+ * Subtract the largest score of `hyps` from all of them so as to avoid
+ * underflow/overflow, and return it
+ */
+template <class DecoderState>
+float normalizeScores(DecoderState* hyps, const int nHyp) {
+  float largestScore = hyps[0].score_;
+  for (int i = 1; i < nHyp; i++) {
+    if (largestScore < hyps[i].score_) {
+      largestScore = hyps[i].score_;
+    }
+  }
+
+  for (int i = 0; i < nHyp; i++) {
+    hyps[i].score_ -= largestScore;
+  }
+  return largestScore;
+}
+
+/* Return the score subtracted from the hypothesis of the last frame */
 template <class DecoderState>
-void pruneAndNormalize(
-    std::unordered_map<int, std::vector<DecoderState>>& hypothesis,
+float pruneAndNormalize(
+    HypothesisArena<DecoderState>& hypothesis,
     const int startFrame,
     const int lookBack) {
-  // (1) Move things from back of hypothesis to front.
-  for (int i = 0; i <= lookBack; i++) {
-    std::swap(hypothesis[i], hypothesis[i + startFrame]);
-  }
+  // (1) Drop the frames before startFrame, the remaining ones are renumbered.
+  hypothesis.dropFront(startFrame);
 
   // (2) Avoid further back-tracking
-  for (DecoderState& hyp : hypothesis[0]) {
-    hyp.parent_ = nullptr;
+  DecoderState* firstHyps = hypothesis.frame(0);
+  for (int i = 0; i < hypothesis.frameSize(0); i++) {
+    firstHyps[i].parent_ = nullptr;
   }
 
   // (3) For the last frame, subtract the largest score for each hypothesis in
   // it so as to avoid underflow/overflow.
-  float largestScore = hypothesis[lookBack].front().score_;
-  for (int i = 1; i < hypothesis[lookBack].size(); i++) {
-    if (largestScore < hypothesis[lookBack][i].score_) {
-      largestScore = hypothesis[lookBack][i].score_;
-    }
-  }
-
-  for (int i = 0; i < hypothesis[lookBack].size(); i++) {
-    hypothesis[lookBack][i].score_ -= largestScore;
-  }
+  return normalizeScores(
+      hypothesis.frame(lookBack), hypothesis.frameSize(lookBack));
 }
 
 } // namespace w2l
@@ -12,7 +12,6 @@
 
 #include "LM.h"
 #include "LexiconDecoder.h"
-#include "Trie.h"
 
 namespace w2l {
 
@@ -20,7 +19,7 @@ class WordLMDecoder : public LexiconDecoder {
  public:
   WordLMDecoder(
       const DecoderOptions& opt,
-      const TriePtr lexicon,
+      const FlatTriePtr lexicon,
       const LMPtr lm,
       const int sil,
       const int blank,
@@ -28,10 +27,42 @@ class WordLMDecoder : public LexiconDecoder {
       const std::vector<float>& transitions)
       : LexiconDecoder(opt, lexicon, lm, sil, blank, unk, transitions) {}
 
-  void decodeStep(const float* emissions, int T, int N) override;
+  using Decoder::decodeStep;
+
+  void decodeStep(const EmissionMatrix& emissions) override;
 
  protected:
-  int mergeCandidates(const int size) override;
+  /* Decode T frames, reading the scores of the expanded tokens only */
+  template <class EmissionReader>
+  void decodeFrames(const EmissionReader& emissions, int T, int N);
+
+  /**
+   * Expand the hypothesis of the previous frame with frame t, return false if
+   * it is a blank frame (decoded already)
+   */
+  template <class EmissionReader>
+  bool expandFrameAt(const EmissionReader& emissions, int t, int N);
+
+  bool expandStep(const EmissionMatrix& emissions) override;
+
+  /* Expand one hypothesis of the previous frame into `buffer` */
+  template <class EmissionReader>
+  void expandHyp(
+      const EmissionReader& emissions,
+      int t,
+      int N,
+      const LexiconDecoderState& prevHyp,
+      bool preselect,
+      LexiconCandidates& buffer);
+
+  void storeProposals(LexiconCandidates& buffer) override;
+
+  int mergeCandidates(
+      std::vector<LexiconDecoderState*>& candidatePtrs,
+      const int size,
+      CandidateMergeTable<LexiconDecoderState>& mergeTable) override;
+
+  uint64_t mergeKey(const LexiconDecoderState* node) const override;
 };
 
 } // namespace w2l
@@ -0,0 +1,438 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Benchmark the decoders on the assets of DecoderTest (emissions of a random
+ * model, 3-gram LM pruned from Librispeech, 26k-word lexicon). Emissions can
+ * be scaled up synthetically by tiling the recorded frames (with optional
+ * gaussian noise), and a grid of decoder type x criterion x beam size x beam
+ * threshold is swept. For CTC, a blank column is appended to the emissions,
+ * scored as the best token of the frame.
+ *
+ * One line per configuration is printed on stdout, in CSV (with a header) or
+ * JSON lines:
+ *  - frames_per_sec, rtf: decoding speed, rtf assuming `framestride` ms of
+ *    audio per frame
+ *  - candidates_per_frame: candidates proposed per frame (DecoderStats, zero
+ *    if the decoder is built with W2L_DECODER_STATS=0)
+ *  - hyps_per_frame: hypotheses kept in the beam per frame
+ *  - lm_calls_per_frame: LM queries (score and finish) per frame
+ *  - peak_rss_kb: peak resident memory of the process while decoding
+ *  - peak_hyp_kb: peak memory of the hypothesis arena (and traceback) of the
+ *    decoder
+ *
+ * Example:
+ *   DecoderBenchmark --beamsizes=100,500 --criterions=asg --scales=1,8
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "common/Defines.h"
+#include "common/Dictionary.h"
+#include "common/Utils.h"
+#include "decoder/CachedLM.h"
+#include "decoder/FlatTrie.h"
+#include "decoder/KenLM.h"
+#include "decoder/LexiconFreeDecoder.h"
+#include "decoder/TokenLMDecoder.h"
+#include "decoder/Trie.h"
+#include "decoder/WordLMDecoder.h"
+
+DEFINE_string(decodertypes, "wrd,tkn,lexfree", "decoders to benchmark");
+DEFINE_string(criterions, "asg,ctc", "criterion types to benchmark");
+DEFINE_string(beamsizes, "100,500,2500", "beam sizes to benchmark");
+DEFINE_string(beamthresholds, "10,25,100", "beam thresholds to benchmark");
+DEFINE_string(scales, "1,4", "number of times the emissions are tiled");
+DEFINE_double(noise, 0.0, "stddev of the noise added to tiled emissions");
+DEFINE_int32(repeats, 3, "number of timed decodes per configuration");
+DEFINE_double(framestride, 10.0, "audio duration of a frame (ms)");
+DEFINE_string(benchmark_format, "csv", "output format: csv or json");
+
+using namespace w2l;
+
+namespace {
+
+/* An LM forwarding to another one, and counting the queries */
+class CountingLM : public LM {
+ public:
+  explicit CountingLM(const LMPtr& lm) : lm_(lm), nQueries_(0) {}
+
+  int index(const std::string& token) override {
+    return lm_->index(token);
+  }
+
+  LMStateIdx start(bool isNull) override {
+    return lm_->start(isNull);
+  }
+
+  LMStateIdx score(LMStateIdx inState, int tokenIdx, float& score) override {
+    nQueries_++;
+    return lm_->score(inState, tokenIdx, score);
+  }
+
+  void scoreBatch(
+      const LMStateIdx* inStates,
+      const int* tokenIdx,
+      int n,
+      LMStateIdx* outStates,
+      float* scores) override {
+    nQueries_ += n;
+    lm_->scoreBatch(inStates, tokenIdx, n, outStates, scores);
+  }
+
+  LMStateIdx finish(LMStateIdx inState, float& score) override {
+    nQueries_++;
+    return lm_->finish(inState, score);
+  }
+
+  int stateGeneration() const override {
+    return lm_->stateGeneration();
+  }
+
+  void compactStates(LMStateIdx* states, int n) override {
+    lm_->compactStates(states, n);
+  }
+
+  int nStates() const override {
+    return lm_->nStates();
+  }
+
+  LMPtr clone() const override {
+    return std::make_shared<CountingLM>(lm_->clone());
+  }
+
+  int64_t nQueries() const {
+    return nQueries_;
+  }
+
+ private:
+  LMPtr lm_;
+  int64_t nQueries_;
+};
+
+template <class T>
+std::vector<T> parseList(const std::string& list) {
+  std::vector<T> values;
+  for (const auto& item : split(',', list, true)) {
+    std::istringstream stream(item);
+    T value;
+    stream >> value;
+    values.push_back(value);
+  }
+  return values;
+}
+
+template <class T>
+std::vector<T> readBinary(const std::string& path, size_t size) {
+  std::vector<T> data(size);
+  std::ifstream stream(path, std::ios::binary | std::ios::in);
+  if (!stream.read((char*)data.data(), size * sizeof(T))) {
+    LOG(FATAL) << "[DecoderBenchmark] Failed to read " << path;
+  }
+  return data;
+}
+
+/* Tile the T x N emissions `scale` times and append a blank column if needed */
+std::vector<float> makeEmissions(
+    const std::vector<float>& recorded,
+    int T,
+    int N,
+    int scale,
+    bool addBlank,
+    std::mt19937& rng) {
+  std::normal_distribution<float> noise(0, FLAGS_noise);
+  int outN = addBlank ? N + 1 : N;
+  std::vector<float> emissions(T * scale * outN);
+  for (int t = 0; t < T * scale; t++) {
+    const float* in = recorded.data() + (t % T) * N;
+    float* out = emissions.data() + t * outN;
+    for (int n = 0; n < N; n++) {
+      out[n] = in[n] + (FLAGS_noise > 0 ? noise(rng) : 0);
+    }
+    if (addBlank) {
+      out[N] = *std::max_element(out, out + N);
+    }
+  }
+  return emissions;
+}
+
+/* Reset the peak resident memory of the process (Linux only) */
+void resetPeakMemory() {
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+}
+
+/* Peak resident memory of the process in KB, -1 if unknown */
+long peakMemory() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::stol(line.substr(6));
+    }
+  }
+  return -1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  /* Defaults matching DecoderTest, can be overridden */
+  FLAGS_replabel = 1;
+  FLAGS_lmweight = 2.0;
+  FLAGS_wordscore = 2.0;
+  FLAGS_silweight = -1.0;
+  FLAGS_smearing = "max";
+  FLAGS_lmcachesize = 0;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::string dataDir = FLAGS_datadir;
+#ifdef DECODER_TEST_DATADIR
+  if (dataDir.empty()) {
+    dataDir = DECODER_TEST_DATADIR;
+  }
+#endif
+
+  /* ===================== Load assets ===================== */
+  auto tn = readBinary<int>(pathsConcat(dataDir, "TN.bin"), 2);
+  int T = tn[0], N = tn[1];
+  auto recorded =
+      readBinary<float>(pathsConcat(dataDir, "emission.bin"), T * N);
+  auto transitions =
+      readBinary<float>(pathsConcat(dataDir, "transition.bin"), N * N);
+
+  FLAGS_criterion = kAsgCriterion; // The blank is added separately for CTC
+  auto lexicon = loadWords(pathsConcat(dataDir, "words.lst"), -1);
+  auto tokenDict = createTokenDict(pathsConcat(dataDir, "letters.lst"));
+  auto wordDict = createWordDict(lexicon);
+  if (tokenDict.indexSize() != N) {
+    LOG(FATAL) << "[DecoderBenchmark] " << tokenDict.indexSize()
+               << " tokens for emissions of size " << N
+               << ", check --replabel";
+  }
+  int silIdx = tokenDict.getIndex(kSilToken);
+
+  auto lm = std::make_shared<KenLM>(pathsConcat(dataDir, "lm.arpa"));
+  int unkIdx = lm->index(kUnkToken);
+  auto unk = std::make_shared<TrieLabel>(unkIdx, wordDict.getIndex(kUnkToken));
+
+  SmearingMode smearMode = SmearingMode::NONE;
+  if (FLAGS_smearing == "logadd") {
+    smearMode = SmearingMode::LOGADD;
+  } else if (FLAGS_smearing == "max") {
+    smearMode = SmearingMode::MAX;
+  }
+
+  /* Tries for the word LM (with unigram scores) and the token LM */
+  auto buildTrie = [&](bool wordLm) {
+    auto trie = std::make_shared<Trie>(N, silIdx);
+    auto startState = lm->start(false);
+    for (auto& it : lexicon) {
+      int lmIdx = -1;
+      float score = -1;
+      if (wordLm) {
+        lmIdx = lm->index(it.first);
+        if (lmIdx == unkIdx) {
+          continue;
+        }
+        lm->score(startState, lmIdx, score);
+      }
+      for (auto& tokens : it.second) {
+        trie->insert(
+            tokens2Tensor(tokens, tokenDict),
+            std::make_shared<TrieLabel>(lmIdx, wordDict.getIndex(it.first)),
+            score);
+      }
+    }
+    trie->smear(smearMode);
+    return std::make_shared<FlatTrie>(trie);
+  };
+  auto wordTrie = buildTrie(true);
+  auto tokenTrie = buildTrie(false);
+
+  /* Token to LM index map, including the blank */
+  std::unordered_map<int, int> lmIndMap;
+  for (int i = 0; i < N; i++) {
+    lmIndMap[i] = lm->index(tokenDict.getToken(i));
+  }
+  lmIndMap[N] = unkIdx;
+
+  LOG(INFO) << "[DecoderBenchmark] Loaded emissions [" << T << " x " << N
+            << "], " << wordTrie->getNumNodes() << " trie nodes";
+
+  /* ===================== Sweep ===================== */
+  const char* columns[] = {"decoder",
+                           "criterion",
+                           "beamsize",
+                           "beamthreshold",
+                           "frames",
+                           "time_ms",
+                           "frames_per_sec",
+                           "rtf",
+                           "candidates_per_frame",
+                           "hyps_per_frame",
+                           "lm_calls_per_frame",
+                           "peak_rss_kb",
+                           "peak_hyp_kb",
+                           "best_score"};
+  const int nColumns = sizeof(columns) / sizeof(columns[0]);
+  bool json = FLAGS_benchmark_format == "json";
+  if (!json) {
+    for (int i = 0; i < nColumns; i++) {
+      std::cout << (i ? "," : "") << columns[i];
+    }
+    std::cout << std::endl;
+  }
+  auto report = [&](const std::vector<std::string>& values) {
+    for (int i = 0; i < nColumns; i++) {
+      if (json) {
+        bool isString = i < 2;
+        std::cout << (i ? ", \"" : "{\"") << columns[i] << "\": "
+                  << (isString ? "\"" : "") << values[i]
+                  << (isString ? "\"" : "");
+      } else {
+        std::cout << (i ? "," : "") << values[i];
+      }
+    }
+    std::cout << (json ? "}" : "") << std::endl;
+  };
+
+  std::mt19937 rng(FLAGS_seed);
+  for (const auto& decoderType : split(',', FLAGS_decodertypes, true)) {
+    for (const auto& criterion : split(',', FLAGS_criterions, true)) {
+      bool ctc = criterion == "ctc";
+      int blankIdx = ctc ? N : -1;
+      int emissionN = ctc ? N + 1 : N;
+      for (int scale : parseList<int>(FLAGS_scales)) {
+        auto emissions = makeEmissions(recorded, T, N, scale, ctc, rng);
+        int nFrames = T * scale;
+        EmissionMatrix emission(emissions.data(), nFrames, emissionN);
+
+        for (int beamSize : parseList<int>(FLAGS_beamsizes)) {
+          for (float threshold : parseList<float>(FLAGS_beamthresholds)) {
+            DecoderOptions opt(
+                beamSize,
+                threshold,
+                static_cast<float>(FLAGS_lmweight),
+                static_cast<float>(FLAGS_wordscore),
+                static_cast<float>(FLAGS_unkweight),
+                FLAGS_logadd,
+                static_cast<float>(FLAGS_silweight),
+                ctc ? CriterionType::CTC : CriterionType::ASG);
+            opt.hashMerge_ = FLAGS_hashmerge;
+            opt.histogramPruning_ = FLAGS_histogrampruning;
+            opt.maxCandidates_ = FLAGS_maxcandidates;
+            opt.blankSkipThreshold_ = static_cast<float>(FLAGS_blankskip);
+            opt.tokenTopK_ = FLAGS_tokentopk;
+            opt.tokenThreshold_ = static_cast<float>(FLAGS_tokenthreshold);
+            opt.nThreads_ = FLAGS_nthread_beam;
+
+            LMPtr decoderLm = lm->clone();
+            if (FLAGS_lmcachesize > 0) {
+              decoderLm =
+                  std::make_shared<CachedLM>(decoderLm, FLAGS_lmcachesize);
+            }
+            auto countingLm = std::make_shared<CountingLM>(decoderLm);
+            std::vector<float> noTransitions;
+            const auto& trans = ctc ? noTransitions : transitions;
+
+            std::unique_ptr<Decoder> decoder;
+            if (decoderType == "wrd") {
+              decoder.reset(new WordLMDecoder(
+                  opt, wordTrie, countingLm, silIdx, blankIdx, unk, trans));
+            } else if (decoderType == "tkn") {
+              decoder.reset(new TokenLMDecoder(
+                  opt,
+                  tokenTrie,
+                  countingLm,
+                  silIdx,
+                  blankIdx,
+                  unk,
+                  trans,
+                  lmIndMap));
+            } else if (decoderType == "lexfree") {
+              decoder.reset(new LexiconFreeDecoder(
+                  opt, countingLm, silIdx, blankIdx, trans, lmIndMap));
+            } else {
+              LOG(FATAL) << "Unsupported decoder type: " << decoderType;
+            }
+
+            /* Timed runs */
+            resetPeakMemory();
+            double seconds = 0;
+            float bestScore = 0;
+            for (int r = 0; r < FLAGS_repeats; r++) {
+              auto start = std::chrono::steady_clock::now();
+              auto results = decoder->decode(emission);
+              auto end = std::chrono::steady_clock::now();
+              seconds += std::chrono::duration<double>(end - start).count();
+              bestScore = results.empty() ? 0 : results[0].score_;
+            }
+            long peakKb = peakMemory();
+            size_t peakHypBytes = decoder->peakHypothesisBytes();
+            const DecoderStats& stats = decoder->getStats();
+            double candidates =
+                static_cast<double>(stats.nCandidates_) / nFrames;
+            seconds /= std::max(FLAGS_repeats, 1);
+            double lmCalls = static_cast<double>(countingLm->nQueries()) /
+                std::max(FLAGS_repeats, 1);
+
+            /* Untimed run, one frame at a time, to count the hypotheses */
+            int64_t nHyps = 0;
+            decoder->decodeBegin();
+            for (int t = 0; t < nFrames; t++) {
+              decoder->decodeStep(emission.frames(t, 1));
+              nHyps += decoder->nHypothesis();
+            }
+            decoder->decodeEnd();
+
+            std::ostringstream cells[nColumns];
+            cells[0] << decoderType;
+            cells[1] << criterion;
+            cells[2] << beamSize;
+            cells[3] << threshold;
+            cells[4] << nFrames;
+            cells[5] << std::fixed << std::setprecision(3) << seconds * 1000;
+            cells[6] << std::fixed << std::setprecision(1)
+                     << nFrames / seconds;
+            cells[7] << std::fixed << std::setprecision(5)
+                     << seconds * 1000 / (nFrames * FLAGS_framestride);
+            cells[8] << std::fixed << std::setprecision(2) << candidates;
+            cells[9] << std::fixed << std::setprecision(2)
+                     << static_cast<double>(nHyps) / nFrames;
+            cells[10] << std::fixed << std::setprecision(2)
+                      << lmCalls / nFrames;
+            cells[11] << peakKb;
+            cells[12] << peakHypBytes / 1024;
+            cells[13] << std::fixed << std::setprecision(3) << bestScore;
+            std::vector<std::string> values;
+            for (auto& cell : cells) {
+              values.push_back(cell.str());
+            }
+            report(values);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
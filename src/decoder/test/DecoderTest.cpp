@@ -7,7 +7,9 @@
  */
 
 #include <stdlib.h>
+#include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -19,7 +21,12 @@
 #include "common/Transforms.h"
 #include "common/Utils.h"
 #include "criterion/criterion.h"
+#include "decoder/BatchDecoder.h"
+#include "decoder/CachedLM.h"
+#include "decoder/FlatTrie.h"
 #include "decoder/KenLM.h"
+#include "decoder/Lattice.h"
+#include "decoder/Traceback.h"
 #include "decoder/Trie.h"
 #include "decoder/WordLMDecoder.h"
 #include "module/module.h"
@@ -50,6 +57,77 @@ std::vector<int> tokens2Tensor(
   return ret;
 }
 
+/**
+ * An LM scoring as another one, but whose states also tell apart all the word
+ * sequences: its state pool grows with the input unless it is compacted.
+ */
+class HistoryLM : public LM {
+ public:
+  explicit HistoryLM(const LMPtr& lm) : lm_(lm), generation_(0) {}
+
+  int index(const std::string& token) override {
+    return lm_->index(token);
+  }
+
+  LMStateIdx start(bool isNull) override {
+    return states_.intern(State{lm_->start(isNull), 0});
+  }
+
+  LMStateIdx score(LMStateIdx inState, int tokenIdx, float& score) override {
+    State state = states_.get(inState);
+    state.lmState_ = lm_->score(state.lmState_, tokenIdx, score);
+    state.history_ = state.history_ * 1000003 + tokenIdx + 1;
+    return states_.intern(state);
+  }
+
+  LMStateIdx finish(LMStateIdx inState, float& score) override {
+    State state = states_.get(inState);
+    state.lmState_ = lm_->finish(state.lmState_, score);
+    return states_.intern(state);
+  }
+
+  int stateGeneration() const override {
+    return generation_;
+  }
+
+  void compactStates(LMStateIdx* states, int n) override {
+    LMStatePool<State, StateHash> liveStates;
+    for (int i = 0; i < n; i++) {
+      states[i] = liveStates.intern(states_.get(states[i]));
+    }
+    states_.swap(liveStates);
+    generation_++;
+  }
+
+  int nStates() const override {
+    return states_.size();
+  }
+
+  LMPtr clone() const override {
+    return std::make_shared<HistoryLM>(lm_->clone());
+  }
+
+ private:
+  struct State {
+    LMStateIdx lmState_; // State of the wrapped LM
+    uint64_t history_; // Hash of the words so far
+
+    bool operator==(const State& other) const {
+      return lmState_ == other.lmState_ && history_ == other.history_;
+    }
+  };
+
+  struct StateHash {
+    size_t operator()(const State& state) const {
+      return state.history_ * 31 + state.lmState_;
+    }
+  };
+
+  LMPtr lm_;
+  LMStatePool<State, StateHash> states_;
+  int generation_;
+};
+
 TEST(DecoderTest, run) {
   FLAGS_criterion = kAsgCriterion;
   FLAGS_replabel = 1;
@@ -118,6 +196,19 @@ TEST(DecoderTest, run) {
   total_score += lm_score;
   ASSERT_NEAR(total_score, -19.5123, 1e-5);
 
+  /* -------- Cached Language Model --------*/
+  auto cachedLm = std::make_shared<CachedLM>(lm->clone(), 1 << 16);
+  for (int pass = 0; pass < 2; pass++) {
+    inState = cachedLm->start(0);
+    for (int i = 0; i < sentence.size(); i++) {
+      auto word = sentence[i];
+      inState = cachedLm->score(inState, cachedLm->index(word), lm_score);
+      ASSERT_NEAR(lm_score, lmScoreTarget[i], 1e-5);
+    }
+  }
+  ASSERT_EQ(cachedLm->nMisses(), sentence.size());
+  ASSERT_EQ(cachedLm->nHits(), sentence.size());
+
   /* -------- Build Trie --------*/
   int sil_idx = tokenDict.getIndex(kSilToken);
   int blank_idx =
@@ -127,6 +218,9 @@ TEST(DecoderTest, run) {
   auto start_state = lm->start(false);
 
   // Insert words
+  std::vector<std::vector<int>> spellings;
+  std::vector<TrieLabelPtr> labels;
+  std::vector<float> scores;
   for (auto& it : lexicon) {
     std::string word = it.first;
     int lm_idx = lm->index(word);
@@ -141,6 +235,10 @@ TEST(DecoderTest, run) {
           spelling_tensor,
           std::make_shared<TrieLabel>(lm_idx, wordDict.getIndex(word)),
           score);
+      spellings.push_back(spelling_tensor);
+      labels.push_back(
+          std::make_shared<TrieLabel>(lm_idx, wordDict.getIndex(word)));
+      scores.push_back(score);
     }
   }
   LOG(INFO) << "[Decoder] Trie planted.\n";
@@ -158,6 +256,39 @@ TEST(DecoderTest, run) {
     ASSERT_NEAR(node->maxScore_, trieScoreTarget[i], 1e-5);
   }
 
+  // Flattening
+  auto flatTrie = std::make_shared<FlatTrie>(trie);
+  for (int i = 0; i < sentence.size(); i++) {
+    auto word_tensor = tokens2Tensor(sentence[i], tokenDict);
+    auto node = trie->search(word_tensor);
+    int flatNode = flatTrie->search(word_tensor);
+    ASSERT_GE(flatNode, 0);
+    ASSERT_EQ(flatTrie->getNode(flatNode)->maxScore_, node->maxScore_);
+    ASSERT_EQ(flatTrie->getNode(flatNode)->nLabel_, node->nLabel_);
+    for (int j = 0; j < node->nLabel_; j++) {
+      ASSERT_EQ(
+          flatTrie->getLabel(flatTrie->getNode(flatNode), j)->usr_,
+          node->label_[j]->usr_);
+    }
+  }
+  LOG(INFO) << "[Decoder] Trie flattened.\n";
+
+  // Building and smearing in parallel gives the same trie
+  auto parallelTrie = std::make_shared<Trie>(tokenDict.indexSize(), sil_idx);
+  parallelTrie->insert(spellings, labels, scores, 4);
+  parallelTrie->smear(SmearingMode::MAX, 4);
+  FlatTrie parallelFlatTrie(parallelTrie);
+  ASSERT_EQ(parallelFlatTrie.getNumNodes(), flatTrie->getNumNodes());
+  ASSERT_EQ(parallelFlatTrie.getNumLabels(), flatTrie->getNumLabels());
+  for (int i = 0; i < flatTrie->getNumNodes(); i++) {
+    auto node = flatTrie->getNode(i);
+    auto parallelNode = parallelFlatTrie.getNode(i);
+    ASSERT_EQ(parallelNode->idx_, node->idx_);
+    ASSERT_EQ(parallelNode->nChildren_, node->nChildren_);
+    ASSERT_EQ(parallelNode->nLabel_, node->nLabel_);
+    ASSERT_EQ(parallelNode->maxScore_, node->maxScore_);
+  }
+
   /* -------- Build Decoder --------*/
   DecoderOptions decoder_opt(
       2500, // FLAGS_beamsize
@@ -172,7 +303,7 @@ TEST(DecoderTest, run) {
   std::shared_ptr<TrieLabel> unk =
       std::make_shared<TrieLabel>(unk_idx, wordDict.getIndex(kUnkToken));
   WordLMDecoder decoder(
-      decoder_opt, trie, lm, sil_idx, blank_idx, unk, transitions);
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
   LOG(INFO) << "[Decoder] Decoder constructed.\n";
 
   /* -------- Run --------*/
@@ -196,6 +327,444 @@ TEST(DecoderTest, run) {
   for (int i = 0; i < 5; i++) {
     ASSERT_NEAR(results[i].score_, hypScoreTarget[i], 1e-3);
   }
+
+#if W2L_DECODER_STATS
+  const DecoderStats& stats = decoder.getStats();
+  ASSERT_EQ(stats.nFrames_, T);
+  ASSERT_GT(stats.nLmCalls_, 0);
+  ASSERT_GE(
+      stats.nCandidates_,
+      stats.nRejected_ + stats.nPruned_ + stats.nMerged_ + n_hyp);
+#endif
+
+  /* -------- Run with hash-based merging --------*/
+  decoder_opt.hashMerge_ = true;
+  WordLMDecoder hashDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto hashResults = hashDecoder.decode(emission.data(), T, N);
+
+  ASSERT_EQ(hashResults.size(), n_hyp);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(hashResults[i].score_, results[i].score_);
+  }
+
+  /* -------- Run with histogram pruning --------*/
+  decoder_opt.histogramPruning_ = true;
+  WordLMDecoder histogramDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto histogramResults = histogramDecoder.decode(emission.data(), T, N);
+
+  ASSERT_EQ(histogramResults.size(), n_hyp);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_NEAR(histogramResults[i].score_, results[i].score_, 1e-3);
+  }
+
+  /* -------- Run with capped candidates --------*/
+  decoder_opt.histogramPruning_ = false;
+  decoder_opt.maxCandidates_ = 2500;
+  WordLMDecoder cappedDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto cappedResults = cappedDecoder.decode(emission.data(), T, N);
+  decoder_opt.maxCandidates_ = 0;
+
+  ASSERT_GT(cappedResults.size(), 0);
+  ASSERT_NEAR(cappedResults[0].score_, results[0].score_, 1.0);
+#if W2L_DECODER_STATS
+  ASSERT_GT(cappedDecoder.getStats().nCapHits_, 0);
+  ASSERT_LE(cappedDecoder.getStats().maxBufferSize_, 2500);
+#endif
+
+  /* -------- Run with the best tokens of each frame only --------*/
+  // About half of the tokens of each frame are skipped, but not the ones of
+  // the best hypothesis
+  decoder_opt.tokenTopK_ = 15;
+  decoder_opt.tokenThreshold_ = 5;
+  WordLMDecoder topKDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto topKResults = topKDecoder.decode(emission.data(), T, N);
+  decoder_opt.tokenTopK_ = 0;
+  decoder_opt.tokenThreshold_ = 0;
+
+  ASSERT_GT(topKResults.size(), 0);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_NEAR(topKResults[i].score_, hypScoreTarget[i], 1e-3);
+  }
+  ASSERT_EQ(topKResults[0].words_, results[0].words_);
+  ASSERT_EQ(topKResults[0].tokens_, results[0].tokens_);
+#if W2L_DECODER_STATS
+  ASSERT_LT(
+      topKDecoder.getStats().nCandidates_, decoder.getStats().nCandidates_);
+#endif
+
+  /* -------- Run with the beam expanded by several threads --------*/
+  decoder_opt.nThreads_ = 4;
+  WordLMDecoder parallelDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto parallelResults = parallelDecoder.decode(emission.data(), T, N);
+
+  ASSERT_EQ(parallelResults.size(), n_hyp);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_NEAR(parallelResults[i].score_, results[i].score_, 1e-3);
+  }
+
+  /* -------- Run with a lattice --------*/
+  decoder_opt.nThreads_ = 1;
+  decoder_opt.lattice_ = true;
+  WordLMDecoder latticeDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto latticeResults = latticeDecoder.decode(emission.data(), T, N);
+  std::stringstream latticeStream;
+  saveLattice(latticeStream, latticeDecoder.getLattice());
+  Lattice lattice;
+  ASSERT_TRUE(loadLattice(latticeStream, lattice));
+
+  ASSERT_EQ(lattice.nFrames_, T);
+  ASSERT_EQ(lattice.ends_.size(), n_hyp);
+  // The arcs of the paths which left the beam are dropped while decoding
+  ASSERT_LE(
+      latticeDecoder.nLatticeArcs(),
+      kLatticeCompactBeams * decoder_opt.beamSize_);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_NEAR(latticeResults[i].score_, results[i].score_, 1e-3);
+    ASSERT_NEAR(lattice.score(i), results[i].score_, 1e-3);
+    std::vector<int> words;
+    for (int word : results[i].words_) {
+      if (word >= 0) {
+        words.push_back(word);
+      }
+    }
+    ASSERT_EQ(lattice.words(i), words);
+  }
+
+  // Rescoring with the same LM gives the same paths
+  std::vector<int> lmIndices(wordDict.indexSize());
+  for (int i = 0; i < lmIndices.size(); i++) {
+    lmIndices[i] = lm->index(wordDict.getToken(i));
+  }
+  Lattice rescored = lattice;
+  rescoreLattice(rescored, lm->clone(), lmIndices, decoder_opt.lmWeight_);
+  ASSERT_NEAR(rescored.score(0), results[0].score_, 1e-3);
+  ASSERT_EQ(rescored.words(0), lattice.words(0));
+  decoder_opt.lattice_ = false;
+
+  /* -------- Run several streams in lock step --------*/
+  // The streams start one after the other, and the LM state pool is small
+  // enough to be compacted while they overlap
+  BatchDecoder batchDecoder(
+      lm,
+      [&](const LMPtr& streamLm) {
+        return std::unique_ptr<LexiconDecoder>(new WordLMDecoder(
+            decoder_opt,
+            flatTrie,
+            streamLm,
+            sil_idx,
+            blank_idx,
+            unk,
+            transitions));
+      },
+      100);
+  const int batchGeneration = lm->stateGeneration();
+  std::vector<int> chunkSizes{1, 10, 37};
+  std::vector<int> streamStarts{0, 20, 40};
+  std::vector<Decoder*> streams;
+  for (int i = 0; i < chunkSizes.size(); i++) {
+    streams.push_back(batchDecoder.addStream());
+  }
+  for (int s = 0; s < T + streamStarts.back(); s++) {
+    for (int i = 0; i < chunkSizes.size(); i++) {
+      const int t = s - streamStarts[i];
+      if (t == 0) {
+        streams[i]->decodeBegin();
+      }
+      if (t >= 0 && t < T && t % chunkSizes[i] == 0) {
+        const int size = std::min(chunkSizes[i], T - t);
+        streams[i]->decodeStep(emission.data() + t * N, size, N);
+      }
+    }
+    batchDecoder.run();
+  }
+  ASSERT_GT(lm->stateGeneration(), batchGeneration);
+  for (auto stream : streams) {
+    stream->decodeEnd();
+    auto streamResults = stream->getAllFinalHypothesis();
+    ASSERT_EQ(streamResults.size(), n_hyp);
+    for (int i = 0; i < 5; i++) {
+      ASSERT_NEAR(streamResults[i].score_, results[i].score_, 1e-3);
+    }
+  }
+
+  // The options of a stream are the ones of its decoder
+  DecoderOptions streamOpt = decoder_opt;
+  streamOpt.beamSize_ = 10;
+  streams[0]->setOptions(streamOpt);
+  auto narrowResults = streams[0]->decode(emission.data(), T, N);
+  ASSERT_GT(narrowResults.size(), 0);
+  ASSERT_LE(narrowResults.size(), 10);
+  streams[0]->setOptions(decoder_opt);
+  ASSERT_EQ(streams[0]->decode(emission.data(), T, N).size(), n_hyp);
+
+  /* -------- Run in bounded memory --------*/
+  decoder_opt.maxBufferFrames_ = 40;
+  decoder_opt.pruneLookBack_ = 20;
+  WordLMDecoder boundedDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, blank_idx, unk, transitions);
+  auto boundedResults = boundedDecoder.decode(emission.data(), T, N);
+  decoder_opt.maxBufferFrames_ = 0;
+
+  ASSERT_EQ(boundedResults.size(), n_hyp);
+  ASSERT_EQ(boundedResults[0].tokens_.size(), results[0].tokens_.size());
+  ASSERT_EQ(boundedResults[0].words_.size(), results[0].words_.size());
+  ASSERT_NEAR(boundedResults[0].score_, results[0].score_, 1e-3);
+
+  /* -------- Run in bounded memory over a long input --------*/
+  // The emissions are repeated, and each word sequence has its own LM state:
+  // once pruned, the LM state pool only holds the states of the live
+  // hypothesis, so it does not grow with the input
+  const int nRepeats = 8;
+  const int longT = nRepeats * T;
+  std::vector<float> longEmission;
+  for (int i = 0; i < nRepeats; i++) {
+    longEmission.insert(longEmission.end(), emission.begin(), emission.end());
+  }
+  EmissionMatrix longMatrix(longEmission.data(), longT, N);
+  auto historyLm = std::make_shared<HistoryLM>(lm->clone());
+  WordLMDecoder longDecoder(
+      decoder_opt, flatTrie, historyLm, sil_idx, blank_idx, unk, transitions);
+  std::vector<int> peakLmStates(nRepeats, 0);
+  longDecoder.decodeBegin();
+  for (int t = 0; t < longT; t += 10) {
+    longDecoder.decodeStep(longMatrix.frames(t, std::min(10, longT - t)));
+    peakLmStates[t / T] = std::max(peakLmStates[t / T], historyLm->nStates());
+    if (longDecoder.nDecodedFramesInBuffer() > 40) {
+      longDecoder.prune(20);
+      ASSERT_LE(historyLm->nStates(), longDecoder.nHypothesis());
+    }
+  }
+  longDecoder.decodeEnd();
+  ASSERT_GT(longDecoder.getAllFinalHypothesis().size(), 0);
+  ASSERT_LE(peakLmStates[nRepeats - 1], 2 * peakLmStates[0]);
+
+  /* -------- Run with CTC, skipping the blank frames --------*/
+  // A blank token is added after the other ones, and each frame is followed
+  // by a frame of blank
+  const int ctcN = N + 1;
+  const int ctcBlank = N;
+  std::vector<float> ctcEmission(2 * T * ctcN, -20);
+  for (int t = 0; t < T; t++) {
+    std::copy(
+        emission.begin() + t * N,
+        emission.begin() + (t + 1) * N,
+        ctcEmission.begin() + 2 * t * ctcN);
+    ctcEmission[(2 * t + 1) * ctcN + ctcBlank] = 0;
+  }
+  decoder_opt.criterionType_ = CriterionType::CTC;
+  WordLMDecoder ctcDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, ctcBlank, unk, std::vector<float>());
+  auto ctcResults = ctcDecoder.decode(ctcEmission.data(), 2 * T, ctcN);
+
+  decoder_opt.blankSkipThreshold_ = 0.999;
+  WordLMDecoder skipDecoder(
+      decoder_opt, flatTrie, lm, sil_idx, ctcBlank, unk, std::vector<float>());
+  auto skipResults = skipDecoder.decode(ctcEmission.data(), 2 * T, ctcN);
+  decoder_opt.blankSkipThreshold_ = 0;
+  decoder_opt.criterionType_ = CriterionType::ASG;
+
+  ASSERT_GT(ctcResults.size(), 0);
+  ASSERT_GT(skipResults.size(), 0);
+  ASSERT_EQ(skipResults[0].words_, ctcResults[0].words_);
+  ASSERT_EQ(skipResults[0].tokens_, ctcResults[0].tokens_);
+  ASSERT_NEAR(skipResults[0].score_, ctcResults[0].score_, 1e-3);
+  ASSERT_EQ(ctcDecoder.getStats().nBlankFrames_, 0);
+  ASSERT_EQ(skipDecoder.getStats().nBlankFrames_, T);
+
+  /* -------- Prune while decoding --------*/
+  decoder.decodeBegin();
+  decoder.decodeStep(emission.data(), T / 2, N);
+  auto unprunedBest = decoder.getBestHypothesis();
+
+  decoder.decodeBegin();
+  decoder.decodeStep(emission.data(), T / 2, N);
+  decoder.prune(10);
+  ASSERT_LT(decoder.nDecodedFramesInBuffer(), T / 2);
+
+  // Both report the scores of the whole utterance, as without pruning
+  auto prunedBest = decoder.getBestHypothesis();
+  auto prunedResults = decoder.getAllFinalHypothesis();
+  float bestScore = prunedResults[0].score_;
+  for (const auto& result : prunedResults) {
+    bestScore = std::max(bestScore, result.score_);
+  }
+  ASSERT_NEAR(prunedBest.score_, bestScore, 1e-3);
+  ASSERT_NEAR(prunedBest.score_, unprunedBest.score_, 1e-3);
+
+  /* -------- Run as a stream --------*/
+  // As Decode with --streamchunk: the frames committed after each chunk and
+  // the final hypothesis make up the offline one
+  const int streamChunk = 10;
+  const int streamLookBack = 40;
+  EmissionMatrix streamEmission(emission.data(), T, N);
+  DecodeResult streamed;
+  decoder.decodeBegin();
+  for (int t = 0; t < T; t += streamChunk) {
+    decoder.decodeStep(
+        streamEmission.frames(t, std::min(streamChunk, T - t)));
+    auto partial = decoder.getBestHypothesis(streamLookBack);
+    decoder.pruneAndCommit(streamLookBack, partial, streamed);
+  }
+  decoder.decodeEnd();
+  auto streamFinal = decoder.getAllFinalHypothesis();
+  ASSERT_GT(streamed.tokens_.size(), 0);
+  ASSERT_EQ(streamFinal.size(), n_hyp);
+
+  streamed.words_.insert(
+      streamed.words_.end(),
+      streamFinal[0].words_.begin(),
+      streamFinal[0].words_.end());
+  streamed.tokens_.insert(
+      streamed.tokens_.end(),
+      streamFinal[0].tokens_.begin(),
+      streamFinal[0].tokens_.end());
+  ASSERT_EQ(streamed.words_, results[0].words_);
+  ASSERT_EQ(streamed.tokens_, results[0].tokens_);
+  ASSERT_NEAR(streamFinal[0].score_, results[0].score_, 1e-3);
+
+  /* -------- Run with half precision emissions --------*/
+  std::vector<uint16_t> halfEmission(emission.size());
+  for (int i = 0; i < emission.size(); i++) {
+    halfEmission[i] = floatToHalf(emission[i]);
+  }
+  auto halfResults = decoder.decode(EmissionMatrix(halfEmission.data(), T, N));
+
+  ASSERT_GT(halfResults.size(), 0);
+  ASSERT_NEAR(halfResults[0].score_, results[0].score_, 0.5);
+
+  /* -------- Run with int8 emissions --------*/
+  std::vector<int8_t> int8Emission(emission.size());
+  std::vector<float> int8Scales(T), int8Offsets(T);
+  for (int t = 0; t < T; t++) {
+    quantizeFrame(
+        emission.data() + t * N,
+        N,
+        int8Emission.data() + t * N,
+        int8Scales[t],
+        int8Offsets[t]);
+  }
+  EmissionMatrix int8Matrix(
+      int8Emission.data(), int8Scales.data(), int8Offsets.data(), T, N);
+  auto int8Results = decoder.decode(int8Matrix);
+
+  /* Same hypothesis as the float decoder on the dequantized emissions */
+  std::vector<float> dequantized(emission.size());
+  Int8EmissionReader int8Reader(int8Matrix);
+  float maxPathError = 0; // Each frame is off by at most scale / 2
+  for (int t = 0; t < T; t++) {
+    for (int n = 0; n < N; n++) {
+      dequantized[t * N + n] = int8Reader(t, n);
+    }
+    maxPathError += int8Scales[t] / 2;
+  }
+  auto dequantizedResults = decoder.decode(dequantized.data(), T, N);
+
+  ASSERT_EQ(int8Results.size(), dequantizedResults.size());
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(int8Results[i].words_, dequantizedResults[i].words_);
+    ASSERT_NEAR(int8Results[i].score_, dequantizedResults[i].score_, 1e-3);
+  }
+  ASSERT_NEAR(int8Results[0].score_, results[0].score_, maxPathError);
+}
+
+/* What Traceback reads from the states of a decoder */
+struct TracebackTestState {
+  const TracebackTestState* parent_;
+  int token_;
+  int word_;
+
+  int getWord() const {
+    return word_;
+  }
+};
+
+TEST(DecoderTest, traceback) {
+  /* -------- Append --------*/
+  // 0: r
+  // 1: a (r), b (r, word 7)
+  // 2: c (a, word 5), d (b), e (b)
+  // 3: f (d), g (d)
+  std::vector<std::vector<TracebackTestState>> frames(4);
+  frames[0] = {{nullptr, 0, -1}};
+  frames[1] = {{&frames[0][0], 1, -1}, {&frames[0][0], 2, 7}};
+  frames[2] = {
+      {&frames[1][0], 3, 5}, {&frames[1][1], 4, -1}, {&frames[1][1], 5, -1}};
+  frames[3] = {{&frames[2][1], 6, -1}, {&frames[2][1], 7, -1}};
+
+  Traceback traceback;
+  for (int f = 0; f < frames.size(); f++) {
+    traceback.append(
+        frames[f].data(),
+        frames[f].size(),
+        f > 0 ? frames[f - 1].data() : nullptr);
+  }
+  ASSERT_EQ(traceback.nFrames(), 4);
+  ASSERT_EQ(traceback.nRecords(), 8);
+  std::vector<int> frameStarts{0, 1, 3, 6};
+  for (int f = 0; f < frameStarts.size(); f++) {
+    ASSERT_EQ(traceback.frame(f), frameStarts[f]);
+  }
+
+  /* -------- Get hypothesis --------*/
+  auto hyp = traceback.getHypothesis(traceback.frame(2), 2, -1.5);
+  ASSERT_EQ(hyp.tokens_, std::vector<int>({0, 1, 3}));
+  ASSERT_EQ(hyp.words_, std::vector<int>({-1, -1, 5}));
+  ASSERT_EQ(hyp.score_, -1.5);
+  auto fHyp = traceback.getHypothesis(traceback.frame(3), 3, 0);
+  auto gHyp = traceback.getHypothesis(traceback.frame(3) + 1, 3, 0);
+  ASSERT_EQ(fHyp.tokens_, std::vector<int>({0, 2, 4, 6}));
+  ASSERT_EQ(fHyp.words_, std::vector<int>({-1, 7, -1, -1}));
+  ASSERT_EQ(gHyp.tokens_, std::vector<int>({0, 2, 4, 7}));
+  ASSERT_EQ(traceback.getHypothesis(-1, 3, 0).tokens_.size(), 0);
+
+  /* -------- Find ancestor --------*/
+  // Back to the first record whose parent completed a word
+  int lookBack = 0;
+  ASSERT_EQ(traceback.findAncestor(traceback.frame(3), lookBack), 4);
+  ASSERT_EQ(lookBack, 1);
+  // At least lookBack frames back, then up to the start
+  lookBack = 2;
+  ASSERT_EQ(traceback.findAncestor(traceback.frame(3), lookBack), 0);
+  ASSERT_EQ(lookBack, 3);
+
+  /* -------- Compact --------*/
+  // a, c and e are in no path of the last frame
+  traceback.compact();
+  ASSERT_EQ(traceback.nRecords(), 5);
+  ASSERT_EQ(traceback.nLiveRecords(), 5);
+  frameStarts = {0, 1, 2, 3};
+  for (int f = 0; f < frameStarts.size(); f++) {
+    ASSERT_EQ(traceback.frame(f), frameStarts[f]);
+  }
+  auto compactFHyp = traceback.getHypothesis(traceback.frame(3), 3, 0);
+  auto compactGHyp = traceback.getHypothesis(traceback.frame(3) + 1, 3, 0);
+  ASSERT_EQ(compactFHyp.tokens_, fHyp.tokens_);
+  ASSERT_EQ(compactFHyp.words_, fHyp.words_);
+  ASSERT_EQ(compactGHyp.tokens_, gHyp.tokens_);
+  lookBack = 0;
+  ASSERT_EQ(traceback.findAncestor(traceback.frame(3), lookBack), 2);
+  ASSERT_EQ(lookBack, 1);
+
+  /* -------- Drop front --------*/
+  // The new first frame loses its parent
+  traceback.dropFront(2);
+  ASSERT_EQ(traceback.nFrames(), 2);
+  ASSERT_EQ(traceback.nRecords(), 3);
+  ASSERT_EQ(traceback.frame(0), 0);
+  ASSERT_EQ(traceback.frame(1), 1);
+  auto droppedHyp = traceback.getHypothesis(traceback.frame(1) + 1, 1, 0);
+  ASSERT_EQ(droppedHyp.tokens_, std::vector<int>({4, 7}));
+  ASSERT_EQ(droppedHyp.words_, std::vector<int>({-1, -1}));
+
+  traceback.clear();
+  ASSERT_EQ(traceback.nFrames(), 0);
+  ASSERT_EQ(traceback.nRecords(), 0);
 }
 
 int main(int argc, char** argv) {
@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Benchmark building and smearing the trie with several threads, on the
+ * lexicon of DecoderTest (26k words) and on a synthetic lexicon of random
+ * words over the same tokens. The tries built with several threads are
+ * checked to be identical to the sequential one once flattened.
+ *
+ * One CSV line per lexicon and number of threads is printed on stdout:
+ *  - insert_ms, smear_ms: best time out of `repeats`
+ *  - speedup: insert + smear time with the first number of threads over
+ *    this one
+ *  - identical: 1 if the flattened trie is identical to the one built with
+ *    the first number of threads (1 builds sequentially)
+ *
+ * Example:
+ *   TrieBenchmark --threads=1,4,16 --synthetic_words=1000000
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "common/Defines.h"
+#include "common/Dictionary.h"
+#include "common/Utils.h"
+#include "decoder/FlatTrie.h"
+#include "decoder/Trie.h"
+
+using namespace w2l;
+
+DEFINE_string(threads, "1,2,4,8", "numbers of threads to benchmark");
+DEFINE_int32(synthetic_words, 1000000, "words of the synthetic lexicon");
+DEFINE_int32(repeats, 3, "number of timed builds per configuration");
+
+namespace {
+
+struct Spellings {
+  std::vector<std::vector<int>> indices;
+  std::vector<TrieLabelPtr> labels;
+  std::vector<float> scores;
+};
+
+std::vector<int> parseThreads(const std::string& list) {
+  std::vector<int> values;
+  for (const auto& item : split(',', list, true)) {
+    values.push_back(std::stoi(item));
+  }
+  return values;
+}
+
+bool sameFlatTrie(const FlatTrie& a, const FlatTrie& b) {
+  return a.getNumNodes() == b.getNumNodes() &&
+      a.getNumLabels() == b.getNumLabels() &&
+      !std::memcmp(
+          a.nodes(), b.nodes(), a.getNumNodes() * sizeof(FlatTrieNode)) &&
+      !std::memcmp(
+          a.labels(), b.labels(), a.getNumLabels() * sizeof(TrieLabel)) &&
+      !std::memcmp(a.scores(), b.scores(), a.getNumLabels() * sizeof(float));
+}
+
+double elapsed(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void benchmark(
+    const std::string& name,
+    const Spellings& spellings,
+    int N,
+    int silIdx,
+    SmearingMode smearMode,
+    const std::vector<int>& threads) {
+  std::shared_ptr<FlatTrie> reference;
+  double referenceTime = 0;
+  for (int nThreads : threads) {
+    double insertTime = std::numeric_limits<double>::infinity();
+    double smearTime = std::numeric_limits<double>::infinity();
+    std::shared_ptr<Trie> trie;
+    for (int r = 0; r < FLAGS_repeats; r++) {
+      trie = std::make_shared<Trie>(N, silIdx);
+      auto start = std::chrono::steady_clock::now();
+      if (nThreads == 1) {
+        for (int i = 0; i < spellings.indices.size(); i++) {
+          trie->insert(
+              spellings.indices[i], spellings.labels[i], spellings.scores[i]);
+        }
+      } else {
+        trie->insert(
+            spellings.indices, spellings.labels, spellings.scores, nThreads);
+      }
+      insertTime = std::min(insertTime, elapsed(start));
+      start = std::chrono::steady_clock::now();
+      trie->smear(smearMode, nThreads);
+      smearTime = std::min(smearTime, elapsed(start));
+    }
+
+    auto flatTrie = std::make_shared<FlatTrie>(trie);
+    if (!reference) {
+      reference = flatTrie;
+      referenceTime = insertTime + smearTime;
+    }
+    std::cout << name << "," << spellings.indices.size() << ","
+              << flatTrie->getNumNodes() << "," << nThreads << ","
+              << insertTime << "," << smearTime << ","
+              << referenceTime / (insertTime + smearTime) << ","
+              << sameFlatTrie(*reference, *flatTrie) << std::endl;
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  FLAGS_replabel = 1;
+  FLAGS_smearing = "logadd";
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::string dataDir = FLAGS_datadir;
+#ifdef DECODER_TEST_DATADIR
+  if (dataDir.empty()) {
+    dataDir = DECODER_TEST_DATADIR;
+  }
+#endif
+
+  FLAGS_criterion = kAsgCriterion;
+  auto lexicon = loadWords(pathsConcat(dataDir, "words.lst"), -1);
+  auto tokenDict = createTokenDict(pathsConcat(dataDir, "letters.lst"));
+  auto wordDict = createWordDict(lexicon);
+  const int N = tokenDict.indexSize();
+  const int silIdx = tokenDict.getIndex(kSilToken);
+
+  SmearingMode smearMode = SmearingMode::NONE;
+  if (FLAGS_smearing == "logadd") {
+    smearMode = SmearingMode::LOGADD;
+  } else if (FLAGS_smearing == "max") {
+    smearMode = SmearingMode::MAX;
+  }
+  const auto threads = parseThreads(FLAGS_threads);
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> score(-10, 0);
+
+  std::cout << "lexicon,words,nodes,threads,insert_ms,smear_ms,speedup,"
+            << "identical" << std::endl;
+
+  /* Test lexicon, with random word scores */
+  Spellings test;
+  for (auto& it : lexicon) {
+    for (auto& tokens : it.second) {
+      test.indices.push_back(tokens2Tensor(tokens, tokenDict));
+      test.labels.push_back(
+          std::make_shared<TrieLabel>(-1, wordDict.getIndex(it.first)));
+      test.scores.push_back(score(rng));
+    }
+  }
+  benchmark("test", test, N, silIdx, smearMode, threads);
+
+  /* Synthetic lexicon: random words of 4 to 12 letters, then silence */
+  Spellings synthetic;
+  std::vector<int> letters;
+  for (int i = 0; i < N; i++) {
+    if (i != silIdx) {
+      letters.push_back(i);
+    }
+  }
+  std::uniform_int_distribution<int> length(4, 12);
+  std::uniform_int_distribution<int> letter(0, letters.size() - 1);
+  for (int i = 0; i < FLAGS_synthetic_words; i++) {
+    std::vector<int> indices(length(rng));
+    for (auto& idx : indices) {
+      idx = letters[letter(rng)];
+    }
+    indices.push_back(silIdx);
+    synthetic.indices.push_back(indices);
+    synthetic.labels.push_back(std::make_shared<TrieLabel>(-1, i));
+    synthetic.scores.push_back(score(rng));
+  }
+  benchmark("synthetic", synthetic, N, silIdx, smearMode, threads);
+
+  return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "DecodeSweep.h"
+
+#include <cmath>
+#include <random>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "common/Utils.h"
+
+namespace w2l {
+
+namespace {
+
+/* Values of one swept weight */
+struct SweepParam {
+  std::vector<double> values; // Fixed value or grid
+  double lo;
+  double hi;
+  bool isRange; // `lo:hi`, random search only
+};
+
+double* fieldOf(const std::string& name, SweepConfig& config) {
+  if (name == "lmweight") {
+    return &config.lmweight;
+  } else if (name == "wordscore") {
+    return &config.wordscore;
+  } else if (name == "silweight") {
+    return &config.silweight;
+  } else if (name == "unkweight") {
+    return &config.unkweight;
+  }
+  return nullptr;
+}
+
+double parseValue(const std::string& str, const std::string& item) {
+  try {
+    size_t end;
+    double value = std::stod(str, &end);
+    if (end == str.size()) {
+      return value;
+    }
+  } catch (const std::exception&) {
+  }
+  LOG(FATAL) << "[Sweep] Invalid value '" << str << "' in: " << item;
+  return 0;
+}
+
+} // namespace
+
+std::string SweepConfig::toString() const {
+  std::ostringstream ss;
+  ss << "lmweight=" << lmweight << " wordscore=" << wordscore
+     << " silweight=" << silweight << " unkweight=" << unkweight;
+  return ss.str();
+}
+
+std::vector<SweepConfig> sweepConfigs(
+    const std::string& spec,
+    const SweepConfig& base,
+    int nRandom,
+    int64_t seed) {
+  std::vector<std::string> names;
+  std::vector<SweepParam> params;
+  for (const auto& item : split(',', spec, true)) {
+    auto nameValues = split('=', trim(item));
+    SweepConfig dummy;
+    if (nameValues.size() != 2 || !fieldOf(nameValues[0], dummy)) {
+      LOG(FATAL) << "[Sweep] Expected lmweight, wordscore, silweight or "
+                 << "unkweight=values, got: " << item;
+    }
+    for (const auto& name : names) {
+      if (name == nameValues[0]) {
+        LOG(FATAL) << "[Sweep] Weight swept twice: " << name;
+      }
+    }
+    names.push_back(nameValues[0]);
+
+    SweepParam param;
+    param.isRange = false;
+    auto bounds = split(':', nameValues[1]);
+    if (bounds.size() == 1) {
+      param.values.push_back(parseValue(bounds[0], item));
+    } else if (bounds.size() == 2 || bounds.size() == 3) {
+      param.lo = parseValue(bounds[0], item);
+      param.hi = parseValue(bounds[1], item);
+      if (!(param.lo <= param.hi)) {
+        LOG(FATAL) << "[Sweep] Empty range in: " << item;
+      }
+      if (bounds.size() == 2) {
+        param.isRange = true;
+        if (nRandom <= 0) {
+          LOG(FATAL) << "[Sweep] Range without a step in a grid search: "
+                     << item;
+        }
+      } else {
+        const double step = parseValue(bounds[2], item);
+        if (!(step > 0)) {
+          LOG(FATAL) << "[Sweep] Step should be positive in: " << item;
+        }
+        /* The values are computed from lo so that steps don't accumulate
+         * rounding errors, and hi is included up to rounding */
+        const int nSteps = std::floor((param.hi - param.lo) / step + 1e-6);
+        for (int i = 0; i <= nSteps; i++) {
+          param.values.push_back(param.lo + i * step);
+        }
+      }
+    } else {
+      LOG(FATAL) << "[Sweep] Invalid values in: " << item;
+    }
+    params.push_back(param);
+  }
+
+  std::vector<SweepConfig> configs;
+  if (nRandom > 0) {
+    std::mt19937_64 rng(seed);
+    for (int i = 0; i < nRandom; i++) {
+      SweepConfig config = base;
+      for (int p = 0; p < params.size(); p++) {
+        const SweepParam& param = params[p];
+        double* field = fieldOf(names[p], config);
+        if (param.isRange) {
+          *field =
+              std::uniform_real_distribution<double>(param.lo, param.hi)(rng);
+        } else {
+          *field = param.values[std::uniform_int_distribution<int>(
+              0, param.values.size() - 1)(rng)];
+        }
+      }
+      configs.push_back(config);
+    }
+    return configs;
+  }
+
+  /* Grid: the first weight of the spec varies slowest */
+  configs.push_back(base);
+  for (int p = 0; p < params.size(); p++) {
+    std::vector<SweepConfig> grid;
+    for (const auto& config : configs) {
+      for (double value : params[p].values) {
+        SweepConfig next = config;
+        *fieldOf(names[p], next) = value;
+        grid.push_back(next);
+      }
+    }
+    configs.swap(grid);
+  }
+  return configs;
+}
+
+} // namespace w2l
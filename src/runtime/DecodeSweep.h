@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace w2l {
+
+/**
+ * Decoder weights of one configuration of a sweep. Changing them changes
+ * neither the LM queries nor the trie, so that all the configurations of a
+ * sweep share the loaded emissions, LM, trie and LM caches.
+ */
+struct SweepConfig {
+  double lmweight;
+  double wordscore;
+  double silweight;
+  double unkweight;
+
+  /* e.g. "lmweight=1.5 wordscore=0 silweight=0 unkweight=-inf" */
+  std::string toString() const;
+};
+
+/**
+ * The configurations of a sweep over the weights of `base`. The spec is a
+ * comma-separated list of `name=values`, where name is one of lmweight,
+ * wordscore, silweight or unkweight and values is one of:
+ *  - `v`: the fixed value v;
+ *  - `lo:hi:step`: the values lo, lo + step, ..., up to hi;
+ *  - `lo:hi`: values drawn uniformly in [lo, hi] (random search only).
+ *
+ * With nRandom = 0, return the grid of all the combinations of values.
+ * Otherwise return nRandom configurations drawn at random with `seed`:
+ * `lo:hi:step` weights are drawn among their values.
+ *
+ * Example: "lmweight=0.5:3:0.5,wordscore=-2:2:1,unkweight=-inf"
+ */
+std::vector<SweepConfig> sweepConfigs(
+    const std::string& spec,
+    const SweepConfig& base,
+    int nRandom = 0,
+    int64_t seed = 0);
+
+} // namespace w2l
@@ -0,0 +1,254 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "EmissionFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "common/Defines.h"
+
+namespace w2l {
+
+static_assert(sizeof(EmissionFileHeader) == 64, "Invalid header size");
+static_assert(sizeof(EmissionFileEntry) == 16, "Invalid entry size");
+
+std::string emissionPath(
+    const std::string& dir,
+    const std::string& test,
+    const std::string& format) {
+  const std::string ext = format == "cereal" ? ".bin" : ".emis";
+  return pathsConcat(dir, cleanFilepath(test) + ext);
+}
+
+EmissionType emissionType(const std::string& format) {
+  if (format == "float32") {
+    return EmissionType::FLOAT32;
+  } else if (format == "float16") {
+    return EmissionType::FLOAT16;
+  } else if (format == "int8") {
+    return EmissionType::INT8;
+  }
+  LOG(FATAL) << "[EmissionFile] Invalid emission format: " << format;
+  return EmissionType::FLOAT32;
+}
+
+/* ===================== EmissionFileWriter ===================== */
+
+EmissionFileWriter::EmissionFileWriter(
+    const std::string& path,
+    EmissionType type)
+    : path_(path), file_(path, std::ios::binary), type_(type) {
+  if (!file_.is_open() || !file_.good()) {
+    LOG(FATAL) << "[EmissionFile] Error opening file for writing: " << path;
+  }
+  /* Placeholder, written again by close() */
+  EmissionFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  metadata_.emissionN = 0;
+}
+
+EmissionFileWriter::~EmissionFileWriter() {
+  if (file_.is_open()) {
+    LOG(ERROR) << "[EmissionFile] File not closed, it is incomplete: "
+               << path_;
+  }
+}
+
+void EmissionFileWriter::pad() {
+  const size_t position = file_.tellp();
+  const size_t padding = (kEmissionFileAlignment -
+                          position % kEmissionFileAlignment) %
+      kEmissionFileAlignment;
+  const char zeros[kEmissionFileAlignment] = {0};
+  file_.write(zeros, padding);
+}
+
+void EmissionFileWriter::add(
+    const std::vector<float>& emission,
+    int T,
+    int N,
+    const std::vector<std::string>& wordTarget,
+    const std::vector<int>& tokenTarget,
+    const std::string& sampleId) {
+  if (emission.size() != static_cast<size_t>(T) * N) {
+    LOG(FATAL) << "[EmissionFile] Invalid emission size for sample "
+               << sampleId;
+  }
+  if (!entries_.empty() && N != metadata_.emissionN) {
+    LOG(FATAL) << "[EmissionFile] All the emissions should have " << N
+               << " classes, sample " << sampleId;
+  }
+
+  pad();
+  EmissionFileEntry entry;
+  entry.offset = file_.tellp();
+  entry.emissionT = T;
+  entry.reserved = 0;
+  entries_.push_back(entry);
+
+  if (type_ == EmissionType::FLOAT16) {
+    halfBuffer_.resize(emission.size());
+    for (size_t i = 0; i < emission.size(); i++) {
+      halfBuffer_[i] = floatToHalf(emission[i]);
+    }
+    file_.write(
+        reinterpret_cast<const char*>(halfBuffer_.data()),
+        halfBuffer_.size() * sizeof(uint16_t));
+  } else if (type_ == EmissionType::INT8) {
+    int8Buffer_.resize(emission.size());
+    scales_.resize(T);
+    offsets_.resize(T);
+    for (int t = 0; t < T; t++) {
+      quantizeFrame(
+          emission.data() + t * N,
+          N,
+          int8Buffer_.data() + t * N,
+          scales_[t],
+          offsets_[t]);
+    }
+    file_.write(
+        reinterpret_cast<const char*>(scales_.data()), T * sizeof(float));
+    file_.write(
+        reinterpret_cast<const char*>(offsets_.data()), T * sizeof(float));
+    file_.write(
+        reinterpret_cast<const char*>(int8Buffer_.data()), int8Buffer_.size());
+  } else {
+    file_.write(
+        reinterpret_cast<const char*>(emission.data()),
+        emission.size() * sizeof(float));
+  }
+  if (!file_.good()) {
+    LOG(FATAL) << "[EmissionFile] Error writing file: " << path_;
+  }
+
+  metadata_.wordTargets.push_back(wordTarget);
+  metadata_.tokenTargets.push_back(tokenTarget);
+  metadata_.sampleIds.push_back(sampleId);
+  metadata_.emissionT.push_back(T);
+  metadata_.emissionN = N;
+}
+
+void EmissionFileWriter::close(
+    const std::vector<float>& transition,
+    const std::string& gflags) {
+  metadata_.transition = transition;
+  metadata_.gflags = gflags;
+
+  EmissionFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kEmissionFileMagic, sizeof(header.magic));
+  header.version = kEmissionFileVersion;
+  header.dataType = static_cast<uint32_t>(type_);
+  header.nSamples = entries_.size();
+  header.emissionN = metadata_.emissionN;
+
+  pad();
+  header.tableOffset = file_.tellp();
+  file_.write(
+      reinterpret_cast<const char*>(entries_.data()),
+      entries_.size() * sizeof(EmissionFileEntry));
+
+  header.metadataOffset = file_.tellp();
+  {
+    cereal::BinaryOutputArchive ar(file_);
+    ar(std::string(W2L_VERSION));
+    ar(metadata_);
+  }
+  header.metadataSize = static_cast<uint64_t>(file_.tellp()) -
+      header.metadataOffset;
+
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_.close();
+  if (file_.fail()) {
+    LOG(FATAL) << "[EmissionFile] Error writing file: " << path_;
+  }
+}
+
+/* ===================== EmissionFile ===================== */
+
+EmissionFile::EmissionFile(const std::string& path)
+    : path_(path), mapping_(nullptr), mappingSize_(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(FATAL) << "[EmissionFile] Error opening file: " << path;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(EmissionFileHeader)) {
+    LOG(FATAL) << "[EmissionFile] Invalid file: " << path;
+  }
+  mappingSize_ = st.st_size;
+  void* mapping = mmap(nullptr, mappingSize_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    LOG(FATAL) << "[EmissionFile] Error mapping file: " << path;
+  }
+  mapping_ = static_cast<const char*>(mapping);
+
+  header_ = reinterpret_cast<const EmissionFileHeader*>(mapping_);
+  if (std::memcmp(header_->magic, kEmissionFileMagic, sizeof(header_->magic))) {
+    LOG(FATAL) << "[EmissionFile] Not an emission file, or incomplete: "
+               << path;
+  }
+  if (header_->version != kEmissionFileVersion) {
+    LOG(FATAL) << "[EmissionFile] Unsupported version " << header_->version
+               << ": " << path;
+  }
+  if (header_->tableOffset +
+              header_->nSamples * sizeof(EmissionFileEntry) >
+          mappingSize_ ||
+      header_->metadataOffset + header_->metadataSize > mappingSize_) {
+    LOG(FATAL) << "[EmissionFile] Truncated file: " << path;
+  }
+  entries_ = reinterpret_cast<const EmissionFileEntry*>(
+      mapping_ + header_->tableOffset);
+
+  /* The metadata is small, deserialize it from a copy */
+  std::istringstream metadataStream(std::string(
+      mapping_ + header_->metadataOffset, header_->metadataSize));
+  {
+    std::string version;
+    cereal::BinaryInputArchive ar(metadataStream);
+    ar(version);
+    ar(metadata_);
+  }
+}
+
+EmissionFile::~EmissionFile() {
+  if (mapping_) {
+    munmap(const_cast<char*>(mapping_), mappingSize_);
+  }
+}
+
+EmissionMatrix EmissionFile::emission(int i) const {
+  const char* data = mapping_ + entries_[i].offset;
+  const int T = emissionT(i);
+  const int N = emissionN();
+  switch (type()) {
+    case EmissionType::FLOAT16:
+      return EmissionMatrix(reinterpret_cast<const uint16_t*>(data), T, N);
+    case EmissionType::INT8: {
+      const float* scales = reinterpret_cast<const float*>(data);
+      const float* offsets = scales + T;
+      return EmissionMatrix(
+          reinterpret_cast<const int8_t*>(offsets + T), scales, offsets, T, N);
+    }
+    default:
+      return EmissionMatrix(reinterpret_cast<const float*>(data), T, N);
+  }
+}
+
+} // namespace w2l
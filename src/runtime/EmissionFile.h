@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common/Utils.h"
+#include "decoder/Emissions.h"
+
+namespace w2l {
+
+/**
+ * Emission file: a flat, memory-mappable alternative to serializing a whole
+ * EmissionSet with cereal, for large evaluation sets.
+ *
+ *   [header][emission 0][emission 1]...[offset table][metadata]
+ *
+ * - header: EmissionFileHeader, fixed size.
+ * - emissions: T x N row-major payloads in float32, fp16 or int8, each one
+ *   aligned to kEmissionFileAlignment bytes, written one after another as they
+ *   are computed. An int8 payload starts with the T scales and T offsets of
+ *   its frames (see EmissionType::INT8).
+ * - offset table: one EmissionFileEntry per sample.
+ * - metadata: cereal serialized EmissionSet without its emissions (targets,
+ *   sample ids, transitions, gflags).
+ *
+ * The table and the metadata are written last, and the header is patched to
+ * point to them, so that a file is only valid once completely written.
+ */
+const char kEmissionFileMagic[8] = {'W', '2', 'L', 'E', 'M', 'I', 'T', '\0'};
+const uint32_t kEmissionFileVersion = 1;
+const int kEmissionFileAlignment = 64;
+
+struct EmissionFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dataType; // EmissionType
+  int32_t nSamples;
+  int32_t emissionN;
+  uint64_t tableOffset;
+  uint64_t metadataOffset;
+  uint64_t metadataSize;
+  char reserved[16];
+};
+
+struct EmissionFileEntry {
+  uint64_t offset; // Offset of the emission payload in the file
+  int32_t emissionT;
+  int32_t reserved;
+};
+
+/**
+ * Path of the emissions of dataset `test` in `dir`, for an emission format
+ * (FLAGS_emission_format): "cereal", "float32", "float16" or "int8".
+ */
+std::string emissionPath(
+    const std::string& dir,
+    const std::string& test,
+    const std::string& format);
+
+/* Payload type of the emission file formats "float32", "float16" and "int8" */
+EmissionType emissionType(const std::string& format);
+
+/**
+ * EmissionFileWriter writes an emission file incrementally: each emission is
+ * flushed to the file by add(), and only the (small) metadata is kept in
+ * memory until close().
+ */
+class EmissionFileWriter {
+ public:
+  EmissionFileWriter(const std::string& path, EmissionType type);
+
+  ~EmissionFileWriter();
+
+  void add(
+      const std::vector<float>& emission,
+      int T,
+      int N,
+      const std::vector<std::string>& wordTarget,
+      const std::vector<int>& tokenTarget,
+      const std::string& sampleId);
+
+  /* Write the offset table and the metadata. No emission can be added after */
+  void close(const std::vector<float>& transition, const std::string& gflags);
+
+ private:
+  std::string path_;
+  std::ofstream file_;
+  EmissionType type_;
+  EmissionSet metadata_;
+  std::vector<EmissionFileEntry> entries_;
+  std::vector<uint16_t> halfBuffer_;
+  std::vector<int8_t> int8Buffer_;
+  std::vector<float> scales_;
+  std::vector<float> offsets_;
+
+  void pad();
+};
+
+/**
+ * EmissionFile gives read-only access to an emission file mapped in memory.
+ * The decoders read the emissions in place, whatever their type.
+ */
+class EmissionFile {
+ public:
+  explicit EmissionFile(const std::string& path);
+
+  ~EmissionFile();
+
+  EmissionFile(const EmissionFile&) = delete;
+  EmissionFile& operator=(const EmissionFile&) = delete;
+
+  int size() const {
+    return header_->nSamples;
+  }
+
+  EmissionType type() const {
+    return static_cast<EmissionType>(header_->dataType);
+  }
+
+  /* Metadata of the samples, with no emissions */
+  const EmissionSet& metadata() const {
+    return metadata_;
+  }
+
+  int emissionT(int i) const {
+    return entries_[i].emissionT;
+  }
+
+  int emissionN() const {
+    return header_->emissionN;
+  }
+
+  /* View of the T x N emissions of sample `i` in the mapping */
+  EmissionMatrix emission(int i) const;
+
+ private:
+  std::string path_;
+  const char* mapping_;
+  size_t mappingSize_;
+  const EmissionFileHeader* header_;
+  const EmissionFileEntry* entries_;
+  EmissionSet metadata_;
+};
+
+} // namespace w2l
@@ -0,0 +1,297 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "TrieCache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "common/Defines.h"
+
+namespace w2l {
+
+static_assert(sizeof(TrieCacheHeader) == 64, "Invalid header size");
+static_assert(sizeof(FlatTrieNode) == 24, "Invalid trie node size");
+static_assert(sizeof(TrieLabel) == 8, "Invalid trie label size");
+
+namespace {
+
+const uint64_t kFnvOffset = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+/* FNV-1a, continuing from `hash` */
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = kFnvOffset) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+uint64_t align(uint64_t offset) {
+  return (offset + kTrieCacheAlignment - 1) / kTrieCacheAlignment *
+      kTrieCacheAlignment;
+}
+
+/* Offsets of the blocks of a cache, from the counts in its header */
+struct TrieCacheLayout {
+  explicit TrieCacheLayout(const TrieCacheHeader& header) {
+    nodes = align(sizeof(TrieCacheHeader));
+    labels = align(nodes + header.nNodes * sizeof(FlatTrieNode));
+    scores = align(labels + header.nLabels * sizeof(TrieLabel));
+    wordOffsets = align(scores + header.nLabels * sizeof(float));
+    words = align(wordOffsets + (header.nWords + 1) * sizeof(uint64_t));
+  }
+
+  uint64_t nodes;
+  uint64_t labels;
+  uint64_t scores;
+  uint64_t wordOffsets;
+  uint64_t words;
+};
+
+void writeAt(
+    std::ofstream& file,
+    uint64_t offset,
+    const void* data,
+    size_t size) {
+  /* Zero padding up to the aligned offset */
+  static const char kZeros[kTrieCacheAlignment] = {};
+  uint64_t pos = file.tellp();
+  file.write(kZeros, offset - pos);
+  file.write(static_cast<const char*>(data), size);
+}
+
+} // namespace
+
+uint64_t hashFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    LOG(FATAL) << "[TrieCache] Error opening file: " << path;
+  }
+  const int64_t size = file.tellg();
+  uint64_t hash = fnv1a(reinterpret_cast<const char*>(&size), sizeof(size));
+
+  std::vector<char> buffer(1 << 20);
+  auto hashRange = [&](int64_t begin, int64_t end) {
+    file.seekg(begin);
+    while (begin < end) {
+      int64_t n = std::min<int64_t>(buffer.size(), end - begin);
+      file.read(buffer.data(), n);
+      if (!file.good()) {
+        LOG(FATAL) << "[TrieCache] Error reading file: " << path;
+      }
+      hash = fnv1a(buffer.data(), n, hash);
+      begin += n;
+    }
+  };
+  hashRange(0, size);
+  return hash;
+}
+
+uint64_t hashFileStamped(
+    const std::string& path,
+    const std::string& stampPath) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    LOG(FATAL) << "[TrieCache] Error opening file: " << path;
+  }
+  const int64_t size = st.st_size;
+  const int64_t mtimeSec = st.st_mtim.tv_sec;
+  const int64_t mtimeNsec = st.st_mtim.tv_nsec;
+
+  /* The stamp: the path of the file, then its size, mtime and hash */
+  std::ifstream stampIn(stampPath);
+  std::string stampedPath;
+  int64_t stampedSize, stampedSec, stampedNsec;
+  uint64_t hash;
+  if (std::getline(stampIn, stampedPath) &&
+      stampIn >> stampedSize >> stampedSec >> stampedNsec >> hash &&
+      stampedPath == path && stampedSize == size && stampedSec == mtimeSec &&
+      stampedNsec == mtimeNsec) {
+    return hash;
+  }
+
+  LOG(INFO) << "[TrieCache] Hashing " << path;
+  hash = hashFile(path);
+  const std::string tmpPath = stampPath + ".tmp";
+  std::ofstream stampOut(tmpPath, std::ios::trunc);
+  stampOut << path << "\n"
+           << size << " " << mtimeSec << " " << mtimeNsec << " " << hash
+           << "\n";
+  stampOut.close();
+  if (stampOut.fail() || rename(tmpPath.c_str(), stampPath.c_str()) != 0) {
+    LOG(WARNING) << "[TrieCache] Error writing hash stamp: " << stampPath;
+  }
+  return hash;
+}
+
+uint64_t hashDictionary(const Dictionary& dict) {
+  uint64_t hash = kFnvOffset;
+  for (int i = 0; i < dict.indexSize(); i++) {
+    const std::string token = dict.getToken(i);
+    hash = fnv1a(token.c_str(), token.size() + 1, hash);
+    hash = fnv1a(reinterpret_cast<const char*>(&i), sizeof(i), hash);
+  }
+  return hash;
+}
+
+uint64_t hashString(const std::string& str) {
+  return fnv1a(str.data(), str.size());
+}
+
+void saveTrieCache(
+    const std::string& path,
+    const TrieCacheKey& key,
+    const FlatTrie& trie,
+    const Dictionary& wordDict) {
+  TrieCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kTrieCacheMagic, sizeof(header.magic));
+  header.version = kTrieCacheVersion;
+  header.key = key;
+  header.nNodes = trie.getNumNodes();
+  header.nLabels = trie.getNumLabels();
+  header.nWords = wordDict.indexSize();
+  TrieCacheLayout layout(header);
+
+  std::vector<uint64_t> wordOffsets{0};
+  std::string words;
+  for (int i = 0; i < header.nWords; i++) {
+    words += wordDict.getToken(i);
+    words.push_back('\0');
+    wordOffsets.push_back(words.size());
+  }
+
+  const std::string tmpPath = path + ".tmp";
+  std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!file.is_open() || !file.good()) {
+    LOG(FATAL) << "[TrieCache] Error opening file for writing: " << tmpPath;
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeAt(
+      file,
+      layout.nodes,
+      trie.nodes(),
+      header.nNodes * sizeof(FlatTrieNode));
+  writeAt(
+      file,
+      layout.labels,
+      trie.labels(),
+      header.nLabels * sizeof(TrieLabel));
+  writeAt(
+      file, layout.scores, trie.scores(), header.nLabels * sizeof(float));
+  writeAt(
+      file,
+      layout.wordOffsets,
+      wordOffsets.data(),
+      wordOffsets.size() * sizeof(uint64_t));
+  writeAt(file, layout.words, words.data(), words.size());
+  file.close();
+  if (file.fail()) {
+    LOG(FATAL) << "[TrieCache] Error writing file: " << tmpPath;
+  }
+  if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+    LOG(FATAL) << "[TrieCache] Error renaming " << tmpPath << " to " << path;
+  }
+}
+
+/* ===================== TrieCache ===================== */
+
+struct TrieCache::Mapping {
+  Mapping(const char* data, size_t size) : data(data), size(size) {}
+
+  ~Mapping() {
+    munmap(const_cast<char*>(data), size);
+  }
+
+  const char* data;
+  size_t size;
+};
+
+std::shared_ptr<TrieCache> TrieCache::load(
+    const std::string& path,
+    const TrieCacheKey& key) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(INFO) << "[TrieCache] No cache at " << path;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(TrieCacheHeader)) {
+    ::close(fd);
+    LOG(WARNING) << "[TrieCache] Invalid file: " << path;
+    return nullptr;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    LOG(WARNING) << "[TrieCache] Error mapping file: " << path;
+    return nullptr;
+  }
+  auto mapping =
+      std::make_shared<Mapping>(static_cast<const char*>(data), st.st_size);
+
+  auto header = reinterpret_cast<const TrieCacheHeader*>(mapping->data);
+  if (std::memcmp(header->magic, kTrieCacheMagic, sizeof(header->magic)) ||
+      header->version != kTrieCacheVersion) {
+    LOG(WARNING) << "[TrieCache] Not a trie cache, or another version: "
+                 << path;
+    return nullptr;
+  }
+  if (std::memcmp(&header->key, &key, sizeof(key))) {
+    LOG(INFO) << "[TrieCache] Cache built for another lexicon, LM, tokens "
+              << "or options: " << path;
+    return nullptr;
+  }
+  TrieCacheLayout layout(*header);
+  if (header->nNodes <= 0 || header->nLabels < 0 || header->nWords < 0 ||
+      layout.words > mapping->size) {
+    LOG(WARNING) << "[TrieCache] Truncated file: " << path;
+    return nullptr;
+  }
+
+  std::shared_ptr<TrieCache> cache(new TrieCache());
+  cache->mapping_ = mapping;
+  cache->header_ = header;
+  cache->wordOffsets_ =
+      reinterpret_cast<const uint64_t*>(mapping->data + layout.wordOffsets);
+  cache->words_ = mapping->data + layout.words;
+  if (layout.words + cache->wordOffsets_[header->nWords] > mapping->size) {
+    LOG(WARNING) << "[TrieCache] Truncated file: " << path;
+    return nullptr;
+  }
+  cache->trie_ = std::make_shared<FlatTrie>(
+      reinterpret_cast<const FlatTrieNode*>(mapping->data + layout.nodes),
+      header->nNodes,
+      reinterpret_cast<const TrieLabel*>(mapping->data + layout.labels),
+      reinterpret_cast<const float*>(mapping->data + layout.scores),
+      header->nLabels,
+      mapping);
+  return cache;
+}
+
+Dictionary TrieCache::wordDict() const {
+  Dictionary dict;
+  for (int i = 0; i < header_->nWords; i++) {
+    dict.addToken(words_ + wordOffsets_[i]);
+  }
+  dict.setDefaultIndex(dict.getIndex(kUnkToken));
+  return dict;
+}
+
+} // namespace w2l
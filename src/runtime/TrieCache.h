@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include "common/Dictionary.h"
+#include "decoder/FlatTrie.h"
+
+namespace w2l {
+
+/**
+ * Trie cache: the flattened, smeared trie of a lexicon and the word
+ * dictionary it refers to, built once and memory-mapped by the next runs
+ * instead of loading the lexicon and rebuilding the trie.
+ *
+ *   [header][nodes][labels][scores][word offsets][words]
+ *
+ * - header: TrieCacheHeader, fixed size.
+ * - nodes, labels, scores: the arrays of FlatTrie, in place.
+ * - word offsets: nWords + 1 uint64 offsets of the words in the next block.
+ * - words: the words of the dictionary in index order, '\0' terminated.
+ *
+ * Each block is aligned to kTrieCacheAlignment bytes. The cache is only
+ * valid for the inputs it was built from, summarized by a TrieCacheKey.
+ */
+const char kTrieCacheMagic[8] = {'W', '2', 'L', 'T', 'R', 'I', 'E', '\0'};
+const uint32_t kTrieCacheVersion = 1;
+const int kTrieCacheAlignment = 64;
+
+struct TrieCacheKey {
+  uint64_t lexicon; // Hash of the lexicon file
+  uint64_t lm; // Hash of the LM file, 0 if the trie doesn't depend on it
+  uint64_t tokens; // Hash of the token dictionary
+  uint64_t options; // Hash of the flags the trie depends on
+};
+
+struct TrieCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved0;
+  TrieCacheKey key;
+  int32_t nNodes;
+  int32_t nLabels;
+  int32_t nWords;
+  uint32_t reserved1;
+};
+
+/* Hash of the whole content of a file */
+uint64_t hashFile(const std::string& path);
+
+/**
+ * hashFile(), memoized in `stampPath` with the size and the modification time
+ * of the file, so that large files such as binary LMs are only hashed again
+ * once they change.
+ */
+uint64_t hashFileStamped(const std::string& path, const std::string& stampPath);
+
+/* Hash of the tokens of a dictionary and their indices */
+uint64_t hashDictionary(const Dictionary& dict);
+
+/* Hash of a string, e.g. the serialized options of the trie */
+uint64_t hashString(const std::string& str);
+
+/**
+ * Write a trie cache. The file is written next to `path` and renamed, so that
+ * a concurrent reader never maps an incomplete file.
+ */
+void saveTrieCache(
+    const std::string& path,
+    const TrieCacheKey& key,
+    const FlatTrie& trie,
+    const Dictionary& wordDict);
+
+/**
+ * TrieCache maps a trie cache in memory. The FlatTrie it returns reads the
+ * mapping in place and keeps it alive.
+ */
+class TrieCache {
+ public:
+  /**
+   * Map the cache at `path`. Return nullptr if it doesn't exist, is invalid or
+   * was built for another key, in which case the trie should be rebuilt.
+   */
+  static std::shared_ptr<TrieCache> load(
+      const std::string& path,
+      const TrieCacheKey& key);
+
+  FlatTriePtr trie() const {
+    return trie_;
+  }
+
+  /* The word dictionary, as created by createWordDict() */
+  Dictionary wordDict() const;
+
+ private:
+  struct Mapping;
+
+  TrieCache() = default;
+
+  std::shared_ptr<const Mapping> mapping_;
+  const TrieCacheHeader* header_;
+  const uint64_t* wordOffsets_;
+  const char* words_;
+  FlatTriePtr trie_;
+};
+
+} // namespace w2l
@@ -6,7 +6,15 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <fcntl.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <random>
 #include <unordered_map>
 
 #include <gmock/gmock.h>
@@ -15,8 +23,11 @@
 #include <flashlight/flashlight.h>
 
 #include "module/module.h"
+#include "runtime/DecodeSweep.h"
+#include "runtime/EmissionFile.h"
 #include "runtime/Serial.h"
 #include "runtime/SpeechStatMeter.h"
+#include "runtime/TrieCache.h"
 
 using namespace w2l;
 
@@ -99,6 +110,152 @@ TEST(RuntimeTest, SpeechStatMeter) {
   ASSERT_EQ(stats2[4], 2.0);
 }
 
+TEST(RuntimeTest, TrieCache) {
+  const std::string path = "/tmp/test.trie";
+  std::vector<std::string> words{"<unk>", "ab", "abc", "b", "ca"};
+  Dictionary wordDict;
+  auto trie = std::make_shared<Trie>(4, 0);
+  for (int i = 0; i < words.size(); i++) {
+    wordDict.addToken(words[i]);
+    std::vector<int> tokens;
+    for (auto c : words[i]) {
+      tokens.push_back(c - 'a' + 1);
+    }
+    if (i > 0) {
+      trie->insert(tokens, std::make_shared<TrieLabel>(i, i), -i);
+    }
+  }
+  trie->smear(SmearingMode::MAX);
+  FlatTrie flatTrie(trie);
+
+  TrieCacheKey key{1, 2, 3, 4};
+  saveTrieCache(path, key, flatTrie, wordDict);
+  auto cache = TrieCache::load(path, key);
+  ASSERT_NE(cache, nullptr);
+
+  auto cachedTrie = cache->trie();
+  ASSERT_EQ(cachedTrie->getNumNodes(), flatTrie.getNumNodes());
+  ASSERT_EQ(cachedTrie->getNumLabels(), flatTrie.getNumLabels());
+  for (int i = 0; i < flatTrie.getNumNodes(); i++) {
+    auto node = flatTrie.getNode(i);
+    auto cachedNode = cachedTrie->getNode(i);
+    ASSERT_EQ(cachedNode->idx_, node->idx_);
+    ASSERT_EQ(cachedNode->firstChild_, node->firstChild_);
+    ASSERT_EQ(cachedNode->nChildren_, node->nChildren_);
+    ASSERT_EQ(cachedNode->nLabel_, node->nLabel_);
+    ASSERT_EQ(cachedNode->maxScore_, node->maxScore_);
+    for (int j = 0; j < node->nLabel_; j++) {
+      ASSERT_EQ(
+          cachedTrie->getLabel(cachedNode, j)->usr_,
+          flatTrie.getLabel(node, j)->usr_);
+      ASSERT_EQ(
+          cachedTrie->getScore(cachedNode, j), flatTrie.getScore(node, j));
+    }
+  }
+  ASSERT_EQ(cachedTrie->search({1, 2, 3}), flatTrie.search({1, 2, 3}));
+
+  auto cachedDict = cache->wordDict();
+  ASSERT_EQ(cachedDict.indexSize(), wordDict.indexSize());
+  for (int i = 0; i < words.size(); i++) {
+    ASSERT_EQ(cachedDict.getToken(i), words[i]);
+  }
+
+  /* A cache built for other inputs is ignored */
+  key.lm = 5;
+  ASSERT_EQ(TrieCache::load(path, key), nullptr);
+
+  /* The stamped hash of a file is the one of its content, until it changes */
+  const std::string lmPath = "/tmp/test.lm";
+  const std::string stampPath = "/tmp/test.lmhash";
+  std::remove(stampPath.c_str());
+  std::ofstream(lmPath) << "abcd";
+  const uint64_t hash = hashFileStamped(lmPath, stampPath);
+  ASSERT_EQ(hash, hashFile(lmPath));
+  ASSERT_EQ(hashFileStamped(lmPath, stampPath), hash);
+  std::ofstream(lmPath) << "abce";
+  struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+  ASSERT_EQ(utimensat(AT_FDCWD, lmPath.c_str(), times, 0), 0);
+  ASSERT_NE(hashFileStamped(lmPath, stampPath), hash);
+  ASSERT_EQ(hashFileStamped(lmPath, stampPath), hashFile(lmPath));
+}
+
+TEST(RuntimeTest, EmissionFile) {
+  const std::string path = "/tmp/test.emis";
+  const int N = 30;
+  std::vector<int> sizes{17, 1, 40};
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(-5, 4);
+  std::vector<std::vector<float>> emissions;
+  {
+    EmissionFileWriter writer(path, EmissionType::INT8);
+    for (int i = 0; i < sizes.size(); i++) {
+      std::vector<float> emission(sizes[i] * N);
+      for (auto& score : emission) {
+        score = noise(rng);
+      }
+      writer.add(
+          emission,
+          sizes[i],
+          N,
+          {"word" + std::to_string(i)},
+          {i, i + 1},
+          "sample" + std::to_string(i));
+      emissions.push_back(emission);
+    }
+    writer.close({}, "");
+  }
+
+  EmissionFile file(path);
+  ASSERT_EQ(file.size(), sizes.size());
+  ASSERT_EQ(file.type(), EmissionType::INT8);
+  ASSERT_EQ(file.emissionN(), N);
+  for (int i = 0; i < sizes.size(); i++) {
+    ASSERT_EQ(file.emissionT(i), sizes[i]);
+    ASSERT_EQ(file.metadata().sampleIds[i], "sample" + std::to_string(i));
+    ASSERT_EQ(file.metadata().tokenTargets[i], std::vector<int>({i, i + 1}));
+
+    /* The error is at most 1/510 of the range of the scores of the frame */
+    Int8EmissionReader reader(file.emission(i));
+    for (int t = 0; t < sizes[i]; t++) {
+      const float* frame = emissions[i].data() + t * N;
+      const auto range = std::minmax_element(frame, frame + N);
+      const float bound = (*range.second - *range.first) / 510 * 1.01;
+      for (int n = 0; n < N; n++) {
+        ASSERT_LE(std::fabs(reader(t, n) - frame[n]), bound);
+      }
+      /* The extreme scores of the frame are (almost) exact */
+      int best = range.second - frame;
+      ASSERT_NEAR(reader(t, best), frame[best], 1e-4);
+    }
+  }
+}
+
+TEST(RuntimeTest, DecodeSweep) {
+  SweepConfig base{1.0, 0.0, 0.0, -std::numeric_limits<double>::infinity()};
+  auto grid = sweepConfigs("lmweight=0.5:2:0.5,wordscore=-1:1:1", base);
+  ASSERT_EQ(grid.size(), 12);
+  ASSERT_EQ(grid[0].lmweight, 0.5);
+  ASSERT_EQ(grid[0].wordscore, -1.0);
+  ASSERT_EQ(grid[1].wordscore, 0.0);
+  ASSERT_EQ(grid[11].lmweight, 2.0);
+  ASSERT_EQ(grid[11].wordscore, 1.0);
+  for (const auto& config : grid) {
+    ASSERT_EQ(config.silweight, base.silweight);
+    ASSERT_EQ(config.unkweight, base.unkweight);
+  }
+
+  auto random = sweepConfigs("lmweight=0.5:2,silweight=-1:0:0.5", base, 20, 1);
+  ASSERT_EQ(random.size(), 20);
+  for (const auto& config : random) {
+    ASSERT_GE(config.lmweight, 0.5);
+    ASSERT_LE(config.lmweight, 2.0);
+    ASSERT_TRUE(
+        config.silweight == -1.0 || config.silweight == -0.5 ||
+        config.silweight == 0.0);
+    ASSERT_EQ(config.wordscore, base.wordscore);
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();